@@ -17,12 +17,17 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
+
+/* Polling interval used when polling first kicks in */
+#define POLL_NS_START 4000
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
@@ -100,6 +105,40 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, fd);
+    if (node) {
+        node->io_poll = io_poll;
+    }
+    aio_notify(ctx);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "polling parameters must not be negative");
+        return;
+    }
+
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+    ctx->poll_ns = 0;
+
+    aio_notify(ctx);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -186,12 +225,95 @@ bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx, bool *have_handlers)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll) {
+            *have_handlers = true;
+            if (node->io_poll(node->opaque)) {
+                progress = true;
+            }
+        }
+    }
+
+    return progress;
+}
+
+/* Busy-poll the registered poll handlers for up to ctx->poll_ns, or until the
+ * next timer is due if that is sooner.  Returns true if a handler made
+ * progress, in which case aio_poll() must not block.
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t timeout)
+{
+    bool have_handlers = false;
+    bool progress;
+    int64_t end;
+
+    if (ctx->poll_ns == 0 || timeout == 0) {
+        return false;
+    }
+    if (timeout > 0 && timeout < ctx->poll_ns) {
+        end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + timeout;
+    } else {
+        end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + ctx->poll_ns;
+    }
+
+    ctx->walking_handlers++;
+    do {
+        progress = run_poll_handlers_once(ctx, &have_handlers);
+    } while (!progress && have_handlers &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end);
+    ctx->walking_handlers--;
+
+    if (!have_handlers) {
+        return false;
+    }
+    if (progress) {
+        ctx->poll_hits++;
+    } else {
+        ctx->poll_misses++;
+    }
+    return progress;
+}
+
+/* Tune the polling interval from the time the last blocking aio_poll() spent
+ * waiting for an event, polling included.
+ */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* The event arrived while polling, leave the interval alone */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* Polling would not have caught this one, back off */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* A little more polling would have avoided the sleep */
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = POLL_NS_START;
+        } else {
+            ctx->poll_ns *= ctx->poll_grow ? ctx->poll_grow : 2;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     bool was_dispatching;
     int ret;
     bool progress;
+    int64_t timeout;
+    int64_t start = 0;
 
     was_dispatching = ctx->dispatching;
     progress = false;
@@ -208,6 +330,18 @@ bool aio_poll(AioContext *ctx, bool blocking)
      */
     aio_set_dispatching(ctx, !blocking);
 
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    if (timeout && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (try_poll_mode(ctx, timeout)) {
+            progress = true;
+            timeout = 0;
+        } else {
+            timeout = aio_compute_timeout(ctx);
+        }
+    }
+
     ctx->walking_handlers++;
 
     g_array_set_size(ctx->pollfds, 0);
@@ -230,7 +364,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
     /* wait until next event */
     ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
                          ctx->pollfds->len,
-                         blocking ? aio_compute_timeout(ctx) : 0);
+                         timeout);
+
+    if (start) {
+        adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
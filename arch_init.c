@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
@@ -46,12 +47,20 @@
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -109,9 +118,10 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
+static void mig_throttle_guest_down(void);
+static void mig_throttle_guest_up(void);
+static void mig_throttle_stop(void);
 
 static uint64_t bitmap_sync_count;
 
@@ -126,6 +136,20 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC  0x200
+/* 0x200 is the last bit below the smallest TARGET_PAGE_SIZE (1K).  Further
+ * records use combinations of flags that never go together otherwise.
+ */
+#define RAM_SAVE_FLAG_MEM_SIZE_FIXED_RAM (RAM_SAVE_FLAG_MEM_SIZE | \
+                                          RAM_SAVE_FLAG_PAGE)
+
+QEMU_BUILD_BUG_ON((RAM_SAVE_FLAG_FULL | RAM_SAVE_FLAG_COMPRESS |
+                   RAM_SAVE_FLAG_MEM_SIZE | RAM_SAVE_FLAG_PAGE |
+                   RAM_SAVE_FLAG_EOS | RAM_SAVE_FLAG_CONTINUE |
+                   RAM_SAVE_FLAG_XBZRLE | RAM_SAVE_FLAG_HOOK |
+                   RAM_SAVE_FLAG_COMPRESS_PAGE |
+                   RAM_SAVE_FLAG_MULTIFD_SYNC) & TARGET_PAGE_MASK);
 
 static struct defconfig_file {
     const char *filename;
@@ -174,9 +198,6 @@ static struct {
     QemuMutex lock;
 } XBZRLE;
 
-/* buffer used for XBZRLE decoding */
-static uint8_t *xbzrle_decoded_buf;
-
 static void XBZRLE_cache_lock(void)
 {
     if (migrate_use_xbzrle())
@@ -194,39 +215,48 @@ static void XBZRLE_cache_unlock(void)
  * a migration is in progress.
  * A running migration maybe using the cache and might finish during this
  * call, hence changes to the cache are protected by XBZRLE.lock().
+ * The lock is only held to swap the pointer: the new cache is allocated
+ * and the old one freed outside of it, so that the migration thread does
+ * not wait for a multi-GB cache to be torn down.
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
-    int64_t ret;
+    PageCache *new_cache, *old_cache;
+    bool active;
 
     if (new_size < TARGET_PAGE_SIZE) {
         return -1;
     }
 
+    if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
+        return pow2floor(new_size);
+    }
+
     XBZRLE_cache_lock();
+    active = XBZRLE.cache != NULL;
+    XBZRLE_cache_unlock();
+    if (!active) {
+        return pow2floor(new_size);
+    }
 
-    if (XBZRLE.cache != NULL) {
-        if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
-            goto out_new_size;
-        }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
-            ret = -1;
-            goto out;
-        }
+    new_cache = cache_init(new_size / TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    if (!new_cache) {
+        error_report("Error creating cache");
+        return -1;
+    }
 
-        cache_fini(XBZRLE.cache);
+    XBZRLE_cache_lock();
+    old_cache = XBZRLE.cache;
+    if (old_cache) {
         XBZRLE.cache = new_cache;
+    } else {
+        /* the migration finished in the meantime */
+        old_cache = new_cache;
     }
-
-out_new_size:
-    ret = pow2floor(new_size);
-out:
     XBZRLE_cache_unlock();
-    return ret;
+
+    cache_fini(old_cache);
+    return pow2floor(new_size);
 }
 
 /* accounting for migration statistics */
@@ -321,6 +351,200 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return size;
 }
 
+/* Multiple threads compression
+ *
+ * The migration thread hands out non-zero pages to a pool of compression
+ * threads.  Each thread compresses one page at a time into its own buffer.
+ * The output is written to the stream by the migration thread, the next
+ * time it hands out a page to the same thread or when it flushes all of
+ * them.
+ *
+ * Only the first page of a RAMBlock carries the block name, the others have
+ * RAM_SAVE_FLAG_CONTINUE set.  Therefore all compressed pages are flushed
+ * before the migration thread moves on to another block, and the first page
+ * of the new block is sent by the migration thread itself.
+ */
+typedef struct CompressParam {
+    /* protected by comp_done_lock */
+    bool done;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    /* only used by the migration thread */
+    bool pending;
+    /* output, valid once done is set */
+    uint8_t *buf;
+    unsigned long len;
+    bool failed;
+} CompressParam;
+
+/* On the destination, compressed pages and XBZRLE pages are decoded by the
+ * decompression threads.  ram_load hands them out in batches, so that waking
+ * up a thread is paid once per batch rather than once per page.  A page is
+ * sent at most once per section and ram_load waits for all batches at the
+ * end of each section, so decoded pages never overtake newer data.
+ */
+#define DECOMPRESS_BATCH_PAGES 32
+
+typedef struct DecompressPage {
+    void *des;
+    /* RAM_SAVE_FLAG_COMPRESS_PAGE or RAM_SAVE_FLAG_XBZRLE */
+    int flags;
+    int len;
+    uint8_t *data;
+} DecompressPage;
+
+typedef struct DecompressParam {
+    /* protected by decomp_done_lock */
+    bool done;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* the batch, filled by ram_load while the thread is idle */
+    DecompressPage pages[DECOMPRESS_BATCH_PAGES];
+    int num_pages;
+    uint8_t *compbuf;
+} DecompressParam;
+
+static int compress_thread_count;
+static CompressParam *comp_param;
+static QemuThread *compress_threads;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+static int decompress_thread_count;
+static DecompressParam *decomp_param;
+static QemuThread *decompress_threads;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+static bool decompress_failed;
+/* batch being filled by ram_load, not handed out yet */
+static DecompressParam *decomp_fill;
+
+/* Multiple connections (multifd)
+ *
+ * Non-zero pages are sent in batches over additional TCP connections, each
+ * with its own send thread.  Pages are sharded across the connections by
+ * address, so a page always travels on the same connection and batches are
+ * made of neighbouring pages.  A batch is a MultiFDPacket followed by the
+ * page data.
+ *
+ * At the end of each round, every connection gets a packet with
+ * MULTIFD_FLAG_SYNC and the main stream gets a RAM_SAVE_FLAG_MULTIFD_SYNC
+ * record.  The destination waits until all receive threads have reached
+ * their sync packet before it goes on with the main stream, and the threads
+ * wait for the main stream to reach the record before they read on.  So a
+ * page is never written out of order with what the main stream sends about
+ * it in an earlier or later round.
+ */
+#define MULTIFD_MAGIC 0x4d554c54 /* "MULT" */
+#define MULTIFD_FLAG_SYNC 0x1
+#define MULTIFD_MAX_PAGES 64
+/* Pages are sharded across the connections in 2 MB chunks */
+#define MULTIFD_SHARD_BITS 21
+
+typedef struct QEMU_PACKED MultiFDPacket {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t pages;
+    char idstr[256];
+    uint64_t offset[MULTIFD_MAX_PAGES];
+} MultiFDPacket;
+
+typedef struct MultiFDSendParam {
+    int id;
+    int fd;
+    QemuThread thread;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* protected by multifd_send_lock */
+    bool done;
+
+    /* batch being sent, owned by the thread until done is set */
+    RAMBlock *block;
+    uint32_t flags;
+    uint32_t pages;
+    ram_addr_t offset[MULTIFD_MAX_PAGES];
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_MAX_PAGES + 1];
+
+    /* batch being filled, only used by the migration thread */
+    RAMBlock *fill_block;
+    uint32_t fill_pages;
+    ram_addr_t fill_offset[MULTIFD_MAX_PAGES];
+} MultiFDSendParam;
+
+typedef struct MultiFDRecvParam {
+    int id;
+    int fd;
+    QemuThread thread;
+    /* posted by ram_load when the main stream reaches a sync record */
+    QemuSemaphore sem;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_MAX_PAGES];
+} MultiFDRecvParam;
+
+/* multifd_send and multifd_send_count are only changed by the migration
+ * thread, with multifd_send_lock held so that migrate_fd_cancel() can look
+ * at them too
+ */
+static int multifd_send_count;
+static MultiFDSendParam *multifd_send;
+static QemuMutex multifd_send_lock;
+static QemuCond multifd_send_cond;
+static bool multifd_send_failed;
+static bool multifd_send_quit;
+
+static int multifd_recv_count;
+static MultiFDRecvParam *multifd_recv;
+static QemuMutex multifd_recv_lock;
+static QemuCond multifd_recv_cond;
+static int multifd_recv_synced;
+static bool multifd_recv_failed;
+static bool multifd_recv_quit;
+
+/* Fixed-ram layout for migration to a file
+ *
+ * The block list goes in a RAM_SAVE_FLAG_MEM_SIZE_FIXED_RAM record instead
+ * of RAM_SAVE_FLAG_MEM_SIZE, and every block in it is followed by the file
+ * offsets of its page bitmap and of its pages.  The pages area is as large
+ * as the block and aligned to FIXED_RAM_ALIGN, the main stream goes on
+ * right after it.  A page is written at its own place in the pages area by
+ * the multifd send threads, with a single thread if multifd is disabled, so
+ * a page that is sent again overwrites the old copy and nothing about it
+ * goes to the main stream.
+ *
+ * The bitmap has a bit set for the pages that hold data, zero pages are
+ * only cleared in the bitmap.  It is stored as little-endian 64-bit words
+ * once all pages have been written.  The destination reads it as soon as
+ * it sees the block and loads the pages with several threads.
+ */
+#define FIXED_RAM_ALIGN (1 << 20)
+
+typedef struct FixedRamLoadParam {
+    QemuThread thread;
+    RAMBlock *block;
+    int fd;
+    unsigned long *bmap;
+    uint64_t pages_offset;
+    uint64_t start;
+    uint64_t end;
+    int ret;
+} FixedRamLoadParam;
+
+/* file descriptor of the migration file, -1 without fixed-ram */
+static int fixed_ram_fd = -1;
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -331,6 +555,22 @@ static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* Set when the source has switched to post-copy */
+static bool ram_postcopy_active;
+
+/* Pages requested by the destination in post-copy, they are sent before
+ * the ones found by the background scan
+ */
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QemuMutex page_request_lock;
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
 
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
@@ -459,17 +699,36 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
         int k;
         int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+        /* The last word may extend past the block, leave those pages
+         * alone or they are counted but never sent
+         */
+        unsigned long last_mask =
+            BITMAP_LAST_WORD_MASK(length >> TARGET_PAGE_BITS);
+        bool cleared = false;
 
         for (k = page; k < page + nr; k++) {
-            if (src[k]) {
+            unsigned long dirty = src[k];
+
+            if (k == page + nr - 1) {
+                dirty &= last_mask;
+            }
+            if (dirty) {
                 unsigned long new_dirty;
                 new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
+                migration_bitmap[k] |= dirty;
+                new_dirty &= dirty;
                 migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
+                src[k] &= ~dirty;
+                cleared = true;
             }
         }
+        /* TCG only notices further writes once its TLB entries for the
+         * block are no longer marked dirty
+         */
+        if (cleared && tcg_enabled()) {
+            cpu_physical_memory_reset_dirty(start, length,
+                                            DIRTY_MEMORY_MIGRATION);
+        }
     } else {
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
             if (cpu_physical_memory_get_dirty(start + addr,
@@ -532,23 +791,32 @@ static void migration_bitmap_sync(void)
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+            /* Compare the bytes dirtied with the bytes sent since the last
+               time we were in this routine.  Throttle the guest harder when
+               it dirtied more than half of what was sent twice in a row,
+               and release it step by step once it dirties less than a
+               quarter */
+            uint64_t bytes_dirty_period;
+            uint64_t bytes_xfer_period;
+
             bytes_xfer_now = ram_bytes_transferred();
+            bytes_dirty_period = num_dirty_pages_period * TARGET_PAGE_SIZE;
+            bytes_xfer_period = bytes_xfer_now - bytes_xfer_prev;
             if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
+                bytes_dirty_period > bytes_xfer_period / 2) {
+                if (++dirty_rate_high_cnt >= 2) {
+                    mig_throttle_guest_down();
                     dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
+                }
+            } else {
+                dirty_rate_high_cnt = 0;
+                if (bytes_dirty_period < bytes_xfer_period / 4) {
+                    mig_throttle_guest_up();
+                }
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         } else {
-             mig_throttle_on = false;
+            mig_throttle_stop();
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != 0) {
@@ -565,524 +833,2299 @@ static void migration_bitmap_sync(void)
         s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
         start_time = end_time;
         num_dirty_pages_period = 0;
-        s->dirty_sync_count = bitmap_sync_count;
     }
+    s->dirty_sync_count = bitmap_sync_count;
 }
 
-/*
- * ram_save_page: Send the given page to the stream
- *
- * Returns: Number of bytes written.
- */
-static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
-                         bool last_stage)
+static void *do_data_compress(void *opaque)
 {
-    int bytes_sent;
-    int cont;
-    ram_addr_t current_addr;
-    MemoryRegion *mr = block->mr;
+    CompressParam *param = opaque;
     uint8_t *p;
-    int ret;
-    bool send_async = true;
-
-    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
 
-    p = memory_region_get_ram_ptr(mr) + offset;
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
 
-    /* In doubt sent page as normal */
-    bytes_sent = -1;
-    ret = ram_control_save_page(f, block->offset,
-                           offset, TARGET_PAGE_SIZE, &bytes_sent);
+            p = memory_region_get_ram_ptr(param->block->mr) + param->offset;
+            param->len = compressBound(TARGET_PAGE_SIZE);
+            param->failed = compress2(param->buf, &param->len, p,
+                                      TARGET_PAGE_SIZE,
+                                      migrate_compress_level()) != Z_OK;
 
-    XBZRLE_cache_lock();
+            qemu_mutex_lock(&comp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&comp_done_cond);
+            qemu_mutex_unlock(&comp_done_lock);
 
-    current_addr = block->offset + offset;
-    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-        if (ret != RAM_SAVE_CONTROL_DELAYED) {
-            if (bytes_sent > 0) {
-                acct_info.norm_pages++;
-            } else if (bytes_sent == 0) {
-                acct_info.dup_pages++;
-            }
-        }
-    } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-        acct_info.dup_pages++;
-        bytes_sent = save_block_hdr(f, block, offset, cont,
-                                    RAM_SAVE_FLAG_COMPRESS);
-        qemu_put_byte(f, 0);
-        bytes_sent++;
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        xbzrle_cache_zero_page(current_addr);
-    } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-        bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
-                                      offset, cont, last_stage);
-        if (!last_stage) {
-            /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
-             */
-            send_async = false;
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
         }
     }
+    qemu_mutex_unlock(&param->mutex);
 
-    /* XBZRLE overflow or normal page */
-    if (bytes_sent == -1) {
-        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-        if (send_async) {
-            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-        } else {
-            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-        }
-        bytes_sent += TARGET_PAGE_SIZE;
-        acct_info.norm_pages++;
+    return NULL;
+}
+
+static void migrate_compress_threads_create(void)
+{
+    int i;
+
+    compress_thread_count = migrate_compress_threads();
+    compress_threads = g_new0(QemuThread, compress_thread_count);
+    comp_param = g_new0(CompressParam, compress_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < compress_thread_count; i++) {
+        comp_param[i].done = true;
+        comp_param[i].buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(compress_threads + i, "compress",
+                           do_data_compress, comp_param + i,
+                           QEMU_THREAD_JOINABLE);
     }
+}
 
-    XBZRLE_cache_unlock();
+static void migrate_compress_threads_join(void)
+{
+    int i;
 
-    return bytes_sent;
+    if (!compress_thread_count) {
+        return;
+    }
+    for (i = 0; i < compress_thread_count; i++) {
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+    }
+    for (i = 0; i < compress_thread_count; i++) {
+        qemu_thread_join(compress_threads + i);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+        g_free(comp_param[i].buf);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(compress_threads);
+    g_free(comp_param);
+    compress_threads = NULL;
+    comp_param = NULL;
+    compress_thread_count = 0;
 }
 
-/*
- * ram_find_and_save_block: Finds a page to send and sends it to f
- *
- * Returns:  The number of bytes written.
- *           0 means no dirty pages
+/* Write the page that @param has compressed, if any.  The thread must be
+ * idle.
  */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int bytes_sent;
 
-static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
+    if (!param->pending) {
+        return 0;
+    }
+    param->pending = false;
+
+    if (param->failed) {
+        /* Should not happen with a buffer of compressBound() bytes, but the
+         * page can still be sent as it is */
+        bytes_sent = save_block_hdr(f, param->block, param->offset,
+                                    RAM_SAVE_FLAG_CONTINUE,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, memory_region_get_ram_ptr(param->block->mr) +
+                        param->offset, TARGET_PAGE_SIZE);
+        return bytes_sent + TARGET_PAGE_SIZE;
+    }
+
+    bytes_sent = save_block_hdr(f, param->block, param->offset,
+                                RAM_SAVE_FLAG_CONTINUE,
+                                RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, param->len);
+    qemu_put_buffer(f, param->buf, param->len);
+    return bytes_sent + 4 + param->len;
+}
+
+/* Wait for all compression threads and write their pages to @f */
+static int flush_compressed_data(QEMUFile *f)
 {
-    RAMBlock *block = last_seen_block;
-    ram_addr_t offset = last_offset;
-    bool complete_round = false;
     int bytes_sent = 0;
-    MemoryRegion *mr;
-
-    if (!block)
-        block = QTAILQ_FIRST(&ram_list.blocks);
+    int i;
 
-    while (true) {
-        mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
-        if (complete_round && block == last_seen_block &&
-            offset >= last_offset) {
-            break;
+    for (i = 0; i < compress_thread_count; i++) {
+        qemu_mutex_lock(&comp_done_lock);
+        while (!comp_param[i].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
         }
-        if (offset >= block->length) {
-            offset = 0;
-            block = QTAILQ_NEXT(block, next);
-            if (!block) {
-                block = QTAILQ_FIRST(&ram_list.blocks);
-                complete_round = true;
-                ram_bulk_stage = false;
-            }
-        } else {
-            bytes_sent = ram_save_page(f, block, offset, last_stage);
+        qemu_mutex_unlock(&comp_done_lock);
 
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent > 0) {
-                last_sent_block = block;
+        bytes_sent += flush_compressed_page(f, &comp_param[i]);
+    }
+    return bytes_sent;
+}
+
+/* Hand out a page to an idle compression thread.  Returns the number of
+ * bytes of earlier pages that were written to @f.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset)
+{
+    CompressParam *param = NULL;
+    int bytes_sent;
+    int i;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (!param) {
+        for (i = 0; i < compress_thread_count; i++) {
+            if (comp_param[i].done) {
+                param = &comp_param[i];
+                param->done = false;
                 break;
             }
         }
+        if (!param) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
     }
-    last_seen_block = block;
-    last_offset = offset;
+    qemu_mutex_unlock(&comp_done_lock);
+
+    bytes_sent = flush_compressed_page(f, param);
+
+    qemu_mutex_lock(&param->mutex);
+    param->block = block;
+    param->offset = offset;
+    param->pending = true;
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
 
     return bytes_sent;
 }
 
-static uint64_t bytes_transferred;
-
-void acct_update_position(QEMUFile *f, size_t size, bool zero)
+static int fixed_ram_pwrite(int fd, const uint8_t *buf, size_t size,
+                            uint64_t offset)
 {
-    uint64_t pages = size / TARGET_PAGE_SIZE;
-    if (zero) {
-        acct_info.dup_pages += pages;
-    } else {
-        acct_info.norm_pages += pages;
-        bytes_transferred += size;
-        qemu_update_position(f, size);
+    ssize_t len;
+
+    while (size) {
+        len = pwrite(fd, buf, size, offset);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += len;
+        size -= len;
+        offset += len;
     }
+    return 0;
 }
 
-static ram_addr_t ram_save_remaining(void)
+static int fixed_ram_pread(int fd, uint8_t *buf, size_t size, uint64_t offset)
 {
-    return migration_dirty_pages;
-}
+    ssize_t len;
 
-uint64_t ram_bytes_remaining(void)
-{
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    while (size) {
+        len = pread(fd, buf, size, offset);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            return -EIO;
+        }
+        buf += len;
+        size -= len;
+        offset += len;
+    }
+    return 0;
 }
 
-uint64_t ram_bytes_transferred(void)
+/* Convert a bitmap with @bits bits, a multiple of 64, between host and
+ * little-endian order
+ */
+static void fixed_ram_bitmap_swap(unsigned long *bmap, uint64_t bits)
 {
-    return bytes_transferred;
+#ifdef HOST_WORDS_BIGENDIAN
+    uint64_t i;
+
+    for (i = 0; i < BITS_TO_LONGS(bits); i++) {
+        bmap[i] = sizeof(long) == 8 ? bswap64(bmap[i]) : bswap32(bmap[i]);
+    }
+#endif
 }
 
-uint64_t ram_bytes_total(void)
+/* Write the pages of the batch of @p at their place in the file, merging
+ * neighbouring pages into one write
+ */
+static int multifd_send_fixed_ram(MultiFDSendParam *p)
 {
-    RAMBlock *block;
-    uint64_t total = 0;
-
-    QTAILQ_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    uint8_t *host = memory_region_get_ram_ptr(p->block->mr);
+    int i, n, ret;
 
-    return total;
+    for (i = 0; i < p->pages; i += n) {
+        for (n = 1; i + n < p->pages; n++) {
+            if (p->offset[i + n] != p->offset[i] + n * TARGET_PAGE_SIZE) {
+                break;
+            }
+        }
+        ret = fixed_ram_pwrite(fixed_ram_fd, host + p->offset[i],
+                               n * TARGET_PAGE_SIZE,
+                               p->block->pages_offset + p->offset[i]);
+        if (ret < 0) {
+            error_report("fixed-ram: could not write RAM: %s",
+                         strerror(-ret));
+            return ret;
+        }
+    }
+    return 0;
 }
 
-void free_xbzrle_decoded_buf(void)
+static int multifd_send_packet(MultiFDSendParam *p)
 {
-    g_free(xbzrle_decoded_buf);
-    xbzrle_decoded_buf = NULL;
-}
+    size_t size = sizeof(p->packet);
+    uint8_t *host = NULL;
+    int i;
 
-static void migration_end(void)
-{
-    if (migration_bitmap) {
-        memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
-        migration_bitmap = NULL;
+    if (fixed_ram_fd >= 0) {
+        return multifd_send_fixed_ram(p);
     }
 
-    XBZRLE_cache_lock();
-    if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        XBZRLE.cache = NULL;
-        XBZRLE.encoded_buf = NULL;
-        XBZRLE.current_buf = NULL;
+    memset(&p->packet, 0, sizeof(p->packet));
+    p->packet.magic = cpu_to_be32(MULTIFD_MAGIC);
+    p->packet.flags = cpu_to_be32(p->flags);
+    p->packet.pages = cpu_to_be32(p->pages);
+    if (p->pages) {
+        pstrcpy(p->packet.idstr, sizeof(p->packet.idstr), p->block->idstr);
+        host = memory_region_get_ram_ptr(p->block->mr);
     }
-    XBZRLE_cache_unlock();
-}
 
-static void ram_migration_cancel(void *opaque)
-{
-    migration_end();
+    p->iov[0].iov_base = &p->packet;
+    p->iov[0].iov_len = sizeof(p->packet);
+    for (i = 0; i < p->pages; i++) {
+        p->packet.offset[i] = cpu_to_be64(p->offset[i]);
+        p->iov[i + 1].iov_base = host + p->offset[i];
+        p->iov[i + 1].iov_len = TARGET_PAGE_SIZE;
+        size += TARGET_PAGE_SIZE;
+    }
+
+    if (iov_send(p->fd, p->iov, p->pages + 1, 0, size) != size) {
+        return -1;
+    }
+    return 0;
 }
 
-static void reset_ram_globals(void)
+static void *multifd_send_thread(void *opaque)
 {
-    last_seen_block = NULL;
-    last_sent_block = NULL;
-    last_offset = 0;
+    MultiFDSendParam *p = opaque;
+    int ret;
+
+    qemu_mutex_lock(&p->mutex);
+    while (!p->quit) {
+        if (p->start) {
+            p->start = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            ret = multifd_send_packet(p);
+
+            qemu_mutex_lock(&multifd_send_lock);
+            if (ret < 0) {
+                multifd_send_failed = true;
+            }
+            p->done = true;
+            qemu_cond_signal(&multifd_send_cond);
+            qemu_mutex_unlock(&multifd_send_lock);
+
+            qemu_mutex_lock(&p->mutex);
+        } else {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+static void multifd_send_join(void)
+{
+    int i;
+
+    if (!multifd_send) {
+        return;
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *p = &multifd_send[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        /* Wake up a thread that is blocked on a dead connection */
+        if (p->fd >= 0) {
+            shutdown(p->fd, 2);
+        }
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        qemu_thread_join(&multifd_send[i].thread);
+    }
+
+    qemu_mutex_lock(&multifd_send_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *p = &multifd_send[i];
+
+        if (p->fd >= 0) {
+            closesocket(p->fd);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+    }
+    g_free(multifd_send);
+    multifd_send = NULL;
+    multifd_send_count = 0;
+    qemu_mutex_unlock(&multifd_send_lock);
+}
+
+/* Called by migrate_fd_cancel(): a send thread may be stuck on a connection
+ * that does not make progress, and the migration thread waiting for it.
+ * Shut the connections down so that the threads fail, and wake up the
+ * migration thread.
+ */
+void multifd_send_cancel(void)
+{
+    int i;
+
+    qemu_mutex_lock(&multifd_send_lock);
+    multifd_send_quit = true;
+    for (i = 0; i < multifd_send_count; i++) {
+        if (multifd_send[i].fd >= 0) {
+            shutdown(multifd_send[i].fd, 2);
+        }
+    }
+    qemu_cond_broadcast(&multifd_send_cond);
+    qemu_mutex_unlock(&multifd_send_lock);
+}
+
+/* Open connection @id and send its handshake, returns the socket or -1 */
+static int multifd_send_connect(MigrationState *s, int id)
+{
+    Error *local_err = NULL;
+    uint32_t handshake[2];
+    int fd;
+
+    fd = tcp_connect_migration_channel(s, &local_err);
+    if (fd < 0) {
+        error_report("multifd: %s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -1;
+    }
+    handshake[0] = cpu_to_be32(MULTIFD_MAGIC);
+    handshake[1] = cpu_to_be32(id);
+    if (qemu_send_full(fd, handshake, sizeof(handshake), 0) !=
+        sizeof(handshake)) {
+        error_report("multifd: could not send handshake");
+        closesocket(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Open the multifd connections if the capability is enabled and this is a
+ * TCP migration.  Falls back to the main stream alone if any of them cannot
+ * be set up.  With fixed-ram, start the threads that write RAM to the file
+ * instead.
+ */
+static void multifd_send_setup(QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+    int count = migrate_multifd_channels();
+    int i, fd;
+
+    if (f != s->file || (!migrate_use_multifd() && fixed_ram_fd < 0)) {
+        return;
+    }
+    if (!migrate_use_multifd()) {
+        count = 1;
+    }
+
+    qemu_mutex_lock(&multifd_send_lock);
+    multifd_send = g_new0(MultiFDSendParam, count);
+    multifd_send_failed = false;
+    multifd_send_quit = false;
+    qemu_mutex_unlock(&multifd_send_lock);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendParam *p = &multifd_send[i];
+
+        fd = -1;
+        if (fixed_ram_fd < 0) {
+            fd = multifd_send_connect(s, i);
+            if (fd < 0) {
+                break;
+            }
+        }
+
+        p->id = i;
+        p->fd = fd;
+        p->done = true;
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+        qemu_mutex_lock(&multifd_send_lock);
+        multifd_send_count++;
+        qemu_mutex_unlock(&multifd_send_lock);
+    }
+
+    if (multifd_send_count < count) {
+        error_report("multifd: using a single connection");
+        multifd_send_join();
+    }
+}
+
+/* Hand the batch that is being filled over to the thread of @p, once the
+ * thread is done with the previous one.
+ */
+static int multifd_send_batch(QEMUFile *f, MultiFDSendParam *p,
+                              uint32_t flags)
+{
+    qemu_mutex_lock(&multifd_send_lock);
+    while (!p->done && !multifd_send_quit) {
+        qemu_cond_wait(&multifd_send_cond, &multifd_send_lock);
+    }
+    if (multifd_send_failed || multifd_send_quit) {
+        qemu_mutex_unlock(&multifd_send_lock);
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+    p->done = false;
+    qemu_mutex_unlock(&multifd_send_lock);
+
+    p->block = p->fill_block;
+    p->pages = p->fill_pages;
+    memcpy(p->offset, p->fill_offset, p->pages * sizeof(p->offset[0]));
+    p->flags = flags;
+    p->fill_pages = 0;
+
+    qemu_mutex_lock(&p->mutex);
+    p->start = true;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    return 0;
+}
+
+/* Send the pending batches and a sync packet on every connection, and the
+ * matching record on the main stream.  Returns the number of bytes written
+ * to @f.  With fixed-ram, pages have their own place in the file and only
+ * the pending batches are handed out.
+ */
+static int multifd_send_sync(QEMUFile *f)
+{
+    int i;
+
+    if (!multifd_send_count) {
+        return 0;
+    }
+
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *p = &multifd_send[i];
+
+        if (p->fill_pages) {
+            multifd_send_batch(f, p, 0);
+        }
+        if (fixed_ram_fd < 0) {
+            multifd_send_batch(f, p, MULTIFD_FLAG_SYNC);
+        }
+    }
+    if (fixed_ram_fd >= 0) {
+        return 0;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    qemu_put_be32(f, multifd_send_count);
+    return 12;
+}
+
+/* Wait until all batches have been handed to the kernel */
+static void multifd_send_wait(void)
+{
+    int i;
+
+    if (!multifd_send_count) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_send_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        while (!multifd_send[i].done && !multifd_send_quit) {
+            qemu_cond_wait(&multifd_send_cond, &multifd_send_lock);
+        }
+    }
+    qemu_mutex_unlock(&multifd_send_lock);
+}
+
+/* Use the fixed-ram layout if the capability is enabled and the migration
+ * stream is a file that can seek
+ */
+static void fixed_ram_setup(QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+
+    fixed_ram_fd = -1;
+    if (!migrate_use_fixed_ram() || f != s->file) {
+        return;
+    }
+    if (qemu_file_fd_offset(f) < 0) {
+        error_report("fixed-ram: the migration stream is not a file, "
+                     "using a regular stream");
+        return;
+    }
+    fixed_ram_fd = qemu_get_fd(f);
+}
+
+/* Place the bitmap and the pages of @block right after its entry in the
+ * block list, and go on with the main stream after the pages
+ */
+static void fixed_ram_put_block(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t pages = block->length >> TARGET_PAGE_BITS;
+    int64_t pos;
+
+    pos = qemu_file_fd_offset(f);
+    if (pos < 0) {
+        qemu_file_set_error(f, pos);
+        return;
+    }
+    block->bitmap_offset = pos + 16;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   DIV_ROUND_UP(pages, 64) * 8,
+                                   FIXED_RAM_ALIGN);
+    block->file_bmap = bitmap_new(ROUND_UP(pages, 64));
+
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_fd_seek(f, block->pages_offset + block->length);
+}
+
+/* Write the page bitmaps once all pages are in the file */
+static void fixed_ram_save_complete(QEMUFile *f)
+{
+    RAMBlock *block;
+    bool failed;
+    int ret;
+
+    if (fixed_ram_fd < 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_send_lock);
+    failed = multifd_send_failed;
+    qemu_mutex_unlock(&multifd_send_lock);
+    if (failed) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        uint64_t bits = ROUND_UP(block->length >> TARGET_PAGE_BITS, 64);
+
+        fixed_ram_bitmap_swap(block->file_bmap, bits);
+        ret = fixed_ram_pwrite(fixed_ram_fd, (uint8_t *)block->file_bmap,
+                               bits / 8, block->bitmap_offset);
+        if (ret < 0) {
+            error_report("fixed-ram: could not write the page bitmap of "
+                         "\"%s\": %s", block->idstr, strerror(-ret));
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+}
+
+/*
+ * ram_save_multifd_page: Queue the given page on its multifd connection
+ *
+ * Zero pages go to the main stream.  They always carry the block name,
+ * because the block of the previous record on the main stream is unknown.
+ * With fixed-ram they are only cleared in the bitmap of the file.
+ *
+ * Returns: Number of bytes written, or accounted for on the connections.
+ */
+static int ram_save_multifd_page(QEMUFile *f, RAMBlock *block,
+                                 ram_addr_t offset)
+{
+    MultiFDSendParam *p;
+    uint8_t *host;
+    int bytes_sent;
+
+    host = memory_region_get_ram_ptr(block->mr) + offset;
+    if (is_zero_range(host, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        if (fixed_ram_fd >= 0) {
+            clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+            return 0;
+        }
+        bytes_sent = save_block_hdr(f, block, offset, 0,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        return bytes_sent + 1;
+    }
+
+    p = &multifd_send[((block->offset + offset) >> MULTIFD_SHARD_BITS) %
+                      multifd_send_count];
+    if (p->fill_pages && p->fill_block != block) {
+        multifd_send_batch(f, p, 0);
+    }
+    if (fixed_ram_fd >= 0) {
+        set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+    }
+    p->fill_block = block;
+    p->fill_offset[p->fill_pages++] = offset;
+    if (p->fill_pages == MULTIFD_MAX_PAGES) {
+        multifd_send_batch(f, p, 0);
+    }
+
+    acct_info.norm_pages++;
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    return TARGET_PAGE_SIZE;
+}
+
+/*
+ * ram_save_compressed_page: Send the given page to the stream, compressed
+ * by the compression threads
+ *
+ * Returns: Number of bytes written.  This can be 0 for a page that was handed
+ *          out to a compression thread, its data is counted when it is
+ *          written.
+ */
+static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset)
+{
+    int bytes_sent = -1;
+    int cont;
+    uint8_t *p;
+    int ret;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    ret = ram_control_save_page(f, block->offset,
+                                offset, TARGET_PAGE_SIZE, &bytes_sent);
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_sent == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+        return bytes_sent;
+    }
+
+    if (block != last_sent_block) {
+        /* The pages of the previous block go first, see above */
+        bytes_sent = flush_compressed_data(f);
+        cont = 0;
+    } else {
+        bytes_sent = 0;
+        cont = RAM_SAVE_FLAG_CONTINUE;
+    }
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        bytes_sent += save_block_hdr(f, block, offset, cont,
+                                     RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+    } else if (!cont) {
+        acct_info.norm_pages++;
+        bytes_sent += save_block_hdr(f, block, offset, cont,
+                                     RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+    } else {
+        acct_info.norm_pages++;
+        bytes_sent += compress_page_with_multi_thread(f, block, offset);
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * ram_save_page: Send the given page to the stream
+ *
+ * Returns: Number of bytes written.
+ */
+static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
+                         bool last_stage)
+{
+    int bytes_sent;
+    int cont;
+    ram_addr_t current_addr;
+    MemoryRegion *mr = block->mr;
+    uint8_t *p;
+    int ret;
+    bool send_async = true;
+
+    if (multifd_send_count) {
+        return ram_save_multifd_page(f, block, offset);
+    }
+    if (compress_thread_count) {
+        return ram_save_compressed_page(f, block, offset);
+    }
+
+    cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    p = memory_region_get_ram_ptr(mr) + offset;
+
+    /* In doubt sent page as normal */
+    bytes_sent = -1;
+    ret = ram_control_save_page(f, block->offset,
+                           offset, TARGET_PAGE_SIZE, &bytes_sent);
+
+    XBZRLE_cache_lock();
+
+    current_addr = block->offset + offset;
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_sent == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+    } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+         * page would be stale
+         */
+        xbzrle_cache_zero_page(current_addr);
+    } else if (!ram_bulk_stage && !ram_postcopy_active &&
+               migrate_use_xbzrle()) {
+        /* The destination cannot decode XBZRLE pages once it runs */
+        bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
+                                      offset, cont, last_stage);
+        if (!last_stage) {
+            /* Can't send this cached data async, since the cache page
+             * might get updated before it gets to the wire
+             */
+            send_async = false;
+        }
+    }
+
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        if (send_async) {
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    XBZRLE_cache_unlock();
+
+    return bytes_sent;
+}
+
+/*
+ * ram_find_and_save_block: Finds a page to send and sends it to f
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no dirty pages
+ */
+
+static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int bytes_sent = 0;
+    MemoryRegion *mr;
+
+    if (!block)
+        block = QTAILQ_FIRST(&ram_list.blocks);
+
+    while (true) {
+        mr = block->mr;
+        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        if (complete_round && block == last_seen_block &&
+            offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+                complete_round = true;
+                ram_bulk_stage = false;
+            }
+        } else {
+            bytes_sent = ram_save_page(f, block, offset, last_stage);
+
+            /* if page is unmodified, continue to the next */
+            if (bytes_sent > 0) {
+                last_sent_block = block;
+                break;
+            }
+        }
+    }
+    last_seen_block = block;
+    last_offset = offset;
+
+    return bytes_sent;
+}
+
+/*
+ * ram_save_queue_pages: Queue a page request from the destination
+ *
+ * Called from the return path thread.  The RAMBlock list does not change
+ * while migrating, so it is walked without the ramlist lock.
+ *
+ * Returns: 0 on success, -1 for an invalid request.
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
+
+    trace_ram_save_queue_pages(rbname, start, len);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, rbname)) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("Page request for unknown RAMBlock \"%s\"", rbname);
+        return -1;
+    }
+    if (!len || ((start | len) & ~TARGET_PAGE_MASK) ||
+        start + len < start || start + len > block->length) {
+        error_report("Invalid page request for \"%s\": start " RAM_ADDR_FMT
+                     " length " RAM_ADDR_FMT, rbname, start, len);
+        return -1;
+    }
+
+    req = g_new0(RAMPageRequest, 1);
+    req->block = block;
+    req->offset = start;
+    req->len = len;
+
+    qemu_mutex_lock(&page_request_lock);
+    if (ram_postcopy_active) {
+        QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+        req = NULL;
+    }
+    qemu_mutex_unlock(&page_request_lock);
+
+    /* Late requests are for pages that have been sent already */
+    g_free(req);
+    return 0;
+}
+
+/*
+ * ram_save_queued_page: Send the first page requested by the destination
+ *
+ * The page is sent even if it is clean, the destination may have asked
+ * for it before the copy in flight arrived and the duplicate is dropped.
+ *
+ * Returns: The number of bytes written, 0 if the queue is empty.
+ */
+static int ram_save_queued_page(QEMUFile *f)
+{
+    RAMPageRequest *req;
+    RAMBlock *block = NULL;
+    ram_addr_t offset = 0;
+    bool last = false;
+    int bytes_sent;
+
+    qemu_mutex_lock(&page_request_lock);
+    req = QSIMPLEQ_FIRST(&page_requests);
+    if (req) {
+        block = req->block;
+        offset = req->offset;
+        req->offset += TARGET_PAGE_SIZE;
+        req->len -= TARGET_PAGE_SIZE;
+        if (!req->len) {
+            QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+            g_free(req);
+            last = QSIMPLEQ_EMPTY(&page_requests);
+        }
+    }
+    qemu_mutex_unlock(&page_request_lock);
+
+    if (!block) {
+        return 0;
+    }
+
+    if (test_and_clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                           migration_bitmap)) {
+        migration_dirty_pages--;
+    }
+    bytes_sent = ram_save_page(f, block, offset, false);
+    last_sent_block = block;
+
+    /* The destination is stalled on these pages, don't leave them queued
+     * behind a batch
+     */
+    if (last) {
+        qemu_fflush(f);
+    }
+
+    return bytes_sent;
+}
+
+/* Ranges sent in a single discard command */
+#define MAX_DISCARDS_PER_COMMAND 64
+
+/*
+ * ram_postcopy_send_discard_bitmap: Switch the RAM migration to post-copy
+ *
+ * From now on all pages go through the main stream, and the destination
+ * drops the pages that were dirtied after they had been sent so that it
+ * faults on them.  Called with the guest stopped and the iothread lock held.
+ *
+ * Returns: 0 on success, negative on errors.
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    uint64_t start[MAX_DISCARDS_PER_COMMAND];
+    uint64_t length[MAX_DISCARDS_PER_COMMAND];
+    RAMBlock *block;
+
+    /* The last round of pages must land before the discards */
+    multifd_send_wait();
+    multifd_send_join();
+    migrate_compress_threads_join();
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = first + (block->length >> TARGET_PAGE_BITS);
+        unsigned long run_start, run_end;
+        uint16_t count = 0;
+
+        run_start = find_next_bit(migration_bitmap, end, first);
+        while (run_start < end) {
+            run_end = find_next_zero_bit(migration_bitmap, end, run_start + 1);
+            start[count] = (uint64_t)(run_start - first) << TARGET_PAGE_BITS;
+            length[count] = (uint64_t)(run_end - run_start) << TARGET_PAGE_BITS;
+            if (++count == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                      count, start, length);
+                count = 0;
+            }
+            run_start = find_next_bit(migration_bitmap, end, run_end);
+        }
+        if (count) {
+            qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                  count, start, length);
+        }
+    }
+
+    /* Requested pages break the ordering the bulk stage relies on, and
+     * the first page after the switch must name its block
+     */
+    ram_bulk_stage = false;
+    last_sent_block = NULL;
+
+    qemu_mutex_lock(&page_request_lock);
+    ram_postcopy_active = true;
+    qemu_mutex_unlock(&page_request_lock);
+
+    qemu_mutex_unlock_ramlist();
+
+    return qemu_file_get_error(ms->file);
+}
+
+static uint64_t bytes_transferred;
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    uint64_t pages = size / TARGET_PAGE_SIZE;
+    if (zero) {
+        acct_info.dup_pages += pages;
+    } else {
+        acct_info.norm_pages += pages;
+        bytes_transferred += size;
+        qemu_update_position(f, size);
+    }
+}
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+static void migration_end(void)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
+
+    mig_throttle_stop();
+    migrate_compress_threads_join();
+    multifd_send_join();
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    fixed_ram_fd = -1;
+
+    qemu_mutex_lock(&page_request_lock);
+    ram_postcopy_active = false;
+    while ((req = QSIMPLEQ_FIRST(&page_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req);
+    }
+    qemu_mutex_unlock(&page_request_lock);
+
+    if (migration_bitmap) {
+        memory_global_dirty_log_stop();
+        g_free(migration_bitmap);
+        migration_bitmap = NULL;
+    }
+
+    XBZRLE_cache_lock();
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        XBZRLE.cache = NULL;
+        XBZRLE.encoded_buf = NULL;
+        XBZRLE.current_buf = NULL;
+    }
+    XBZRLE_cache_unlock();
+}
+
+static void ram_migration_cancel(void *opaque)
+{
+    migration_end();
+}
+
+static void reset_ram_globals(void)
+{
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
     last_version = ram_list.version;
     ram_bulk_stage = true;
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+
+    dirty_rate_high_cnt = 0;
+    bitmap_sync_count = 0;
+    migration_bitmap_sync_init();
+
+    if (migrate_use_xbzrle()) {
+        XBZRLE_cache_lock();
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                  TARGET_PAGE_SIZE,
+                                  TARGET_PAGE_SIZE);
+        if (!XBZRLE.cache) {
+            XBZRLE_cache_unlock();
+            error_report("Error creating cache");
+            return -1;
+        }
+        XBZRLE_cache_unlock();
+
+        /* We prefer not to abort if there is no memory */
+        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
+        if (!XBZRLE.encoded_buf) {
+            error_report("Error allocating encoded_buf");
+            return -1;
+        }
+
+        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
+        if (!XBZRLE.current_buf) {
+            error_report("Error allocating current_buf");
+            g_free(XBZRLE.encoded_buf);
+            XBZRLE.encoded_buf = NULL;
+            return -1;
+        }
+
+        acct_clear();
+    }
+
+    fixed_ram_setup(f);
+    multifd_send_setup(f);
+    if (migrate_use_compression() && !multifd_send_count) {
+        migrate_compress_threads_create();
+    }
+
+    qemu_mutex_lock_iothread();
+    qemu_mutex_lock_ramlist();
+    bytes_transferred = 0;
+    reset_ram_globals();
+
+    ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    migration_bitmap = bitmap_new(ram_bitmap_pages);
+    bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+
+    /*
+     * Count the total number of pages used by ram blocks not including any
+     * gaps due to alignment or unplugs.
+     */
+    migration_dirty_pages = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        uint64_t block_pages;
+
+        block_pages = block->length >> TARGET_PAGE_BITS;
+        migration_dirty_pages += block_pages;
+    }
+
+    memory_global_dirty_log_start();
+    migration_bitmap_sync();
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_be64(f, ram_bytes_total() |
+                  (fixed_ram_fd >= 0 ? RAM_SAVE_FLAG_MEM_SIZE_FIXED_RAM
+                                     : RAM_SAVE_FLAG_MEM_SIZE));
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+        if (fixed_ram_fd >= 0) {
+            fixed_ram_put_block(f, block);
+        }
+    }
+
+    multifd_send_sync(f);
+
+    qemu_mutex_unlock_ramlist();
+
+    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
+    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+    int i;
+    int64_t t0;
+    int total_sent = 0;
+
+    qemu_mutex_lock_ramlist();
+
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+
+    t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent = 0;
+
+        if (ram_postcopy_active) {
+            bytes_sent = ram_save_queued_page(f);
+        }
+        if (!bytes_sent) {
+            bytes_sent = ram_find_and_save_block(f, false);
+        }
+        /* no more blocks to sent */
+        if (bytes_sent == 0) {
+            break;
+        }
+        total_sent += bytes_sent;
+        acct_info.iterations++;
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) / 1000000;
+            if (t1 > MAX_WAIT) {
+                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
+                        t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+
+    total_sent += flush_compressed_data(f);
+    bytes_transferred += multifd_send_sync(f);
+
+    qemu_mutex_unlock_ramlist();
+
+    /*
+     * Must occur before EOS (or any QEMUFile operation)
+     * because of RDMA protocol.
+     */
+    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+
+    bytes_transferred += total_sent;
+
+    /*
+     * Do not count these 8 bytes into total_sent, so that we can
+     * return 0 if no page had been dirtied.
+     */
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    bytes_transferred += 8;
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return total_sent;
+}
+
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int bytes_sent;
+
+        bytes_sent = ram_find_and_save_block(f, true);
+        /* no more blocks to sent */
+        if (bytes_sent == 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+
+    bytes_transferred += flush_compressed_data(f);
+    bytes_transferred += multifd_send_sync(f);
+    multifd_send_wait();
+    fixed_ram_save_complete(f);
+
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    migration_end();
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+
+    if (remaining_size < max_size) {
+        qemu_mutex_lock_iothread();
+        migration_bitmap_sync();
+        qemu_mutex_unlock_iothread();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+    return remaining_size;
+}
+
+static DecompressPage *decompress_get_page(void *host, int flags, int len);
+
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    DecompressPage *page;
+    unsigned int xh_len;
+    int xh_flags;
+
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        error_report("Failed to load XBZRLE page - wrong compression!");
+        return -1;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        error_report("Failed to load XBZRLE page - len overflow!");
+        return -1;
+    }
+    /* load data, a decompression thread decodes it */
+    page = decompress_get_page(host, RAM_SAVE_FLAG_XBZRLE, xh_len);
+    qemu_get_buffer(f, page->data, xh_len);
+
+    return 0;
+}
+
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    static RAMBlock *block = NULL;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block || block->length <= offset) {
+            error_report("Ack, bad migration stream!");
+            return NULL;
+        }
+
+        return ramblock_ptr(block, offset);
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id)) && block->length > offset) {
+            break;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+
+    if (!block) {
+        error_report("Can't find block %s!", id);
+        return NULL;
+    }
+    return ramblock_ptr(block, offset);
+}
+
+/*
+ * If a page (or a whole RDMA chunk) has been
+ * determined to be zero, then zap it.
+ */
+void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+{
+    if (ch != 0 || !is_zero_range(host, size)) {
+        memset(host, ch, size);
+    }
+}
 
-static int ram_save_setup(QEMUFile *f, void *opaque)
+/* Returns false if the page could not be decoded */
+static bool decompress_page(DecompressPage *page)
+{
+    unsigned long pagesize = TARGET_PAGE_SIZE;
+
+    switch (page->flags) {
+    case RAM_SAVE_FLAG_XBZRLE:
+        return xbzrle_decode_buffer(page->data, page->len, page->des,
+                                    TARGET_PAGE_SIZE) != -1;
+    default:
+        return uncompress(page->des, &pagesize, page->data,
+                          page->len) == Z_OK &&
+               pagesize == TARGET_PAGE_SIZE;
+    }
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    bool failed;
+    int i;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            failed = false;
+            for (i = 0; i < param->num_pages; i++) {
+                if (!decompress_page(&param->pages[i])) {
+                    failed = true;
+                }
+            }
+
+            qemu_mutex_lock(&decomp_done_lock);
+            if (failed) {
+                decompress_failed = true;
+            }
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    decompress_thread_count = migrate_decompress_threads();
+    decompress_threads = g_new0(QemuThread, decompress_thread_count);
+    decomp_param = g_new0(DecompressParam, decompress_thread_count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    decompress_failed = false;
+    for (i = 0; i < decompress_thread_count; i++) {
+        decomp_param[i].done = true;
+        decomp_param[i].compbuf = g_malloc(DECOMPRESS_BATCH_PAGES *
+                                           compressBound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        qemu_thread_create(decompress_threads + i, "decompress",
+                           do_data_decompress, decomp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decompress_thread_count) {
+        return;
+    }
+    for (i = 0; i < decompress_thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+    }
+    for (i = 0; i < decompress_thread_count; i++) {
+        qemu_thread_join(decompress_threads + i);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].compbuf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decompress_threads);
+    g_free(decomp_param);
+    decompress_threads = NULL;
+    decomp_param = NULL;
+    decompress_thread_count = 0;
+}
+
+/* Hand the batch being filled out to its decompression thread */
+static void decompress_kick(void)
+{
+    DecompressParam *param = decomp_fill;
+
+    if (!param) {
+        return;
+    }
+    decomp_fill = NULL;
+
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/* Queue a page for @host, the caller fills in the @len bytes of data.
+ * Batches go to the first idle decompression thread.
+ */
+static DecompressPage *decompress_get_page(void *host, int flags, int len)
+{
+    DecompressPage *page;
+    int i;
+
+    assert(len <= compressBound(TARGET_PAGE_SIZE));
+
+    if (!decompress_thread_count) {
+        migrate_decompress_threads_create();
+    }
+
+    if (decomp_fill && decomp_fill->num_pages == DECOMPRESS_BATCH_PAGES) {
+        decompress_kick();
+    }
+
+    if (!decomp_fill) {
+        qemu_mutex_lock(&decomp_done_lock);
+        while (!decomp_fill) {
+            for (i = 0; i < decompress_thread_count; i++) {
+                if (decomp_param[i].done) {
+                    decomp_fill = &decomp_param[i];
+                    decomp_fill->done = false;
+                    break;
+                }
+            }
+            if (!decomp_fill) {
+                qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+            }
+        }
+        qemu_mutex_unlock(&decomp_done_lock);
+        decomp_fill->num_pages = 0;
+    }
+
+    page = &decomp_fill->pages[decomp_fill->num_pages];
+    page->des = host;
+    page->flags = flags;
+    page->len = len;
+    page->data = decomp_fill->compbuf +
+                 decomp_fill->num_pages * compressBound(TARGET_PAGE_SIZE);
+    decomp_fill->num_pages++;
+    return page;
+}
+
+/* Wait until all pages handed out so far are in guest memory.  Returns
+ * -EINVAL if any of them could not be decompressed.
+ */
+static int wait_for_decompress_done(void)
+{
+    int ret = 0;
+    int i;
+
+    if (!decompress_thread_count) {
+        return 0;
+    }
+
+    decompress_kick();
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decompress_thread_count; i++) {
+        while (!decomp_param[i].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    if (decompress_failed) {
+        decompress_failed = false;
+        ret = -EINVAL;
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+    return ret;
+}
+
+/* Receive one packet.  Returns 1 for a sync packet, 0 for other packets and
+ * -1 on errors.
+ */
+static int multifd_recv_packet(MultiFDRecvParam *p)
 {
     RAMBlock *block;
-    int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    uint32_t flags, pages;
+    uint8_t *host;
+    uint64_t offset;
+    int i;
 
-    mig_throttle_on = false;
-    dirty_rate_high_cnt = 0;
-    bitmap_sync_count = 0;
-    migration_bitmap_sync_init();
+    if (qemu_recv_full(p->fd, &p->packet, sizeof(p->packet), 0) !=
+        sizeof(p->packet)) {
+        return -1;
+    }
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE_cache_lock();
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            XBZRLE_cache_unlock();
-            error_report("Error creating cache");
+    flags = be32_to_cpu(p->packet.flags);
+    pages = be32_to_cpu(p->packet.pages);
+    if (be32_to_cpu(p->packet.magic) != MULTIFD_MAGIC ||
+        pages > MULTIFD_MAX_PAGES) {
+        return -1;
+    }
+
+    if (pages) {
+        p->packet.idstr[sizeof(p->packet.idstr) - 1] = 0;
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strcmp(p->packet.idstr, block->idstr)) {
+                break;
+            }
+        }
+        if (!block) {
             return -1;
         }
-        XBZRLE_cache_unlock();
 
-        /* We prefer not to abort if there is no memory */
-        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
-        if (!XBZRLE.encoded_buf) {
-            error_report("Error allocating encoded_buf");
+        host = memory_region_get_ram_ptr(block->mr);
+        for (i = 0; i < pages; i++) {
+            offset = be64_to_cpu(p->packet.offset[i]);
+            if ((offset & ~TARGET_PAGE_MASK) || offset >= block->length) {
+                return -1;
+            }
+            p->iov[i].iov_base = host + offset;
+            p->iov[i].iov_len = TARGET_PAGE_SIZE;
+        }
+        if (iov_recv(p->fd, p->iov, pages, 0, pages * TARGET_PAGE_SIZE) !=
+            pages * TARGET_PAGE_SIZE) {
             return -1;
         }
+    }
 
-        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!XBZRLE.current_buf) {
-            error_report("Error allocating current_buf");
-            g_free(XBZRLE.encoded_buf);
-            XBZRLE.encoded_buf = NULL;
-            return -1;
+    return (flags & MULTIFD_FLAG_SYNC) ? 1 : 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParam *p = opaque;
+    bool quit = false;
+    int ret;
+
+    while (!quit) {
+        ret = multifd_recv_packet(p);
+        if (ret < 0) {
+            break;
         }
+        if (ret == 1) {
+            qemu_mutex_lock(&multifd_recv_lock);
+            multifd_recv_synced++;
+            qemu_cond_signal(&multifd_recv_cond);
+            qemu_mutex_unlock(&multifd_recv_lock);
 
-        acct_clear();
+            qemu_sem_wait(&p->sem);
+        }
+        qemu_mutex_lock(&multifd_recv_lock);
+        quit = multifd_recv_quit;
+        qemu_mutex_unlock(&multifd_recv_lock);
     }
 
-    qemu_mutex_lock_iothread();
-    qemu_mutex_lock_ramlist();
-    bytes_transferred = 0;
-    reset_ram_globals();
+    qemu_mutex_lock(&multifd_recv_lock);
+    if (!quit) {
+        multifd_recv_failed = true;
+        qemu_cond_signal(&multifd_recv_cond);
+    }
+    qemu_mutex_unlock(&multifd_recv_lock);
 
-    ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-    migration_bitmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    return NULL;
+}
 
-    /*
-     * Count the total number of pages used by ram blocks not including any
-     * gaps due to alignment or unplugs.
-     */
-    migration_dirty_pages = 0;
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        uint64_t block_pages;
+/* Accept the @count connections announced by the first sync record.  The
+ * source opens them before it writes the record, so this does not wait for
+ * long.
+ */
+static int multifd_recv_setup(int count)
+{
+    Error *local_err = NULL;
+    uint32_t handshake[2];
+    int *fds;
+    int i, id, fd;
+
+    if (count < 1 || count > 255) {
+        error_report("Invalid number of multifd connections: %d", count);
+        return -EINVAL;
+    }
 
-        block_pages = block->length >> TARGET_PAGE_BITS;
-        migration_dirty_pages += block_pages;
+    fds = g_new(int, count);
+    for (i = 0; i < count; i++) {
+        fds[i] = -1;
     }
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
-    qemu_mutex_unlock_iothread();
+    for (i = 0; i < count; i++) {
+        fd = tcp_accept_migration_channel(&local_err);
+        if (fd < 0) {
+            error_report("multifd: %s", error_get_pretty(local_err));
+            error_free(local_err);
+            goto fail;
+        }
+        if (qemu_recv_full(fd, handshake, sizeof(handshake), 0) !=
+            sizeof(handshake)) {
+            error_report("multifd: could not receive handshake");
+            closesocket(fd);
+            goto fail;
+        }
+        id = be32_to_cpu(handshake[1]);
+        if (be32_to_cpu(handshake[0]) != MULTIFD_MAGIC ||
+            id < 0 || id >= count || fds[id] >= 0) {
+            error_report("multifd: invalid handshake");
+            closesocket(fd);
+            goto fail;
+        }
+        fds[id] = fd;
+    }
+
+    multifd_recv = g_new0(MultiFDRecvParam, count);
+    qemu_mutex_init(&multifd_recv_lock);
+    qemu_cond_init(&multifd_recv_cond);
+    multifd_recv_synced = 0;
+    multifd_recv_failed = false;
+    multifd_recv_quit = false;
+    for (i = 0; i < count; i++) {
+        MultiFDRecvParam *p = &multifd_recv[i];
+
+        p->id = i;
+        p->fd = fds[i];
+        qemu_sem_init(&p->sem, 0);
+        qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+    multifd_recv_count = count;
+    g_free(fds);
+    return 0;
+
+fail:
+    for (i = 0; i < count; i++) {
+        if (fds[i] >= 0) {
+            closesocket(fds[i]);
+        }
+    }
+    g_free(fds);
+    return -EINVAL;
+}
+
+/* Wait until every connection has reached its sync packet, then let the
+ * receive threads go on.
+ */
+static int multifd_recv_sync(void)
+{
+    int ret = 0;
+    int i;
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    while (multifd_recv_synced < multifd_recv_count && !multifd_recv_failed) {
+        qemu_cond_wait(&multifd_recv_cond, &multifd_recv_lock);
+    }
+    if (multifd_recv_failed) {
+        ret = -EIO;
+    }
+    multifd_recv_synced = 0;
+    qemu_mutex_unlock(&multifd_recv_lock);
+
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_post(&multifd_recv[i].sem);
+    }
+    return ret;
+}
+
+void migrate_multifd_recv_join(void)
+{
+    int i;
+
+    if (!multifd_recv_count) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    multifd_recv_quit = true;
+    qemu_mutex_unlock(&multifd_recv_lock);
+    for (i = 0; i < multifd_recv_count; i++) {
+        shutdown(multifd_recv[i].fd, 2);
+        qemu_sem_post(&multifd_recv[i].sem);
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_thread_join(&multifd_recv[i].thread);
+        closesocket(multifd_recv[i].fd);
+        qemu_sem_destroy(&multifd_recv[i].sem);
+    }
+    qemu_mutex_destroy(&multifd_recv_lock);
+    qemu_cond_destroy(&multifd_recv_cond);
+    g_free(multifd_recv);
+    multifd_recv = NULL;
+    multifd_recv_count = 0;
+}
+
+/*
+ * Post-copy on the destination
+ *
+ * Once the destination listens, guest RAM is registered with userfaultfd.
+ * The pages discarded by the source, because they were dirtied after they
+ * had been sent, are missing: a thread touching one of them blocks, and
+ * the fault thread asks the source for the page over the return path.
+ * Incoming pages are placed atomically with UFFDIO_COPY, which also wakes
+ * up the threads waiting for them.  A page can arrive twice, the second
+ * copy is dropped.
+ */
+#ifdef CONFIG_USERFAULTFD
+
+static int postcopy_open_userfaultfd(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int ufd;
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ufd < 0) {
+        error_report("Post-copy: userfaultfd not available: %s",
+                     strerror(errno));
+        return -1;
+    }
+    if (ioctl(ufd, UFFDIO_API, &api)) {
+        error_report("Post-copy: UFFDIO_API failed: %s", strerror(errno));
+        close(ufd);
+        return -1;
+    }
+    if (!(api.ioctls & (1ULL << _UFFDIO_REGISTER))) {
+        error_report("Post-copy: userfaultfd cannot register memory");
+        close(ufd);
+        return -1;
+    }
+    return ufd;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    int ufd;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        error_report("Post-copy needs the host page size (%d) to match the "
+                     "target page size (%d)", getpagesize(), TARGET_PAGE_SIZE);
+        return false;
+    }
+
+    ufd = postcopy_open_userfaultfd();
+    if (ufd < 0) {
+        return false;
+    }
+    close(ufd);
+    return true;
+}
+
+/* Called when the source advises post-copy: transparent huge pages would
+ * fill in the holes left by discarded pages
+ */
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
+        qemu_madvise(block->host, block->length, QEMU_MADV_NOHUGEPAGE);
     }
+    return 0;
+}
 
-    qemu_mutex_unlock_ramlist();
+int ram_discard_range(const char *block_name, uint64_t start, uint64_t length)
+{
+    RAMBlock *block;
 
-    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
-    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+    trace_ram_discard_range(block_name, start, length);
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, block_name)) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("Discard for unknown RAMBlock \"%s\"", block_name);
+        return -EINVAL;
+    }
+    if (((start | length) & ~TARGET_PAGE_MASK) || start + length < start ||
+        start + length > block->length) {
+        error_report("Invalid discard for \"%s\": start %" PRIx64
+                     " length %" PRIx64, block_name, start, length);
+        return -EINVAL;
+    }
 
+    if (qemu_madvise(block->host + start, length, QEMU_MADV_DONTNEED)) {
+        error_report("Discard for \"%s\" failed: %s", block_name,
+                     strerror(errno));
+        return -errno;
+    }
     return 0;
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+static void *postcopy_ram_fault_thread(void *opaque)
 {
-    int ret;
-    int i;
-    int64_t t0;
-    int total_sent = 0;
-
-    qemu_mutex_lock_ramlist();
-
-    if (ram_list.version != last_version) {
-        reset_ram_globals();
-    }
+    MigrationIncomingState *mis = opaque;
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+    RAMBlock *block;
+    uint64_t addr;
+    ram_addr_t offset;
+    ssize_t ret;
 
-    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+    pfd[0].fd = mis->userfault_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = event_notifier_get_fd(&mis->userfault_quit);
+    pfd[1].events = POLLIN;
 
-    t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+    while (true) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("Post-copy: fault thread poll failed: %s",
+                         strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
 
-        bytes_sent = ram_find_and_save_block(f, false);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("Post-copy: failed to read a fault: %s",
+                         ret < 0 ? strerror(errno) : "short read");
             break;
         }
-        total_sent += bytes_sent;
-        acct_info.iterations++;
-        check_guest_throttling();
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) / 1000000;
-            if (t1 > MAX_WAIT) {
-                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
-                        t1, i);
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("Post-copy: unexpected userfaultfd event %d",
+                         msg.event);
+            continue;
+        }
+
+        /* The RAMBlock list does not change during incoming migration */
+        addr = msg.arg.pagefault.address;
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (addr >= (uintptr_t)block->host &&
+                addr < (uintptr_t)block->host + block->length) {
                 break;
             }
         }
-        i++;
+        if (!block) {
+            error_report("Post-copy: fault outside of guest RAM at %#" PRIx64,
+                         addr);
+            break;
+        }
+
+        offset = (addr - (uintptr_t)block->host) & TARGET_PAGE_MASK;
+        trace_postcopy_ram_fault_thread_request(addr, block->idstr, offset);
+        migrate_send_rp_req_pages(mis, block->idstr, offset, TARGET_PAGE_SIZE);
     }
 
-    qemu_mutex_unlock_ramlist();
+    return NULL;
+}
 
-    /*
-     * Must occur before EOS (or any QEMUFile operation)
-     * because of RDMA protocol.
-     */
-    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+/* Called when the destination starts listening, before the devices load */
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    const uint64_t needed = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE);
+    RAMBlock *block;
 
-    bytes_transferred += total_sent;
+    mis->userfault_fd = postcopy_open_userfaultfd();
+    if (mis->userfault_fd < 0) {
+        return -1;
+    }
 
-    /*
-     * Do not count these 8 bytes into total_sent, so that we can
-     * return 0 if no page had been dirtied.
-     */
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    bytes_transferred += 8;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg;
+
+        reg.range.start = (uintptr_t)block->host;
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg)) {
+            error_report("Post-copy: failed to register RAMBlock \"%s\": %s",
+                         block->idstr, strerror(errno));
+            goto fail;
+        }
+        if ((reg.ioctls & needed) != needed) {
+            error_report("Post-copy: cannot place pages in RAMBlock \"%s\"",
+                         block->idstr);
+            goto fail;
+        }
+    }
 
-    ret = qemu_file_get_error(f);
-    if (ret < 0) {
-        return ret;
+    mis->postcopy_tmp_page = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    if (event_notifier_init(&mis->userfault_quit, false)) {
+        error_report("Post-copy: failed to create the fault thread notifier");
+        goto fail;
     }
+    mis->have_fault_thread = true;
+    qemu_thread_create(&mis->fault_thread, "postcopy_fault",
+                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    return 0;
 
-    return total_sent;
+fail:
+    close(mis->userfault_fd);
+    mis->userfault_fd = -1;
+    return -1;
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
-    qemu_mutex_lock_ramlist();
-    migration_bitmap_sync();
-
-    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
-
-    /* try transferring iterative blocks of memory */
+    RAMBlock *block;
+    int ret = 0;
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+    if (mis->have_fault_thread) {
+        event_notifier_set(&mis->userfault_quit);
+        qemu_thread_join(&mis->fault_thread);
+        event_notifier_cleanup(&mis->userfault_quit);
+        mis->have_fault_thread = false;
+    }
 
-        bytes_sent = ram_find_and_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
-            break;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (mis->userfault_fd >= 0) {
+            struct uffdio_range range;
+
+            range.start = (uintptr_t)block->host;
+            range.len = block->length;
+            if (ioctl(mis->userfault_fd, UFFDIO_UNREGISTER, &range)) {
+                error_report("Post-copy: failed to unregister RAMBlock "
+                             "\"%s\": %s", block->idstr, strerror(errno));
+                ret = -errno;
+            }
         }
-        bytes_transferred += bytes_sent;
+        qemu_madvise(block->host, block->length, QEMU_MADV_HUGEPAGE);
     }
 
-    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    migration_end();
+    if (mis->userfault_fd >= 0) {
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+    }
+    qemu_vfree(mis->postcopy_tmp_page);
+    mis->postcopy_tmp_page = NULL;
 
-    qemu_mutex_unlock_ramlist();
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    return ret;
+}
 
+/* Copy the page at @from to @host and wake up the threads waiting on it */
+static int postcopy_place_page(MigrationIncomingState *mis, void *host,
+                               void *from)
+{
+    struct uffdio_copy copy;
+
+    copy.dst = (uintptr_t)host;
+    copy.src = (uintptr_t)from;
+    copy.len = TARGET_PAGE_SIZE;
+    copy.mode = 0;
+    if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy) && errno != EEXIST) {
+        error_report("Post-copy: failed to place page at %p: %s", host,
+                     strerror(errno));
+        return -errno;
+    }
     return 0;
 }
 
-static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+/* Place a page filled with @ch at @host */
+static int postcopy_place_page_fill(MigrationIncomingState *mis, void *host,
+                                    uint8_t ch)
 {
-    uint64_t remaining_size;
+    struct uffdio_zeropage zero;
 
-    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    if (ch) {
+        memset(mis->postcopy_tmp_page, ch, TARGET_PAGE_SIZE);
+        return postcopy_place_page(mis, host, mis->postcopy_tmp_page);
+    }
 
-    if (remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        migration_bitmap_sync();
-        qemu_mutex_unlock_iothread();
-        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    zero.range.start = (uintptr_t)host;
+    zero.range.len = TARGET_PAGE_SIZE;
+    zero.mode = 0;
+    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero) && errno != EEXIST) {
+        error_report("Post-copy: failed to place zero page at %p: %s", host,
+                     strerror(errno));
+        return -errno;
     }
-    return remaining_size;
+    return 0;
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
-{
-    unsigned int xh_len;
-    int xh_flags;
-
-    if (!xbzrle_decoded_buf) {
-        xbzrle_decoded_buf = g_malloc(TARGET_PAGE_SIZE);
-    }
+#else /* !CONFIG_USERFAULTFD */
 
-    /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("Post-copy is not supported on this host");
+    return false;
+}
 
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
-        error_report("Failed to load XBZRLE page - wrong compression!");
-        return -1;
-    }
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    return -1;
+}
 
-    if (xh_len > TARGET_PAGE_SIZE) {
-        error_report("Failed to load XBZRLE page - len overflow!");
-        return -1;
-    }
-    /* load data and decode */
-    qemu_get_buffer(f, xbzrle_decoded_buf, xh_len);
+int ram_discard_range(const char *block_name, uint64_t start, uint64_t length)
+{
+    return -1;
+}
 
-    /* decode RLE */
-    if (xbzrle_decode_buffer(xbzrle_decoded_buf, xh_len, host,
-                             TARGET_PAGE_SIZE) == -1) {
-        error_report("Failed to load XBZRLE page - decode error!");
-        return -1;
-    }
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    return -1;
+}
 
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
     return 0;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static int postcopy_place_page(MigrationIncomingState *mis, void *host,
+                               void *from)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
+    return -1;
+}
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block || block->length <= offset) {
-            error_report("Ack, bad migration stream!");
-            return NULL;
-        }
+static int postcopy_place_page_fill(MigrationIncomingState *mis, void *host,
+                                    uint8_t ch)
+{
+    return -1;
+}
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
-    }
+#endif /* CONFIG_USERFAULTFD */
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+/* Load the pages of one slice of a block from a fixed-ram file.  Pages
+ * without data in the file are zero.
+ */
+static void *fixed_ram_load_thread(void *opaque)
+{
+    FixedRamLoadParam *p = opaque;
+    uint8_t *host = memory_region_get_ram_ptr(p->block->mr);
+    unsigned long page = p->start, next;
+    int ret;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)) && block->length > offset) {
-            return memory_region_get_ram_ptr(block->mr) + offset;
+    while (page < p->end) {
+        next = find_next_zero_bit(p->bmap, p->end, page);
+        if (next > page) {
+            ret = fixed_ram_pread(p->fd, host + (page << TARGET_PAGE_BITS),
+                                  (next - page) << TARGET_PAGE_BITS,
+                                  p->pages_offset +
+                                  ((uint64_t)page << TARGET_PAGE_BITS));
+            if (ret < 0) {
+                p->ret = ret;
+                break;
+            }
         }
-    }
+        page = next;
 
-    error_report("Can't find block %s!", id);
+        next = find_next_bit(p->bmap, p->end, page);
+        for (; page < next; page++) {
+            ram_handle_compressed(host + (page << TARGET_PAGE_BITS), 0,
+                                  TARGET_PAGE_SIZE);
+        }
+    }
     return NULL;
 }
 
-/*
- * If a page (or a whole RDMA chunk) has been
- * determined to be zero, then zap it.
+/* Load @block from a fixed-ram file, with as many threads as set with
+ * multifd-channels, then go on with the main stream after its pages
  */
-void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+static int fixed_ram_load_block(QEMUFile *f, RAMBlock *block,
+                                uint64_t bitmap_offset, uint64_t pages_offset)
 {
-    if (ch != 0 || !is_zero_range(host, size)) {
-        memset(host, ch, size);
+    uint64_t pages = block->length >> TARGET_PAGE_BITS;
+    uint64_t bits = ROUND_UP(pages, 64);
+    int count = migrate_multifd_channels();
+    int fd = qemu_get_fd(f);
+    FixedRamLoadParam *params;
+    unsigned long *bmap;
+    int i, ret;
+
+    bmap = bitmap_new(bits);
+    ret = fixed_ram_pread(fd, (uint8_t *)bmap, bits / 8, bitmap_offset);
+    if (ret < 0) {
+        error_report("fixed-ram: could not read the page bitmap of \"%s\": %s",
+                     block->idstr, strerror(-ret));
+        g_free(bmap);
+        return ret;
+    }
+    fixed_ram_bitmap_swap(bmap, bits);
+
+    params = g_new0(FixedRamLoadParam, count);
+    for (i = 0; i < count; i++) {
+        FixedRamLoadParam *p = &params[i];
+
+        p->block = block;
+        p->fd = fd;
+        p->bmap = bmap;
+        p->pages_offset = pages_offset;
+        p->start = pages * i / count;
+        p->end = pages * (i + 1) / count;
+        qemu_thread_create(&p->thread, "fixed_ram_load",
+                           fixed_ram_load_thread, p, QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < count; i++) {
+        qemu_thread_join(&params[i].thread);
+        if (params[i].ret < 0 && !ret) {
+            ret = params[i].ret;
+        }
     }
+    g_free(params);
+    g_free(bmap);
+
+    if (ret < 0) {
+        error_report("fixed-ram: could not read RAM of \"%s\": %s",
+                     block->idstr, strerror(-ret));
+        return ret;
+    }
+    return qemu_file_fd_seek(f, pages_offset + block->length);
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
+    bool postcopy_running;
 
     seq_iter++;
 
+    /* Only whole pages can be placed while the guest runs */
+    postcopy_running = mis->postcopy_state == POSTCOPY_INCOMING_LISTENING ||
+                       mis->postcopy_state == POSTCOPY_INCOMING_RUNNING;
+
     if (version_id != 4) {
         ret = -EINVAL;
     }
 
+    /* The incoming migration thread loads RAM without the iothread lock.
+     * Blocks are only looked up under the ramlist lock, which is never held
+     * while waiting for the stream; once found, a block stays put for the
+     * whole migration.
+     */
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        DecompressPage *page;
+        bool fixed_ram;
         void *host;
         uint8_t ch;
+        int len;
 
         addr = qemu_get_be64(f);
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
+        if (postcopy_running &&
+            (flags & (RAM_SAVE_FLAG_XBZRLE | RAM_SAVE_FLAG_COMPRESS_PAGE |
+                      RAM_SAVE_FLAG_MULTIFD_SYNC))) {
+            error_report("Unexpected migration flags %#x in post-copy", flags);
+            ret = -EINVAL;
+            break;
+        }
+
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
+        case RAM_SAVE_FLAG_MEM_SIZE_FIXED_RAM:
             /* Synchronize RAM block list */
+            fixed_ram = (flags & ~RAM_SAVE_FLAG_CONTINUE) ==
+                        RAM_SAVE_FLAG_MEM_SIZE_FIXED_RAM;
             total_ram_bytes = addr;
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 uint8_t len;
                 char id[256];
                 ram_addr_t length;
+                uint64_t bitmap_offset = 0, pages_offset = 0;
 
                 len = qemu_get_byte(f);
                 qemu_get_buffer(f, (uint8_t *)id, len);
                 id[len] = 0;
                 length = qemu_get_be64(f);
+                if (fixed_ram) {
+                    bitmap_offset = qemu_get_be64(f);
+                    pages_offset = qemu_get_be64(f);
+                }
 
+                qemu_mutex_lock_ramlist();
                 QTAILQ_FOREACH(block, &ram_list.blocks, next) {
                     if (!strncmp(id, block->idstr, sizeof(id))) {
                         if (block->length != length) {
@@ -1094,12 +3137,17 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                         break;
                     }
                 }
+                qemu_mutex_unlock_ramlist();
 
                 if (!block) {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
                     ret = -EINVAL;
                 }
+                if (!ret && fixed_ram) {
+                    ret = fixed_ram_load_block(f, block, bitmap_offset,
+                                               pages_offset);
+                }
 
                 total_ram_bytes -= length;
             }
@@ -1113,7 +3161,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (postcopy_running) {
+                ret = postcopy_place_page_fill(mis, host, ch);
+            } else {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            }
             break;
         case RAM_SAVE_FLAG_PAGE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1123,7 +3175,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (postcopy_running) {
+                qemu_get_buffer(f, mis->postcopy_tmp_page, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, mis->postcopy_tmp_page);
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
             break;
         case RAM_SAVE_FLAG_XBZRLE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1140,6 +3197,37 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            len = qemu_get_be32(f);
+            if (len <= 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                error_report("Invalid compressed data length: %d", len);
+                ret = -EINVAL;
+                break;
+            }
+            page = decompress_get_page(host, RAM_SAVE_FLAG_COMPRESS_PAGE, len);
+            qemu_get_buffer(f, page->data, len);
+            break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            len = qemu_get_be32(f);
+            if (!multifd_recv_count) {
+                ret = multifd_recv_setup(len);
+            } else if (len != multifd_recv_count) {
+                error_report("Number of multifd connections changed from %d "
+                             "to %d", multifd_recv_count, len);
+                ret = -EINVAL;
+            }
+            if (!ret && multifd_recv_sync() < 0) {
+                error_report("multifd connection failed");
+                ret = -EIO;
+            }
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1157,23 +3245,40 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (wait_for_decompress_done() < 0) {
+        error_report("Failed to decompress page");
+        if (!ret) {
+            ret = -EINVAL;
+        }
+    }
+
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
 }
 
+static bool ram_can_postcopy(void *opaque)
+{
+    return migrate_postcopy_ram();
+}
+
 static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
     .save_live_pending = ram_save_pending,
+    .can_postcopy = ram_can_postcopy,
     .load_state = ram_load,
+    .load_state_unlocked = true,
     .cancel = ram_migration_cancel,
 };
 
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&page_request_lock);
+    qemu_mutex_init(&multifd_send_lock);
+    qemu_cond_init(&multifd_send_cond);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
 
@@ -1377,51 +3482,113 @@ TargetInfo *qmp_query_target(Error **errp)
     return info;
 }
 
+/* To reduce the dirty rate, auto-converge keeps the VCPUs out of the VM
+   for a percentage of the time: after each timeslice of running, every
+   VCPU sleeps for timeslice * percentage / (100 - percentage).  The
+   migration thread adjusts the percentage after each dirty rate
+   measurement.  Everything here is protected by the iothread lock.
+*/
+#define MIG_THROTTLE_TIMESLICE_NS 10000000 /* 10 ms */
+#define MIG_THROTTLE_PERCENTAGE_MAX 99
+
+static QEMUTimer *mig_throttle_timer;
+static int mig_throttle_percentage;
+/* VCPUs that have not run their sleep yet */
+static int mig_throttle_pending;
+
 /* Stub function that's gets run on the vcpu when its brought out of the
    VM to run inside qemu via async_run_on_cpu()*/
 static void mig_sleep_cpu(void *opq)
 {
+    double pct = mig_throttle_percentage / 100.0;
+    int64_t sleep_ns = MIG_THROTTLE_TIMESLICE_NS * pct / (1 - pct);
+
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep(sleep_ns / 1000);
     qemu_mutex_lock_iothread();
+    mig_throttle_pending--;
 }
 
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
+static void mig_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
+    double pct;
 
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
+    if (!mig_throttle_percentage) {
+        return;
     }
-    qemu_mutex_unlock_iothread();
+
+    /* A VCPU that has not slept yet, e.g. because the guest is stopped,
+     * does not need more
+     */
+    if (!mig_throttle_pending) {
+        CPU_FOREACH(cpu) {
+            mig_throttle_pending++;
+            async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
+        }
+    }
+
+    pct = mig_throttle_percentage / 100.0;
+    timer_mod(mig_throttle_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+              MIG_THROTTLE_TIMESLICE_NS / (1 - pct));
 }
 
-static void check_guest_throttling(void)
+static void mig_throttle_set(int percentage)
 {
-    static int64_t t0;
-    int64_t        t1;
+    mig_throttle_percentage = MIN(percentage, MIG_THROTTLE_PERCENTAGE_MAX);
+    trace_migration_throttle(mig_throttle_percentage);
 
-    if (!mig_throttle_on) {
-        return;
+    if (!mig_throttle_timer) {
+        mig_throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
+                                          mig_throttle_timer_tick, NULL);
     }
+    if (!timer_pending(mig_throttle_timer)) {
+        timer_mod(mig_throttle_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                  MIG_THROTTLE_TIMESLICE_NS);
+    }
+}
 
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
+static void mig_throttle_stop(void)
+{
+    if (mig_throttle_percentage) {
+        trace_migration_throttle(0);
     }
+    mig_throttle_percentage = 0;
+    if (mig_throttle_timer) {
+        timer_del(mig_throttle_timer);
+    }
+}
 
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+/* The guest still dirties memory faster than it can be sent */
+static void mig_throttle_guest_down(void)
+{
+    if (!mig_throttle_percentage) {
+        mig_throttle_set(migrate_cpu_throttle_initial());
+    } else {
+        mig_throttle_set(mig_throttle_percentage +
+                         migrate_cpu_throttle_increment());
+    }
+}
 
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
+/* The guest dirties memory well below the link speed */
+static void mig_throttle_guest_up(void)
+{
+    int percentage;
+
+    if (!mig_throttle_percentage) {
+        return;
+    }
+    percentage = mig_throttle_percentage - migrate_cpu_throttle_increment();
+    if (percentage > 0) {
+        mig_throttle_set(percentage);
+    } else {
+        mig_throttle_stop();
     }
 }
+
+int mig_throttle_get_percentage(void)
+{
+    return mig_throttle_percentage;
+}
@@ -36,6 +36,7 @@
 #include "qmp-commands.h"
 #include "qemu/timer.h"
 #include "qapi-event.h"
+#include "migration/migration.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -51,8 +52,20 @@
 #include <windows.h>
 #endif
 
+/**
+ * A BdrvDirtyBitmap can be in two states:
+ * - Active:  Tracks writes to the device.  @successor is NULL.
+ * - Frozen:  Owned by an operation such as an incremental backup.  Writes
+ *            are recorded in @successor instead and the bitmap can be
+ *            neither removed nor cleared.
+ */
 struct BdrvDirtyBitmap {
-    HBitmap *bitmap;
+    HBitmap *bitmap;            /* Dirty sector bitmap implementation */
+    BdrvDirtyBitmap *successor; /* Anonymous child; implies frozen status */
+    char *name;                 /* Optional non-empty unique ID */
+    int64_t size;               /* Size of the bitmap in sectors */
+    bool persistent;            /* Saved by the image format on close */
+    Error *migration_blocker;   /* Set while the bitmap is persistent */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -1027,6 +1040,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
     return 0;
 
 free_and_fail:
+    bdrv_release_named_dirty_bitmaps(bs);
     bs->file = NULL;
     g_free(bs->opaque);
     bs->opaque = NULL;
@@ -1847,6 +1861,7 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_unref(backing_hd);
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_named_dirty_bitmaps(bs);
         g_free(bs->opaque);
         bs->opaque = NULL;
         bs->drv = NULL;
@@ -2034,6 +2049,12 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->iostatus_enabled   = bs_src->iostatus_enabled;
     bs_dest->iostatus           = bs_src->iostatus;
 
+    /* latency statistics */
+    bs_dest->stats.intervals    = bs_src->stats.intervals;
+    memcpy(bs_dest->stats.latency_histogram,
+           bs_src->stats.latency_histogram,
+           sizeof(bs_dest->stats.latency_histogram));
+
     /* dirty bitmap */
     bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
@@ -2139,13 +2160,14 @@ static void bdrv_delete(BlockDriverState *bs)
     assert(!bs->job);
     assert(bdrv_op_blocker_is_empty(bs));
     assert(!bs->refcnt);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     bdrv_close(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    block_acct_cleanup(&bs->stats);
     g_free(bs);
 }
 
@@ -2314,6 +2336,7 @@ static void tracked_request_end(BdrvTrackedRequest *req)
     }
 
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->bs->tracked_requests_tree, &req->overlap_node);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -2339,6 +2362,8 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    interval_tree_insert(&bs->tracked_requests_tree, &req->overlap_node,
+                         offset, offset + bytes);
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
@@ -2352,8 +2377,21 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
         req->serialising = true;
     }
 
-    req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
-    req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    overlap_offset = MIN(req->overlap_offset, overlap_offset);
+    overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    if (overlap_offset != req->overlap_offset ||
+        overlap_bytes != req->overlap_bytes) {
+        req->overlap_offset = overlap_offset;
+        req->overlap_bytes = overlap_bytes;
+
+        /* Re-index the request under its widened range */
+        interval_tree_remove(&req->bs->tracked_requests_tree,
+                             &req->overlap_node);
+        interval_tree_insert(&req->bs->tracked_requests_tree,
+                             &req->overlap_node, overlap_offset,
+                             overlap_offset + overlap_bytes);
+    }
 }
 
 /**
@@ -2390,60 +2428,57 @@ static int bdrv_get_cluster_size(BlockDriverState *bs)
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t offset, unsigned int bytes)
+/* Called for each tracked request whose overlap range intersects that of
+ * @opaque; returns true if @opaque has to wait for it.
+ */
+static bool tracked_request_conflicts(IntervalTreeNode *node, void *opaque)
 {
-    /*        aaaa   bbbb */
-    if (offset >= req->overlap_offset + req->overlap_bytes) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->overlap_offset >= offset + bytes) {
+    BdrvTrackedRequest *self = opaque;
+    BdrvTrackedRequest *req = container_of(node, BdrvTrackedRequest,
+                                           overlap_node);
+
+    if (req == self || (!req->serialising && !self->serialising)) {
         return false;
     }
-    return true;
+
+    /* Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /* If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case). */
+    return !req->waiting_for;
 }
 
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
+    IntervalTreeNode *node;
     BdrvTrackedRequest *req;
-    bool retry;
     bool waited = false;
 
     if (!bs->serialising_in_flight) {
         return false;
     }
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
-            }
+    for (;;) {
+        node = interval_tree_find(&bs->tracked_requests_tree,
+                                  self->overlap_offset,
+                                  self->overlap_offset + self->overlap_bytes,
+                                  tracked_request_conflicts, self);
+        if (!node) {
+            break;
         }
-    } while (retry);
+
+        req = container_of(node, BdrvTrackedRequest, overlap_node);
+        self->waiting_for = req;
+        qemu_co_queue_wait(&req->wait_queue);
+        self->waiting_for = NULL;
+        waited = true;
+    }
 
     return waited;
 }
@@ -3478,6 +3513,10 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -ENOTSUP;
     if (bs->read_only)
         return -EACCES;
+    /* Dirty bitmaps cannot be resized */
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        return -EBUSY;
+    }
 
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
@@ -5089,7 +5128,8 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return -EROFS;
     }
 
-    bdrv_reset_dirty(bs, sector_num, nb_sectors);
+    /* Whatever is read back from the discarded range may have changed */
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     /* Do nothing if disabled.  */
     if (!(bs->open_flags & BDRV_O_UNMAP)) {
@@ -5319,16 +5359,77 @@ bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
     return true;
 }
 
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
+/**
+ * Chooses a default granularity based on the existing cluster size,
+ * but clamped between [4K, 64K]. Defaults to 64K in the case that there
+ * is no cluster size information available.
+ */
+uint32_t bdrv_get_default_bitmap_granularity(BlockDriverState *bs)
+{
+    BlockDriverInfo bdi;
+    uint32_t granularity;
+
+    if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size != 0) {
+        granularity = MAX(4096, bdi.cluster_size);
+        granularity = MIN(65536, granularity);
+    } else {
+        granularity = 65536;
+    }
+
+    return granularity;
+}
+
+/* Check whether the image format of @bs can store a persistent dirty bitmap
+ * with the given granularity.
+ */
+bool bdrv_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                 uint32_t granularity, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM,
+                  bdrv_get_device_name(bs));
+        return false;
+    }
+    if (!drv->bdrv_can_store_dirty_bitmap) {
+        error_setg(errp, "Image format '%s' cannot store dirty bitmaps",
+                   drv->format_name);
+        return false;
+    }
+    return drv->bdrv_can_store_dirty_bitmap(bs, name, granularity, errp);
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BdrvDirtyBitmap *bm;
+
+    assert(name);
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->name && !strcmp(name, bm->name)) {
+            return bm;
+        }
+    }
+    return NULL;
+}
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          uint32_t granularity,
+                                          const char *name,
                                           Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
+    uint32_t sector_granularity;
 
     assert((granularity & (granularity - 1)) == 0);
 
-    granularity >>= BDRV_SECTOR_BITS;
-    assert(granularity);
+    if (name && bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Bitmap already exists: %s", name);
+        return NULL;
+    }
+    sector_granularity = granularity >> BDRV_SECTOR_BITS;
+    assert(sector_granularity);
     bitmap_size = bdrv_nb_sectors(bs);
     if (bitmap_size < 0) {
         error_setg_errno(errp, -bitmap_size, "could not get length of device");
@@ -5336,24 +5437,121 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
         return NULL;
     }
     bitmap = g_new0(BdrvDirtyBitmap, 1);
-    bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(sector_granularity) - 1);
+    bitmap->size = bitmap_size;
+    bitmap->name = g_strdup(name);
     QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
     return bitmap;
 }
 
+bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->successor;
+}
+
+/**
+ * Create a successor bitmap destined to replace this bitmap after an
+ * operation.  Requires that the bitmap is not frozen and has no successor.
+ */
+int bdrv_dirty_bitmap_create_successor(BlockDriverState *bs,
+                                       BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    uint32_t granularity;
+    BdrvDirtyBitmap *child;
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Cannot create a successor for a bitmap that is "
+                   "currently frozen");
+        return -1;
+    }
+
+    /* Create an anonymous successor */
+    granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    child = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
+    if (!child) {
+        return -1;
+    }
+
+    bitmap->successor = child;
+    return 0;
+}
+
+/**
+ * For a bitmap with a successor, take over the writes recorded by the
+ * successor and delete it.  The data recorded before the operation is
+ * dropped.  Returns @bitmap, which keeps its name.
+ */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BlockDriverState *bs,
+                                            BdrvDirtyBitmap *bitmap,
+                                            Error **errp)
+{
+    BdrvDirtyBitmap *successor = bitmap->successor;
+    HBitmap *tmp;
+
+    if (!successor) {
+        error_setg(errp, "Cannot relinquish control if there's no successor");
+        return NULL;
+    }
+
+    tmp = bitmap->bitmap;
+    bitmap->bitmap = successor->bitmap;
+    successor->bitmap = tmp;
+    bitmap->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, successor);
+    return bitmap;
+}
+
+/**
+ * When the operation fails, merge the writes recorded by the successor back
+ * into @parent so that nothing is lost, and unfreeze it.
+ */
+BdrvDirtyBitmap *bdrv_reclaim_dirty_bitmap(BlockDriverState *bs,
+                                           BdrvDirtyBitmap *parent,
+                                           Error **errp)
+{
+    BdrvDirtyBitmap *successor = parent->successor;
+
+    if (!successor) {
+        error_setg(errp, "Cannot reclaim a successor when none is present");
+        return NULL;
+    }
+
+    hbitmap_merge(parent->bitmap, successor->bitmap);
+    parent->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, successor);
+    return parent;
+}
+
 void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     BdrvDirtyBitmap *bm, *next;
     QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
         if (bm == bitmap) {
+            assert(!bdrv_dirty_bitmap_frozen(bm));
+            bdrv_dirty_bitmap_set_persistent(bitmap, false);
             QLIST_REMOVE(bitmap, list);
             hbitmap_free(bitmap->bitmap);
+            g_free(bitmap->name);
             g_free(bitmap);
             return;
         }
     }
 }
 
+/* Drop the bitmaps that belong to the image rather than to a block job or
+ * to migration, called when the image is closed.
+ */
+void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->name) {
+            bdrv_release_dirty_bitmap(bs, bm);
+        }
+    }
+}
+
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bm;
@@ -5364,8 +5562,11 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         BlockDirtyInfo *info = g_new0(BlockDirtyInfo, 1);
         BlockDirtyInfoList *entry = g_new0(BlockDirtyInfoList, 1);
         info->count = bdrv_get_dirty_count(bs, bm);
-        info->granularity =
-            ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bm->bitmap));
+        info->granularity = bdrv_dirty_bitmap_granularity(bm);
+        info->has_name = !!bm->name;
+        info->name = g_strdup(bm->name);
+        info->frozen = bdrv_dirty_bitmap_frozen(bm);
+        info->persistent = bm->persistent;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -5383,26 +5584,99 @@ int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap, int64_t sector
     }
 }
 
+uint32_t bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+bool bdrv_dirty_bitmap_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap,
+                                      bool persistent)
+{
+    assert(bitmap->name || !persistent);
+    if (persistent == bitmap->persistent) {
+        return;
+    }
+
+    /* The source would store the bitmap when it exits, after the destination
+     * took over the image */
+    if (persistent) {
+        error_setg(&bitmap->migration_blocker, "Persistent dirty bitmap '%s' "
+                   "does not support live migration", bitmap->name);
+        migrate_add_blocker(bitmap->migration_blocker);
+    } else {
+        migrate_del_blocker(bitmap->migration_blocker);
+        error_free(bitmap->migration_blocker);
+        bitmap->migration_blocker = NULL;
+    }
+    bitmap->persistent = persistent;
+}
+
+/* Iterate over the bitmaps of @bs, start with @bitmap == NULL */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
 void bdrv_dirty_iter_init(BlockDriverState *bs,
                           BdrvDirtyBitmap *bitmap, HBitmapIter *hbi)
 {
     hbitmap_iter_init(hbi, bitmap->bitmap, 0);
 }
 
+void bdrv_set_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           int64_t cur_sector, int nr_sectors)
+{
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
+    hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_reset_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             int64_t cur_sector, int nr_sectors)
+{
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
+    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
+    if (bitmap->size) {
+        hbitmap_reset(bitmap->bitmap, 0, bitmap->size);
+    }
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        /* Frozen bitmaps record writes through their successor */
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            continue;
+        }
         hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
     }
 }
 
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors)
+void bdrv_set_dirty_all(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        if (bdrv_dirty_bitmap_frozen(bitmap) || !bitmap->size) {
+            continue;
+        }
+        hbitmap_set(bitmap->bitmap, 0, bitmap->size);
     }
 }
 
@@ -5411,6 +5685,35 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
     return hbitmap_count(bitmap->bitmap);
 }
 
+uint64_t bdrv_dirty_bitmap_serialization_size(BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_serialization_size(bitmap->bitmap);
+}
+
+/* A frozen bitmap is serialized together with its successor, so that the
+ * result covers all writes since the bitmap was last cleared.
+ */
+void bdrv_dirty_bitmap_serialize(BdrvDirtyBitmap *bitmap, uint8_t *buf)
+{
+    hbitmap_serialize(bitmap->bitmap, buf);
+    if (bitmap->successor) {
+        uint64_t i, size = hbitmap_serialization_size(bitmap->bitmap);
+        uint8_t *tmp = g_malloc(size);
+
+        hbitmap_serialize(bitmap->successor->bitmap, tmp);
+        for (i = 0; i < size; i++) {
+            buf[i] |= tmp[i];
+        }
+        g_free(tmp);
+    }
+}
+
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap,
+                                   const uint8_t *buf)
+{
+    hbitmap_deserialize(bitmap->bitmap, buf);
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -26,6 +26,123 @@
 #include "block/block_int.h"
 #include "qemu/timer.h"
 
+/* Default histogram boundaries, in ns: powers of four from 1 us to ~4 s */
+static const uint64_t default_latency_boundaries[] = {
+    1000ULL, 4000ULL, 16000ULL, 64000ULL, 256000ULL,
+    1024000ULL, 4096000ULL, 16384000ULL, 65536000ULL,
+    262144000ULL, 1048576000ULL, 4194304000ULL,
+};
+
+void block_acct_cleanup(BlockAcctStats *stats)
+{
+    BlockAcctTimedStats *s, *next;
+    int i;
+
+    QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
+        g_free(s);
+    }
+    QSLIST_INIT(&stats->intervals);
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+
+        g_free(hist->boundaries);
+        g_free(hist->bins);
+        memset(hist, 0, sizeof(*hist));
+    }
+}
+
+void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
+{
+    BlockAcctTimedStats *s;
+    unsigned i;
+
+    s = g_new0(BlockAcctTimedStats, 1);
+    s->interval_length = interval_length;
+    QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        timed_average_init(&s->latency[i], QEMU_CLOCK_REALTIME,
+                           (uint64_t) interval_length * get_ticks_per_sec());
+    }
+}
+
+BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
+                                              BlockAcctTimedStats *s)
+{
+    if (s == NULL) {
+        return QSLIST_FIRST(&stats->intervals);
+    } else {
+        return QSLIST_NEXT(s, entries);
+    }
+}
+
+/* Average number of requests of @type in flight during the window, by
+ * Little's law: the time spent by all requests that completed in the window
+ * divided by the length of the window.  Unlike a live counter of requests
+ * in flight this stays correct when a device never completes a request that
+ * it started to account.
+ */
+double block_acct_queue_depth(BlockAcctTimedStats *stats,
+                              enum BlockAcctType type)
+{
+    uint64_t sum, elapsed;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    sum = timed_average_sum(&stats->latency[type], &elapsed);
+
+    return elapsed ? (double) sum / elapsed : 0;
+}
+
+void block_acct_set_latency_histogram(BlockAcctStats *stats,
+                                      const uint64_t *boundaries,
+                                      int nboundaries)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+
+        g_free(hist->boundaries);
+        g_free(hist->bins);
+        memset(hist, 0, sizeof(*hist));
+
+        if (nboundaries > 0) {
+            hist->nbins = nboundaries + 1;
+            hist->boundaries = g_memdup(boundaries,
+                                        nboundaries * sizeof(uint64_t));
+            hist->bins = g_new0(uint64_t, hist->nbins);
+        }
+    }
+}
+
+void block_acct_set_default_latency_histogram(BlockAcctStats *stats)
+{
+    block_acct_set_latency_histogram(stats, default_latency_boundaries,
+                                     ARRAY_SIZE(default_latency_boundaries));
+}
+
+static void latency_histogram_account(BlockLatencyHistogram *hist,
+                                      uint64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1;
+
+    /* Find the first boundary greater than @latency_ns; boundaries are
+     * sorted, so the bin is the number of boundaries not above it.
+     */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (hist->boundaries[mid] <= latency_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    hist->bins[lo]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -38,12 +155,26 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    BlockAcctTimedStats *s;
+    BlockLatencyHistogram *hist;
+    int64_t latency_ns;
+
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
+    latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+
     stats->nr_bytes[cookie->type] += cookie->bytes;
     stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] +=
-        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+    stats->total_time_ns[cookie->type] += latency_ns;
+
+    QSLIST_FOREACH(s, &stats->intervals, entries) {
+        timed_average_account(&s->latency[cookie->type], latency_ns);
+    }
+
+    hist = &stats->latency_histogram[cookie->type];
+    if (hist->nbins) {
+        latency_histogram_account(hist, latency_ns);
+    }
 }
 
 
@@ -25,6 +25,13 @@
 #define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
 #define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
 
+/* Clusters are copied by up to BACKUP_MAX_WORKERS coroutines in parallel.
+ * Consecutive clusters that need copying are merged into a single read of
+ * up to BACKUP_MAX_CHUNK_CLUSTERS clusters.
+ */
+#define BACKUP_MAX_WORKERS 8
+#define BACKUP_MAX_CHUNK_CLUSTERS 16
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -37,16 +44,36 @@ typedef struct CowRequest {
 typedef struct BackupBlockJob {
     BlockJob common;
     BlockDriverState *target;
+    /* bitmap for sync=incremental */
+    BdrvDirtyBitmap *sync_bitmap;
     MirrorSyncMode sync_mode;
     RateLimit limit;
     BlockdevOnError on_source_error;
     BlockdevOnError on_target_error;
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
-    HBitmap *bitmap;
+    /* clusters that still have to be copied */
+    HBitmap *copy_bitmap;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* copy workers, see backup_run_copy() */
+    int workers_in_flight;
+    CoQueue worker_queue;
+    int ret;                /* first error of a worker, or 0 */
+    bool error_is_read;
+    int64_t error_cluster;  /* first cluster of a chunk that failed */
+
+    /* before-write notifiers waiting for a copy */
+    int guest_cow_in_flight;
+    CoQueue guest_cow_queue;
 } BackupBlockJob;
 
+typedef struct BackupOp {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int nb_clusters;
+} BackupOp;
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -84,6 +111,50 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Write @nb_sectors of @buf to the target.  Clusters that read as zeroes
+ * become write_zeroes requests so that the target stays sparse.
+ */
+static int coroutine_fn backup_write_chunk(BackupBlockJob *job,
+                                           int64_t sector_num, int nb_sectors,
+                                           uint8_t *buf)
+{
+    struct iovec iov;
+    QEMUIOVector qiov;
+    bool zero;
+    int i, n, ret;
+
+    for (i = 0; i < nb_sectors; i += n) {
+        zero = buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                              MIN(BACKUP_SECTORS_PER_CLUSTER, nb_sectors - i) *
+                              BDRV_SECTOR_SIZE);
+
+        /* Extend the request while the clusters are of the same kind */
+        for (n = BACKUP_SECTORS_PER_CLUSTER; i + n < nb_sectors;
+             n += BACKUP_SECTORS_PER_CLUSTER) {
+            int len = MIN(BACKUP_SECTORS_PER_CLUSTER, nb_sectors - i - n);
+            if (buffer_is_zero(buf + (i + n) * BDRV_SECTOR_SIZE,
+                               len * BDRV_SECTOR_SIZE) != zero) {
+                break;
+            }
+        }
+        n = MIN(n, nb_sectors - i);
+
+        if (zero) {
+            ret = bdrv_co_write_zeroes(job->target, sector_num + i, n,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else {
+            iov.iov_base = buf + i * BDRV_SECTOR_SIZE;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(job->target, sector_num + i, n, &qiov);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read)
@@ -95,7 +166,7 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t start, end;
-    int n;
+    int n, nb_clusters;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -107,20 +178,32 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
-        if (hbitmap_get(job->bitmap, start)) {
+    while (start < end) {
+        if (!hbitmap_get(job->copy_bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
+            start++;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
+        /* Merge the following clusters that need copying, too */
+        for (nb_clusters = 1; nb_clusters < BACKUP_MAX_CHUNK_CLUSTERS &&
+             start + nb_clusters < end &&
+             hbitmap_get(job->copy_bitmap, start + nb_clusters);
+             nb_clusters++) {
+            /* do nothing */
+        }
+
+        trace_backup_do_cow_process(job, start, nb_clusters);
 
-        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
+        n = MIN(nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * BACKUP_SECTORS_PER_CLUSTER);
 
         if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
+            /* Later chunks of this request are never larger */
+            bounce_buffer = qemu_blockalign(bs,
+                MIN(end - start, BACKUP_MAX_CHUNK_CLUSTERS) *
+                BACKUP_CLUSTER_SIZE);
         }
         iov.iov_base = bounce_buffer;
         iov.iov_len = n * BDRV_SECTOR_SIZE;
@@ -136,15 +219,8 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = bdrv_co_write_zeroes(job->target,
-                                       start * BACKUP_SECTORS_PER_CLUSTER,
-                                       n, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = bdrv_co_writev(job->target,
-                                 start * BACKUP_SECTORS_PER_CLUSTER, n,
-                                 &bounce_qiov);
-        }
+        ret = backup_write_chunk(job, start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                 bounce_buffer);
         if (ret < 0) {
             trace_backup_do_cow_write_fail(job, start, ret);
             if (error_is_read) {
@@ -153,13 +229,14 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        hbitmap_set(job->bitmap, start, 1);
+        hbitmap_reset(job->copy_bitmap, start, nb_clusters);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
          */
         job->sectors_read += n;
         job->common.offset += n * BDRV_SECTOR_SIZE;
+        start += nb_clusters;
     }
 
 out:
@@ -181,13 +258,22 @@ static int coroutine_fn backup_before_write_notify(
         void *opaque)
 {
     BdrvTrackedRequest *req = opaque;
+    BackupBlockJob *job = (BackupBlockJob *)req->bs->job;
     int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
     int nb_sectors = req->bytes >> BDRV_SECTOR_BITS;
+    int ret;
 
     assert((req->offset & (BDRV_SECTOR_SIZE - 1)) == 0);
     assert((req->bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
 
-    return backup_do_cow(req->bs, sector_num, nb_sectors, NULL);
+    /* The guest is waiting for this copy, hold back new work for the copy
+     * workers until it is done */
+    job->guest_cow_in_flight++;
+    ret = backup_do_cow(req->bs, sector_num, nb_sectors, NULL);
+    if (--job->guest_cow_in_flight == 0) {
+        qemu_co_queue_restart_all(&job->guest_cow_queue);
+    }
+    return ret;
 }
 
 static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -236,12 +322,249 @@ static void backup_complete(BlockJob *job, void *opaque)
     BackupBlockJob *s = container_of(job, BackupBlockJob, common);
     BackupCompleteData *data = opaque;
 
+    if (s->sync_bitmap) {
+        BlockDriverState *bs = job->bs;
+
+        if (data->ret < 0 || block_job_is_cancelled(job)) {
+            /* Merge the successor back into the parent, delete nothing */
+            bdrv_reclaim_dirty_bitmap(bs, s->sync_bitmap, &error_abort);
+        } else {
+            /* Everything up to the start of the job is in the backup now,
+             * only keep the writes that happened since */
+            bdrv_dirty_bitmap_abdicate(bs, s->sync_bitmap, &error_abort);
+        }
+    }
+
     bdrv_unref(s->target);
 
     block_job_completed(job, data->ret);
     g_free(data);
 }
 
+static bool coroutine_fn yield_and_check(BackupBlockJob *job)
+{
+    if (block_job_is_cancelled(&job->common)) {
+        return true;
+    }
+
+    /* we need to yield so that qemu_aio_flush() returns.
+     * (without, VM does not reboot)
+     */
+    if (job->common.speed) {
+        uint64_t delay_ns = ratelimit_calculate_delay(&job->limit,
+                                                      job->sectors_read);
+        job->sectors_read = 0;
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
+    } else {
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
+    }
+
+    if (block_job_is_cancelled(&job->common)) {
+        return true;
+    }
+
+    return false;
+}
+
+/* Only the clusters that are dirty in the sync bitmap need copying, the
+ * others are accounted for in the progress right away.
+ */
+static void backup_incremental_init_bitmap(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t total_sectors = job->common.len / BDRV_SECTOR_SIZE;
+    int64_t clusters = DIV_ROUND_UP(total_sectors, BACKUP_SECTORS_PER_CLUSTER);
+    int64_t granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap) /
+                          BDRV_SECTOR_SIZE;
+    int64_t sector, first, last, dirty_sectors;
+    HBitmapIter hbi;
+
+    bdrv_dirty_iter_init(bs, job->sync_bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+        first = sector / BACKUP_SECTORS_PER_CLUSTER;
+        last = DIV_ROUND_UP(MIN(sector + granularity, total_sectors),
+                            BACKUP_SECTORS_PER_CLUSTER);
+        hbitmap_set(job->copy_bitmap, first, last - first);
+    }
+
+    dirty_sectors = hbitmap_count(job->copy_bitmap) *
+                    BACKUP_SECTORS_PER_CLUSTER;
+    if (hbitmap_get(job->copy_bitmap, clusters - 1)) {
+        /* The last cluster may be partial */
+        dirty_sectors -= clusters * BACKUP_SECTORS_PER_CLUSTER - total_sectors;
+    }
+    job->common.offset = job->common.len - dirty_sectors * BDRV_SECTOR_SIZE;
+}
+
+/* For sync=top, check whether any sector of @cluster is allocated in the
+ * topmost image.
+ */
+static bool coroutine_fn backup_cluster_allocated(BlockDriverState *bs,
+                                                  int64_t cluster)
+{
+    int i, n;
+    int alloced = 0;
+
+    for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * BACKUP_SECTORS_PER_CLUSTER + i,
+                    BACKUP_SECTORS_PER_CLUSTER - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    return alloced != 0;
+}
+
+/* Find the first run of clusters at or after @cluster that the copy workers
+ * should copy.  Return its first cluster and store its length in
+ * @nb_clusters, or return -1 if there is nothing left.  For sync=top, a
+ * cluster that is not allocated in the topmost image is returned with a
+ * length of 0, so that the caller yields between such clusters.
+ */
+static int64_t coroutine_fn backup_next_chunk(BackupBlockJob *job,
+                                              int64_t cluster,
+                                              int *nb_clusters)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t end = DIV_ROUND_UP(job->common.len / BDRV_SECTOR_SIZE,
+                               BACKUP_SECTORS_PER_CLUSTER);
+    bool top = job->sync_mode == MIRROR_SYNC_MODE_TOP;
+    HBitmapIter hbi;
+    int n;
+
+    if (cluster >= end) {
+        return -1;
+    }
+    hbitmap_iter_init(&hbi, job->copy_bitmap, cluster);
+    cluster = hbitmap_iter_next(&hbi);
+    if (cluster < 0) {
+        return -1;
+    }
+
+    /* Clusters that are only in the backing file are skipped, but stay in
+     * copy_bitmap so that the guest cannot overwrite them without a copy.
+     */
+    if (top && !backup_cluster_allocated(bs, cluster)) {
+        *nb_clusters = 0;
+        return cluster;
+    }
+
+    for (n = 1; n < BACKUP_MAX_CHUNK_CLUSTERS && cluster + n < end &&
+         hbitmap_get(job->copy_bitmap, cluster + n) &&
+         (!top || backup_cluster_allocated(bs, cluster + n)); n++) {
+        /* do nothing */
+    }
+    *nb_clusters = n;
+    return cluster;
+}
+
+static void coroutine_fn backup_worker(void *opaque)
+{
+    BackupOp *op = opaque;
+    BackupBlockJob *job = op->job;
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs,
+                        op->cluster * BACKUP_SECTORS_PER_CLUSTER,
+                        op->nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
+                        &error_is_read);
+    if (ret < 0) {
+        if (!job->ret) {
+            job->ret = ret;
+            job->error_is_read = error_is_read;
+            job->error_cluster = op->cluster;
+        }
+        job->error_cluster = MIN(job->error_cluster, op->cluster);
+    }
+
+    job->workers_in_flight--;
+    qemu_co_queue_restart_all(&job->worker_queue);
+    g_free(op);
+}
+
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job,
+                                                 int max_in_flight)
+{
+    while (job->workers_in_flight > max_in_flight) {
+        qemu_co_queue_wait(&job->worker_queue);
+    }
+}
+
+/* Copy everything that is left in copy_bitmap.  The job coroutine hands out
+ * chunks to worker coroutines, and handles rate limiting, pausing and the
+ * errors that the workers report.  A chunk that failed stays in copy_bitmap
+ * and is handed out again if the error action allows a retry.
+ */
+static int coroutine_fn backup_run_copy(BackupBlockJob *job)
+{
+    int64_t cluster, next = 0;
+    int nb_clusters;
+    BackupOp *op;
+    Coroutine *co;
+    int ret = 0;
+
+    for (;;) {
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        /* Guest writes waiting for a copy go first */
+        while (job->guest_cow_in_flight > 0) {
+            qemu_co_queue_wait(&job->guest_cow_queue);
+        }
+
+        cluster = backup_next_chunk(job, next, &nb_clusters);
+        if (cluster >= 0 && nb_clusters == 0) {
+            next = cluster + 1;
+        } else if (cluster >= 0) {
+            backup_wait_for_workers(job, BACKUP_MAX_WORKERS - 1);
+
+            op = g_new(BackupOp, 1);
+            *op = (BackupOp) {
+                .job            = job,
+                .cluster        = cluster,
+                .nb_clusters    = nb_clusters,
+            };
+            job->workers_in_flight++;
+            co = qemu_coroutine_create(backup_worker);
+            qemu_coroutine_enter(co, op);
+            next = cluster + nb_clusters;
+        } else {
+            /* Nothing left to hand out, wait for the last chunks */
+            backup_wait_for_workers(job, 0);
+        }
+
+        if (job->ret < 0) {
+            /* Depending on error action, fail now or retry the chunk */
+            BlockErrorAction action =
+                backup_error_action(job, job->error_is_read, -job->ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->ret;
+                break;
+            }
+            next = job->error_cluster;
+            job->ret = 0;
+        } else if (cluster < 0) {
+            break;
+        }
+    }
+
+    backup_wait_for_workers(job, 0);
+    return ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -252,17 +575,23 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
+    qemu_co_queue_init(&job->worker_queue);
+    qemu_co_queue_init(&job->guest_cow_queue);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len / BDRV_SECTOR_SIZE,
                        BACKUP_SECTORS_PER_CLUSTER);
 
-    job->bitmap = hbitmap_alloc(end, 0);
+    job->copy_bitmap = hbitmap_alloc(end, 0);
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        backup_incremental_init_bitmap(job);
+    } else {
+        hbitmap_set(job->copy_bitmap, 0, end);
+    }
 
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
@@ -279,76 +608,8 @@ static void coroutine_fn backup_run(void *opaque)
             job->common.busy = true;
         }
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
-
-            /* we need to yield so that qemu_aio_flush() returns.
-             * (without, VM does not reboot)
-             */
-            if (job->common.speed) {
-                uint64_t delay_ns = ratelimit_calculate_delay(
-                        &job->limit, job->sectors_read);
-                job->sectors_read = 0;
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-            } else {
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
-            }
-
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * BACKUP_SECTORS_PER_CLUSTER + i,
-                                BACKUP_SECTORS_PER_CLUSTER - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
-                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        /* FULL, TOP and INCREMENTAL copy what is set in copy_bitmap */
+        ret = backup_run_copy(job);
     }
 
     notifier_with_return_remove(&before_write);
@@ -357,7 +618,7 @@ static void coroutine_fn backup_run(void *opaque)
     qemu_co_rwlock_wrlock(&job->flush_rwlock);
     qemu_co_rwlock_unlock(&job->flush_rwlock);
 
-    hbitmap_free(job->bitmap);
+    hbitmap_free(job->copy_bitmap);
 
     bdrv_iostatus_disable(target);
 
@@ -368,6 +629,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
@@ -386,24 +648,47 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!sync_bitmap) {
+            error_setg(errp, "sync=incremental requires a dirty bitmap");
+            return;
+        }
+
+        /* Writes go to the successor until the job completes */
+        if (bdrv_dirty_bitmap_create_successor(bs, sync_bitmap, errp) < 0) {
+            return;
+        }
+    } else if (sync_bitmap) {
+        error_setg(errp, "a dirty bitmap can only be used with "
+                   "sync=incremental");
+        return;
+    }
+
     len = bdrv_getlength(bs);
     if (len < 0) {
         error_setg_errno(errp, -len, "unable to get length for '%s'",
                          bdrv_get_device_name(bs));
-        return;
+        goto error;
     }
 
     BackupBlockJob *job = block_job_create(&backup_job_driver, bs, speed,
                                            cb, opaque, errp);
     if (!job) {
-        return;
+        goto error;
     }
 
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->sync_bitmap = sync_bitmap;
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
+    return;
+
+error:
+    if (sync_bitmap) {
+        bdrv_reclaim_dirty_bitmap(bs, sync_bitmap, &error_abort);
+    }
 }
@@ -0,0 +1,626 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Submission queue size (per-device).  The kernel sizes the completion queue
+ * at twice this, so as long as no more than MAX_ENTRIES requests are in
+ * flight completions can never overflow.
+ */
+#define MAX_ENTRIES 128
+
+struct qemu_luringcb {
+    BlockAIOCB common;
+    struct qemu_luring_state *ctx;
+    int fd;
+    int type;
+    off_t offset;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+
+    /* Short reads and writes are resubmitted for the remaining bytes
+     * through resubmit_qiov, which points into the tail of qiov.
+     */
+    size_t total_done;
+    QEMUIOVector resubmit_qiov;
+
+    /* Error for requests on the failed list */
+    int ret;
+
+    QSIMPLEQ_ENTRY(qemu_luringcb) next;
+};
+
+typedef struct {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, qemu_luringcb) pending;
+
+    /* Requests that could not be submitted, completed by the BH */
+    QSIMPLEQ_HEAD(, qemu_luringcb) failed;
+} LuringQueue;
+
+struct qemu_luring_state {
+    int ring_fd;
+
+    /* Submission ring, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_sz;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+
+    /* Completion ring, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_sz;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned *cq_flags;     /* NULL if the kernel has no CQ ring flags */
+    struct io_uring_cqe *cqes;
+
+    /* File descriptor registered with the ring, or -1 */
+    int fixed_fd;
+
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+};
+
+static void ioq_submit(struct qemu_luring_state *s);
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void luring_resubmit(struct qemu_luring_state *s,
+                            struct qemu_luringcb *luringcb)
+{
+    QSIMPLEQ_INSERT_HEAD(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Completes an io_uring request (calls the callback and frees the ACB).
+ */
+static void qemu_luring_process_completion(struct qemu_luring_state *s,
+    struct qemu_luringcb *luringcb, int ret)
+{
+    if (ret == -EINTR || ret == -EAGAIN) {
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
+    if (ret >= 0 && luringcb->type != QEMU_AIO_FLUSH) {
+        luringcb->total_done += ret;
+        if (luringcb->total_done == luringcb->nbytes) {
+            ret = 0;
+        } else if (ret == 0 && luringcb->type == QEMU_AIO_READ) {
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, luringcb->total_done, 0,
+                              luringcb->nbytes - luringcb->total_done);
+        } else if (ret == 0) {
+            /* A write that makes no progress at all would loop forever */
+            ret = -EIO;
+        } else {
+            /* Buffered I/O may come back short before EOF or with the
+             * device still having room, go again for whatever is left.
+             */
+            if (!luringcb->resubmit_qiov.iov) {
+                qemu_iovec_init(&luringcb->resubmit_qiov,
+                                luringcb->qiov->niov);
+            }
+            qemu_iovec_reset(&luringcb->resubmit_qiov);
+            qemu_iovec_concat(&luringcb->resubmit_qiov, luringcb->qiov,
+                              luringcb->total_done,
+                              luringcb->nbytes - luringcb->total_done);
+            luring_resubmit(s, luringcb);
+            return;
+        }
+    } else if (ret > 0) {
+        ret = 0;
+    }
+
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    qemu_aio_unref(luringcb);
+}
+
+/* Turn eventfd notifications for new completions on or off.  Kernels before
+ * 5.8 have no CQ ring flags; there the eventfd simply stays armed.
+ */
+static void luring_set_eventfd(struct qemu_luring_state *s, bool enabled)
+{
+    if (!s->cq_flags) {
+        return;
+    }
+    if (enabled) {
+        atomic_set(s->cq_flags, *s->cq_flags & ~IORING_CQ_EVENTFD_DISABLED);
+    } else {
+        atomic_set(s->cq_flags, *s->cq_flags | IORING_CQ_EVENTFD_DISABLED);
+    }
+}
+
+/* Reap completions straight from the shared completion ring.
+ *
+ * Unlike linux-aio no system call is needed to fetch events, so the only
+ * wakeup cost is the eventfd itself.  While the ring is being drained eventfd
+ * notifications are switched off: completions that land in the meantime are
+ * picked up by this loop instead of costing another trip through the main
+ * loop.  The head is published before each callback runs, which keeps nested
+ * event loops (a callback invoking aio_poll()) from seeing an entry twice, and
+ * the completion BH stays scheduled while callbacks run so that such a nested
+ * loop comes back here instead of sleeping on the muted eventfd.
+ */
+static void qemu_luring_process_completions(struct qemu_luring_state *s)
+{
+    struct io_uring_cqe *cqe;
+    struct qemu_luringcb *luringcb;
+    unsigned head;
+    int ret;
+
+    luring_set_eventfd(s, false);
+
+    for (;;) {
+        head = *s->cq_head;
+        if (head == atomic_read(s->cq_tail)) {
+            /* Re-enable notifications, then look again so that nothing
+             * completing in between is left without a wakeup.
+             */
+            luring_set_eventfd(s, true);
+            smp_mb();
+            if (head == atomic_read(s->cq_tail)) {
+                qemu_bh_cancel(s->completion_bh);
+                break;
+            }
+            luring_set_eventfd(s, false);
+            continue;
+        }
+        smp_rmb();
+
+        cqe = &s->cqes[head & *s->cq_mask];
+        luringcb = (struct qemu_luringcb *)(uintptr_t)cqe->user_data;
+        ret = cqe->res;
+
+        smp_mb();
+        atomic_set(s->cq_head, head + 1);
+        s->io_q.in_flight--;
+
+        /* Keep the BH pending so a nested event loop drains the ring too */
+        qemu_bh_schedule(s->completion_bh);
+
+        qemu_luring_process_completion(s, luringcb, ret);
+    }
+}
+
+static void qemu_luring_process_failed(struct qemu_luring_state *s)
+{
+    struct qemu_luringcb *luringcb;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.failed)) {
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.failed);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.failed, next);
+        qemu_luring_process_completion(s, luringcb, luringcb->ret);
+    }
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    struct qemu_luring_state *s = opaque;
+
+    qemu_luring_process_completions(s);
+    qemu_luring_process_failed(s);
+
+    if (!s->io_q.plugged &&
+        (s->io_q.blocked || !QSIMPLEQ_EMPTY(&s->io_q.pending))) {
+        ioq_submit(s);
+    }
+}
+
+static void qemu_luring_completion_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_luring_completion_bh(s);
+    }
+}
+
+/* Busy-poll handler: look at the completion ring without a system call */
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    if (*s->cq_head == atomic_read(s->cq_tail)) {
+        return false;
+    }
+
+    event_notifier_test_and_clear(&s->e);
+    qemu_luring_completion_bh(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_luringcb),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    QSIMPLEQ_INIT(&io_q->failed);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void luring_prep_sqe(struct qemu_luring_state *s,
+                            struct io_uring_sqe *sqe,
+                            struct qemu_luringcb *luringcb)
+{
+    QEMUIOVector *qiov = luringcb->qiov;
+    off_t offset = luringcb->offset;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (luringcb->resubmit_qiov.iov) {
+        qiov = &luringcb->resubmit_qiov;
+        offset += luringcb->total_done;
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        break;
+    case QEMU_AIO_READ:
+        sqe->opcode = IORING_OP_READV;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        break;
+    default:
+        abort();
+    }
+
+    if (qiov) {
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        sqe->off = offset;
+    }
+
+    if (luringcb->fd == s->fixed_fd) {
+        sqe->fd = 0;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = luringcb->fd;
+    }
+    sqe->user_data = (uintptr_t)luringcb;
+}
+
+/* Fail everything that the kernel has not taken yet with @ret.  Entries that
+ * were put in the submission ring are taken back out of it; the kernel only
+ * looks at the tail during io_uring_enter(), so rewinding it is safe.  The
+ * callbacks run from the completion BH rather than from inside submission.
+ */
+static void ioq_fail(struct qemu_luring_state *s, int ret)
+{
+    struct qemu_luringcb *luringcb;
+    unsigned head = atomic_read(s->sq_head);
+    unsigned tail = *s->sq_tail;
+
+    while (tail != head) {
+        tail--;
+        luringcb = (struct qemu_luringcb *)(uintptr_t)
+                   s->sqes[tail & *s->sq_mask].user_data;
+        QSIMPLEQ_INSERT_HEAD(&s->io_q.pending, luringcb, next);
+        s->io_q.in_flight--;
+    }
+    atomic_set(s->sq_tail, tail);
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        luringcb->ret = ret;
+        QSIMPLEQ_INSERT_TAIL(&s->io_q.failed, luringcb, next);
+    }
+    s->io_q.in_queue = 0;
+
+    qemu_bh_schedule(s->completion_bh);
+}
+
+/* Move pending requests into the submission ring and hand the whole batch to
+ * the kernel with a single io_uring_enter().  Requests that do not fit, either
+ * because the ring is full or because MAX_ENTRIES are already in flight, stay
+ * on the pending list until the completion BH makes room.
+ */
+static void ioq_submit(struct qemu_luring_state *s)
+{
+    struct qemu_luringcb *luringcb;
+    unsigned tail = *s->sq_tail;
+    unsigned to_submit;
+    int ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+           tail - atomic_read(s->sq_head) < MAX_ENTRIES &&
+           s->io_q.in_flight < MAX_ENTRIES) {
+        unsigned idx = tail & *s->sq_mask;
+
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        s->io_q.in_queue--;
+        s->io_q.in_flight++;
+
+        luring_prep_sqe(s, &s->sqes[idx], luringcb);
+        s->sq_array[idx] = idx;
+        tail++;
+    }
+
+    smp_wmb();
+    atomic_set(s->sq_tail, tail);
+
+    to_submit = tail - atomic_read(s->sq_head);
+    while (to_submit > 0) {
+        ret = io_uring_enter(s->ring_fd, to_submit, 0, 0);
+        if (ret < 0) {
+            ret = -errno;
+        }
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret == -EAGAIN || ret == -EBUSY) {
+            /* The entries stay in the ring and go with the next batch */
+            break;
+        }
+        if (ret < 0) {
+            ioq_fail(s, ret);
+            to_submit = 0;
+            break;
+        }
+        to_submit -= ret;
+        if (ret == 0) {
+            break;
+        }
+    }
+    s->io_q.blocked = (to_submit > 0);
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    struct qemu_luringcb *luringcb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+    case QEMU_AIO_FLUSH:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->ctx = s;
+    luringcb->fd = fd;
+    luringcb->type = type;
+    luringcb->offset = sector_num * 512;
+    luringcb->nbytes = nb_sectors * 512;
+    luringcb->qiov = qiov;
+    luringcb->total_done = 0;
+    memset(&luringcb->resubmit_qiov, 0, sizeof(luringcb->resubmit_qiov));
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+/* Register @fd with the ring so that requests on it skip the per-request
+ * file table lookup in the kernel.  Failure is not fatal, requests then
+ * simply pass the plain file descriptor.
+ */
+int luring_register_fd(void *aio_ctx, int fd)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    if (s->fixed_fd >= 0) {
+        io_uring_register(s->ring_fd, IORING_UNREGISTER_FILES, NULL, 0);
+        s->fixed_fd = -1;
+    }
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_FILES, &fd, 1) < 0) {
+        return -errno;
+    }
+    s->fixed_fd = fd;
+    return 0;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, qemu_luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_luring_poll_cb);
+}
+
+static int luring_map_rings(struct qemu_luring_state *s,
+                            struct io_uring_params *p)
+{
+    s->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    s->cq_ring_sz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    s->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    s->sq_ring = mmap(NULL, s->sq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (s->sq_ring == MAP_FAILED) {
+        return -errno;
+    }
+
+    s->cq_ring = mmap(NULL, s->cq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                      IORING_OFF_CQ_RING);
+    if (s->cq_ring == MAP_FAILED) {
+        goto out_unmap_sq;
+    }
+
+    s->sqes = mmap(NULL, s->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sqes == MAP_FAILED) {
+        goto out_unmap_cq;
+    }
+
+    s->sq_head = s->sq_ring + p->sq_off.head;
+    s->sq_tail = s->sq_ring + p->sq_off.tail;
+    s->sq_mask = s->sq_ring + p->sq_off.ring_mask;
+    s->sq_array = s->sq_ring + p->sq_off.array;
+
+    s->cq_head = s->cq_ring + p->cq_off.head;
+    s->cq_tail = s->cq_ring + p->cq_off.tail;
+    s->cq_mask = s->cq_ring + p->cq_off.ring_mask;
+    /* cq_off.flags is 0 when the kernel does not know about it, and offset
+     * 0 is the CQ head
+     */
+    s->cq_flags = p->cq_off.flags ? s->cq_ring + p->cq_off.flags : NULL;
+    s->cqes = s->cq_ring + p->cq_off.cqes;
+    return 0;
+
+out_unmap_cq:
+    munmap(s->cq_ring, s->cq_ring_sz);
+out_unmap_sq:
+    munmap(s->sq_ring, s->sq_ring_sz);
+    return -ENOMEM;
+}
+
+void *luring_init(void)
+{
+    struct qemu_luring_state *s;
+    struct io_uring_params p;
+    int efd;
+
+    s = g_malloc0(sizeof(*s));
+    s->fixed_fd = -1;
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    s->ring_fd = io_uring_setup(MAX_ENTRIES, &p);
+    if (s->ring_fd < 0) {
+        goto out_close_efd;
+    }
+    qemu_set_cloexec(s->ring_fd);
+
+    if (luring_map_rings(s, &p) < 0) {
+        goto out_close_ring;
+    }
+
+    efd = event_notifier_get_fd(&s->e);
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        goto out_unmap;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_unmap:
+    munmap(s->sqes, s->sqes_sz);
+    munmap(s->cq_ring, s->cq_ring_sz);
+    munmap(s->sq_ring, s->sq_ring_sz);
+out_close_ring:
+    close(s->ring_fd);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    struct qemu_luring_state *s = s_;
+
+    event_notifier_cleanup(&s->e);
+
+    munmap(s->sqes, s->sqes_sz);
+    munmap(s->cq_ring, s->cq_ring_sz);
+    munmap(s->sq_ring, s->sq_ring_sz);
+    close(s->ring_fd);
+    g_free(s);
+}
@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -66,6 +67,34 @@ static inline ssize_t io_event_ret(struct io_event *ev)
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
 }
 
+/* The kernel maps the completion ring at the address of the io_context_t;
+ * this is its header as defined in linux/fs/aio.c.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/* Check for completed requests without entering the kernel */
+static bool io_getevents_peek(io_context_t ctx)
+{
+    struct aio_ring *ring = (struct aio_ring *)ctx;
+
+    if (ring->magic != AIO_RING_MAGIC || ring->incompat_features != 0) {
+        return false;
+    }
+    return atomic_read(&ring->head) != atomic_read(&ring->tail);
+}
+
 /*
  * Completes an AIO request (calls the callback and frees the ACB).
  */
@@ -152,6 +181,21 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* Busy-poll handler, see aio_set_event_notifier_poll() */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    if (!io_getevents_peek(s->ctx)) {
+        return false;
+    }
+
+    event_notifier_test_and_clear(&s->e);
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -297,6 +341,7 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
@@ -18,7 +18,16 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+
+/* The number of operations in flight adapts to the latency of the target,
+ * starting at DEFAULT_IN_FLIGHT.  It grows while writes complete close to
+ * the fastest latency seen so far and shrinks when they queue up.
+ */
+#define DEFAULT_IN_FLIGHT 16
+#define MAX_IN_FLIGHT     64
+
+/* Ranges that read as zeroes need no buffer, only cap their size */
+#define MAX_ZERO_SECTORS  (1 << 21)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -55,8 +64,15 @@ typedef struct MirrorBlockJob {
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    int max_in_flight;
     int sectors_in_flight;
     int ret;
+    bool waiting_for_io;
+
+    /* Target write latency, in nanoseconds */
+    int64_t latency_min;
+    int64_t latency_sum;
+    int latency_count;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -64,6 +80,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t write_start;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -79,6 +96,42 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/* Called once per completed data write.  Every max_in_flight writes,
+ * compare their average latency with the best seen so far.
+ */
+static void mirror_update_in_flight_limit(MirrorBlockJob *s, int64_t latency)
+{
+    int64_t avg;
+
+    if (s->latency_min == 0 || latency < s->latency_min) {
+        s->latency_min = MAX(latency, 1);
+    }
+    s->latency_sum += latency;
+    if (++s->latency_count < s->max_in_flight) {
+        return;
+    }
+
+    avg = s->latency_sum / s->latency_count;
+    if (avg < 2 * s->latency_min) {
+        s->max_in_flight = MIN(s->max_in_flight + 1, MAX_IN_FLIGHT);
+    } else if (avg > 4 * s->latency_min) {
+        s->max_in_flight = MAX(s->max_in_flight - s->max_in_flight / 4, 1);
+    }
+    trace_mirror_in_flight_limit(s, avg, s->latency_min, s->max_in_flight);
+
+    s->latency_sum = 0;
+    s->latency_count = 0;
+}
+
+/* Yield until an operation completes */
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -111,11 +164,12 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
 
-    /* Enter coroutine when it is not sleeping.  The coroutine sleeps to
-     * rate-limit itself.  The coroutine will eventually resume since there is
-     * a sleep timeout so don't wake it early.
+    /* Enter coroutine only when it is waiting for I/O.  The coroutine
+     * sleeps to rate-limit itself and may also be waiting inside the block
+     * layer, e.g. for bdrv_get_block_status.  In both cases it will resume
+     * on its own, so don't wake it early.
      */
-    if (s->common.busy) {
+    if (s->waiting_for_io) {
         qemu_coroutine_enter(s->common.co, NULL);
     }
 }
@@ -128,11 +182,15 @@ static void mirror_write_complete(void *opaque, int ret)
         BlockDriverState *source = s->common.bs;
         BlockErrorAction action;
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
+        bdrv_set_dirty_bitmap(source, s->dirty_bitmap,
+                              op->sector_num, op->nb_sectors);
         action = mirror_error_action(s, false, -ret);
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
         }
+    } else if (op->qiov.niov > 0) {
+        mirror_update_in_flight_limit(s,
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->write_start);
     }
     mirror_iteration_done(op, ret);
 }
@@ -145,7 +203,8 @@ static void mirror_read_complete(void *opaque, int ret)
         BlockDriverState *source = s->common.bs;
         BlockErrorAction action;
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
+        bdrv_set_dirty_bitmap(source, s->dirty_bitmap,
+                              op->sector_num, op->nb_sectors);
         action = mirror_error_action(s, true, -ret);
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
@@ -154,6 +213,7 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    op->write_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
                     mirror_write_complete, op);
 }
@@ -161,9 +221,11 @@ static void mirror_read_complete(void *opaque, int ret)
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
-    int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int nb_sectors, sectors_per_chunk, nb_chunks, max_chunks, pnum;
+    int64_t end, limit, sector_num, next_chunk, next_sector;
+    int64_t hbitmap_next_sector, ret;
     uint64_t delay_ns = 0;
+    bool is_zero = false;
     MirrorOp *op;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
@@ -191,17 +253,44 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
      *
      * We also want to extend the QEMUIOVector to include more adjacent
      * dirty blocks if possible, to limit the number of I/O operations and
-     * run efficiently even with a small granularity.
+     * run efficiently even with a small granularity.  Each operation gets
+     * its share of the buffer, so that larger I/Os are used when fewer
+     * operations are in flight.
      */
     nb_chunks = 0;
     nb_sectors = 0;
     next_sector = sector_num;
     next_chunk = sector_num / sectors_per_chunk;
+    max_chunks = MAX(s->buf_size / s->granularity / s->max_in_flight, 1);
 
     /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
+    }
+
+    /* Ranges of the source that read as zeroes are written with
+     * write_zeroes and need no buffer; a data range stops where the next
+     * zero range starts.  With COW the whole cluster is copied as data.
+     */
+    limit = end;
+    if (!s->cow_bitmap) {
+        ret = bdrv_get_block_status(source, sector_num,
+                                    MIN(end - sector_num, MAX_ZERO_SECTORS),
+                                    &pnum);
+        if (ret >= 0 && pnum > 0) {
+            if ((ret & BDRV_BLOCK_ZERO) &&
+                pnum >= MIN(sectors_per_chunk, end - sector_num)) {
+                is_zero = true;
+                limit = sector_num + pnum;
+                if (limit < end) {
+                    limit -= limit % sectors_per_chunk;
+                }
+            } else if (!(ret & BDRV_BLOCK_ZERO)) {
+                limit = MIN(sector_num + QEMU_ALIGN_UP(pnum, sectors_per_chunk),
+                            end);
+            }
+        }
     }
 
     do {
@@ -232,16 +321,21 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
 
-        /* When doing COW, it may happen that there is not enough space for
-         * a full cluster.  Wait if that is the case.
-         */
-        while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
-            trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
-        }
-        if (s->buf_free_count < nb_chunks + added_chunks) {
-            trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
-            break;
+        if (!is_zero) {
+            /* When doing COW, it may happen that there is not enough space
+             * for a full cluster.  Wait if that is the case.
+             */
+            while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
+                trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
+                mirror_wait_for_io(s);
+            }
+            if (s->buf_free_count < nb_chunks + added_chunks) {
+                trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
+                break;
+            }
+            if (nb_chunks > 0 && nb_chunks + added_chunks > max_chunks) {
+                break;
+            }
         }
 
         /* We have enough free space to copy these sectors.  */
@@ -251,10 +345,39 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         nb_chunks += added_chunks;
         next_sector += added_sectors;
         next_chunk += added_chunks;
-        if (!s->synced && s->common.speed) {
+        if (!s->synced && s->common.speed && !is_zero) {
             delay_ns = ratelimit_calculate_delay(&s->limit, added_sectors);
         }
-    } while (delay_ns == 0 && next_sector < end);
+    } while (delay_ns == 0 && next_sector < limit);
+
+    /* Advance the HBitmapIter in parallel, so that we do not examine
+     * the same sector twice.
+     */
+    for (next_sector = sector_num + sectors_per_chunk;
+         next_sector < sector_num + nb_sectors;
+         next_sector += sectors_per_chunk) {
+        if (next_sector > hbitmap_next_sector
+            && bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
+            hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
+        }
+    }
+
+    bdrv_reset_dirty_bitmap(source, s->dirty_bitmap, sector_num, nb_sectors);
+
+    if (is_zero) {
+        /* The source may have been written while bdrv_get_block_status
+         * yielded.  Check again now that the dirty bits are clear, any
+         * later write sets them again.
+         */
+        ret = bdrv_get_block_status(source, sector_num, nb_sectors, &pnum);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || pnum < nb_sectors) {
+            bdrv_set_dirty_bitmap(source, s->dirty_bitmap,
+                                  sector_num, nb_sectors);
+            bitmap_clear(s->in_flight_bitmap, sector_num / sectors_per_chunk,
+                         nb_chunks);
+            return 0;
+        }
+    }
 
     /* Allocate a MirrorOp that is used as an AIO callback.  */
     op = g_slice_new(MirrorOp);
@@ -262,11 +385,21 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
 
+    s->in_flight++;
+    s->sectors_in_flight += nb_sectors;
+    trace_mirror_one_iteration(s, sector_num, nb_sectors);
+
+    if (is_zero) {
+        qemu_iovec_init(&op->qiov, 0);
+        bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                              BDRV_REQ_MAY_UNMAP, mirror_write_complete, op);
+        return delay_ns;
+    }
+
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
      */
     qemu_iovec_init(&op->qiov, nb_chunks);
-    next_sector = sector_num;
     while (nb_chunks-- > 0) {
         MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
         size_t remaining = (nb_sectors * BDRV_SECTOR_SIZE) - op->qiov.size;
@@ -274,24 +407,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
         s->buf_free_count--;
         qemu_iovec_add(&op->qiov, buf, MIN(s->granularity, remaining));
-
-        /* Advance the HBitmapIter in parallel, so that we do not examine
-         * the same sector twice.
-         */
-        if (next_sector > hbitmap_next_sector
-            && bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
-            hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
-        }
-
-        next_sector += sectors_per_chunk;
     }
 
-    bdrv_reset_dirty(source, sector_num, nb_sectors);
-
     /* Copy the dirty cluster.  */
-    s->in_flight++;
-    s->sectors_in_flight += nb_sectors;
-    trace_mirror_one_iteration(s, sector_num, nb_sectors);
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                    mirror_read_complete, op);
     return delay_ns;
@@ -317,7 +435,7 @@ static void mirror_free_init(MirrorBlockJob *s)
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -442,7 +560,7 @@ static void coroutine_fn mirror_run(void *opaque)
 
             assert(n > 0);
             if (ret == 1) {
-                bdrv_set_dirty(bs, sector_num, n);
+                bdrv_set_dirty_bitmap(bs, s->dirty_bitmap, sector_num, n);
                 sector_num = next;
             } else {
                 sector_num += n;
@@ -477,10 +595,10 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 delay_ns = mirror_iteration(s);
@@ -664,15 +782,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     MirrorBlockJob *s;
 
     if (granularity == 0) {
-        /* Choose the default granularity based on the target file's cluster
-         * size, clamped between 4k and 64k.  */
-        BlockDriverInfo bdi;
-        if (bdrv_get_info(target, &bdi) >= 0 && bdi.cluster_size != 0) {
-            granularity = MAX(4096, bdi.cluster_size);
-            granularity = MIN(65536, granularity);
-        } else {
-            granularity = 65536;
-        }
+        granularity = bdrv_get_default_bitmap_granularity(target);
     }
 
     assert ((granularity & (granularity - 1)) == 0);
@@ -698,8 +808,9 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->base = base;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
 
-    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, errp);
+    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
         return;
     }
@@ -28,6 +28,7 @@
 
 #include "nbd-client.h"
 #include "qemu/sockets.h"
+#include "qemu/bitmap.h"
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
@@ -36,7 +37,7 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
 {
     int i;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         if (s->recv_coroutine[i]) {
             qemu_coroutine_enter(s->recv_coroutine[i], NULL);
         }
@@ -79,7 +80,7 @@ static void nbd_reply_ready(void *opaque)
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
     i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    if (i >= s->max_requests) {
         goto fail;
     }
 
@@ -161,27 +162,66 @@ static void nbd_co_receive_reply(NbdClientSession *s,
     }
 }
 
+/* Like nbd_co_receive_reply, but read the variable-sized extent list of a
+ * QEMU_BLOCK_STATUS reply.  Only the first extent is kept, the rest is drained.
+ */
+static void nbd_co_receive_block_status(NbdClientSession *s,
+    struct nbd_request *request, struct nbd_reply *reply,
+    struct nbd_extent *extent)
+{
+    struct nbd_extent extents[NBD_MAX_EXTENTS];
+    uint32_t count;
+
+    qemu_coroutine_yield();
+    *reply = s->reply;
+    if (reply->handle != request->handle) {
+        reply->error = EIO;
+        return;
+    }
+
+    if (reply->error == 0) {
+        if (qemu_co_recv(s->sock, &count, sizeof(count)) != sizeof(count)) {
+            reply->error = EIO;
+            goto out;
+        }
+        count = be32_to_cpu(count);
+        if (count == 0 || count > NBD_MAX_EXTENTS ||
+            qemu_co_recv(s->sock, extents, count * sizeof(extents[0])) !=
+            count * sizeof(extents[0])) {
+            /* The stream can't be resynchronized, drop the connection */
+            shutdown(s->sock, 2);
+            reply->error = EIO;
+            goto out;
+        }
+        extent->length = be32_to_cpu(extents[0].length);
+        extent->flags = be32_to_cpu(extents[0].flags);
+        if (extent->length == 0 || extent->length > request->len ||
+            (extent->length & (BDRV_SECTOR_SIZE - 1))) {
+            reply->error = EIO;
+        }
+    }
+
+out:
+    /* Tell the read handler to read another header.  */
+    s->reply.handle = 0;
+}
+
 static void nbd_coroutine_start(NbdClientSession *s,
    struct nbd_request *request)
 {
     int i;
 
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    /* Wait for a free slot; requests are woken up in FIFO order as
+     * replies arrive.  */
+    while (s->in_flight >= s->max_requests) {
+        qemu_co_queue_wait(&s->free_sema);
     }
     s->in_flight++;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
-            break;
-        }
-    }
-
-    assert(i < MAX_NBD_REQUESTS);
+    i = find_first_zero_bit(s->in_use, s->max_requests);
+    assert(i < s->max_requests);
+    set_bit(i, s->in_use);
+    s->recv_coroutine[i] = qemu_coroutine_self();
     request->handle = INDEX_TO_HANDLE(s, i);
 }
 
@@ -190,9 +230,9 @@ static void nbd_coroutine_end(NbdClientSession *s,
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
     s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
-    }
+    clear_bit(i, s->in_use);
+    s->in_flight--;
+    qemu_co_queue_next(&s->free_sema);
 }
 
 static int nbd_co_readv_1(NbdClientSession *client, int64_t sector_num,
@@ -338,6 +378,53 @@ int nbd_client_session_co_discard(NbdClientSession *client, int64_t sector_num,
 
 }
 
+int64_t nbd_client_session_co_get_block_status(NbdClientSession *client,
+                                               int64_t sector_num,
+                                               int nb_sectors, int *pnum)
+{
+    /* The block layer takes one extent at a time, don't make the server
+     * look further than that
+     */
+    struct nbd_request request = {
+        .type = NBD_CMD_QEMU_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+    };
+    struct nbd_reply reply;
+    struct nbd_extent extent;
+    ssize_t ret;
+
+    if (!(client->qemu_flags & NBD_QEMU_FLAG_BLOCK_STATUS)) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+
+    /* request.len is 32 bits wide */
+    nb_sectors = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS);
+    request.from = sector_num << BDRV_SECTOR_BITS;
+    request.len = (uint64_t)nb_sectors << BDRV_SECTOR_BITS;
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(client, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_block_status(client, &request, &reply, &extent);
+    }
+    nbd_coroutine_end(client, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    *pnum = extent.length >> BDRV_SECTOR_BITS;
+    if (extent.flags & NBD_STATE_ZERO) {
+        return BDRV_BLOCK_ZERO | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+    /* A hole that doesn't read as zeroes still has to be copied */
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
 void nbd_client_session_detach_aio_context(NbdClientSession *client)
 {
     aio_set_fd_handler(bdrv_get_aio_context(client->bs), client->sock,
@@ -362,18 +449,20 @@ void nbd_client_session_close(NbdClientSession *client)
     if (!client->bs) {
         return;
     }
-    if (client->sock == -1) {
-        return;
+    if (client->sock != -1) {
+        nbd_send_request(client->sock, &request);
+        nbd_teardown_connection(client);
     }
-
-    nbd_send_request(client->sock, &request);
-
-    nbd_teardown_connection(client);
     client->bs = NULL;
+
+    g_free(client->recv_coroutine);
+    client->recv_coroutine = NULL;
+    g_free(client->in_use);
+    client->in_use = NULL;
 }
 
 int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
-    int sock, const char *export)
+    int sock, const char *export, int max_requests)
 {
     int ret;
 
@@ -381,8 +470,8 @@ int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
     logout("session init %s\n", export);
     qemu_set_block(sock);
     ret = nbd_receive_negotiate(sock, export,
-                                &client->nbdflags, &client->size,
-                                &client->blocksize);
+                                &client->nbdflags, &client->qemu_flags,
+                                &client->size, &client->blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
@@ -390,9 +479,12 @@ int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
     }
 
     qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
+    qemu_co_queue_init(&client->free_sema);
     client->bs = bs;
     client->sock = sock;
+    client->max_requests = max_requests;
+    client->recv_coroutine = g_new0(Coroutine *, max_requests);
+    client->in_use = bitmap_new(max_requests);
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
@@ -14,20 +14,22 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS    16
-
 typedef struct NbdClientSession {
     int sock;
     uint32_t nbdflags;
+    uint32_t qemu_flags;
     off_t size;
     size_t blocksize;
 
     CoMutex send_mutex;
-    CoMutex free_sema;
+    CoQueue free_sema;
     Coroutine *send_coroutine;
     int in_flight;
+    int max_requests;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    /* Indexed by request handle, in_use tracks the free slots */
+    Coroutine **recv_coroutine;
+    unsigned long *in_use;
     struct nbd_reply reply;
 
     bool is_unix;
@@ -36,7 +38,8 @@ typedef struct NbdClientSession {
 } NbdClientSession;
 
 int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
-                            int sock, const char *export_name);
+                            int sock, const char *export_name,
+                            int max_requests);
 void nbd_client_session_close(NbdClientSession *client);
 
 int nbd_client_session_co_discard(NbdClientSession *client, int64_t sector_num,
@@ -44,6 +47,9 @@ int nbd_client_session_co_discard(NbdClientSession *client, int64_t sector_num,
 int nbd_client_session_co_flush(NbdClientSession *client);
 int nbd_client_session_co_writev(NbdClientSession *client, int64_t sector_num,
                                  int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_session_co_get_block_status(NbdClientSession *client,
+                                               int64_t sector_num,
+                                               int nb_sectors, int *pnum);
 int nbd_client_session_co_readv(NbdClientSession *client, int64_t sector_num,
                                 int nb_sectors, QEMUIOVector *qiov);
 
@@ -41,6 +41,19 @@
 
 #define EN_OPTSTR ":exportname="
 
+static QemuOptsList runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "max-requests",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight",
+        },
+        { /* end of list */ }
+    },
+};
+
 typedef struct BDRVNBDState {
     NbdClientSession client;
     QemuOpts *socket_opts;
@@ -253,6 +266,8 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     BDRVNBDState *s = bs->opaque;
     char *export = NULL;
     int result, sock;
+    QemuOpts *opts;
+    uint64_t max_requests;
     Error *local_err = NULL;
 
     /* Pop the config into our state object. Exit if invalid. */
@@ -262,16 +277,35 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    max_requests = qemu_opt_get_number(opts, "max-requests",
+                                       NBD_DEFAULT_CLIENT_REQUESTS);
+    qemu_opts_del(opts);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        g_free(export);
+        return -EINVAL;
+    }
+    if (max_requests < 1 || max_requests > NBD_MAX_REQUESTS) {
+        error_setg(errp, "max-requests must be between 1 and %d",
+                   NBD_MAX_REQUESTS);
+        g_free(export);
+        return -EINVAL;
+    }
+
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
     sock = nbd_establish_connection(bs, errp);
     if (sock < 0) {
+        g_free(export);
         return sock;
     }
 
     /* NBD handshake */
-    result = nbd_client_session_init(&s->client, bs, sock, export);
+    result = nbd_client_session_init(&s->client, bs, sock, export,
+                                     max_requests);
     g_free(export);
     return result;
 }
@@ -294,6 +328,16 @@ static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
                                         nb_sectors, qiov);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    return nbd_client_session_co_get_block_status(&s->client, sector_num,
+                                                  nb_sectors, pnum);
+}
+
 static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -396,6 +440,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
     .bdrv_attach_aio_context    = nbd_attach_aio_context,
@@ -413,6 +458,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
     .bdrv_attach_aio_context    = nbd_attach_aio_context,
@@ -430,6 +476,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
     .bdrv_attach_aio_context    = nbd_attach_aio_context,
@@ -307,10 +307,42 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
+static uint64List *uint64_list_new(const uint64_t *values, int n)
+{
+    uint64List *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64List *elem = g_malloc0(sizeof(*elem));
+        elem->value = values[i];
+        *p_next = elem;
+        p_next = &elem->next;
+    }
+
+    return head;
+}
+
+static BlockLatencyHistogramInfo *
+bdrv_query_latency_histogram(const BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+
+    if (!hist->nbins) {
+        return NULL;
+    }
+
+    info = g_malloc0(sizeof(*info));
+    info->boundaries = uint64_list_new(hist->boundaries, hist->nbins - 1);
+    info->bins = uint64_list_new(hist->bins, hist->nbins);
+    return info;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
+    BlockAcctTimedStats *ts = NULL;
+    BlockLatencyHistogramInfo *hist;
 
     s = g_malloc0(sizeof(*s));
 
@@ -336,6 +368,53 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    while ((ts = block_acct_interval_next(&bs->stats, ts))) {
+        BlockDeviceTimedStatsList *timed_stats =
+            g_malloc0(sizeof(*timed_stats));
+        BlockDeviceTimedStats *dev_stats = g_malloc0(sizeof(*dev_stats));
+        TimedAverage *rd = &ts->latency[BLOCK_ACCT_READ];
+        TimedAverage *wr = &ts->latency[BLOCK_ACCT_WRITE];
+        TimedAverage *fl = &ts->latency[BLOCK_ACCT_FLUSH];
+
+        timed_stats->next = s->stats->timed_stats;
+        timed_stats->value = dev_stats;
+        s->stats->timed_stats = timed_stats;
+
+        dev_stats->interval_length = ts->interval_length;
+
+        dev_stats->min_rd_latency_ns = timed_average_min(rd);
+        dev_stats->max_rd_latency_ns = timed_average_max(rd);
+        dev_stats->avg_rd_latency_ns = timed_average_avg(rd);
+
+        dev_stats->min_wr_latency_ns = timed_average_min(wr);
+        dev_stats->max_wr_latency_ns = timed_average_max(wr);
+        dev_stats->avg_wr_latency_ns = timed_average_avg(wr);
+
+        dev_stats->min_flush_latency_ns = timed_average_min(fl);
+        dev_stats->max_flush_latency_ns = timed_average_max(fl);
+        dev_stats->avg_flush_latency_ns = timed_average_avg(fl);
+
+        dev_stats->avg_rd_queue_depth =
+            block_acct_queue_depth(ts, BLOCK_ACCT_READ);
+        dev_stats->avg_wr_queue_depth =
+            block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
+    }
+
+    hist = bdrv_query_latency_histogram(
+        &bs->stats.latency_histogram[BLOCK_ACCT_READ]);
+    s->stats->has_rd_latency_histogram = hist != NULL;
+    s->stats->rd_latency_histogram = hist;
+
+    hist = bdrv_query_latency_histogram(
+        &bs->stats.latency_histogram[BLOCK_ACCT_WRITE]);
+    s->stats->has_wr_latency_histogram = hist != NULL;
+    s->stats->wr_latency_histogram = hist;
+
+    hist = bdrv_query_latency_histogram(
+        &bs->stats.latency_histogram[BLOCK_ACCT_FLUSH]);
+    s->stats->has_flush_latency_histogram = hist != NULL;
+    s->stats->flush_latency_histogram = hist;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file, query_backing);
@@ -0,0 +1,473 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+
+/* Granularities that can be stored, 512 bytes to 2 GB */
+#define BITMAP_MIN_GRANULARITY_BITS 9
+#define BITMAP_MAX_GRANULARITY_BITS 31
+
+static uint64_t bitmap_dir_entry_size(size_t name_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size, 8);
+}
+
+void qcow2_free_bitmap_directory(Qcow2Bitmap *bitmaps, int nb_bitmaps)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+/* Read the bitmap directory that the header extension points to.  Returns
+ * the number of entries, which is s->nb_bitmaps, or -errno.
+ */
+int qcow2_read_bitmap_directory(BlockDriverState *bs, Qcow2Bitmap **pbitmaps)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapDirEntry *e;
+    Qcow2Bitmap *bitmaps;
+    uint8_t *dir;
+    uint64_t pos;
+    int i, ret;
+
+    *pbitmaps = NULL;
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        g_free(dir);
+        return ret;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, s->nb_bitmaps);
+    for (i = 0, pos = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        uint16_t name_size;
+
+        if (s->bitmap_directory_size - pos < sizeof(*e)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        e = (Qcow2BitmapDirEntry *)(dir + pos);
+        bm->data_offset = be64_to_cpu(e->data_offset);
+        bm->data_size = be64_to_cpu(e->data_size);
+        bm->flags = be32_to_cpu(e->flags);
+        bm->granularity_bits = e->granularity_bits;
+        name_size = be16_to_cpu(e->name_size);
+
+        if (name_size == 0 || name_size > QCOW2_BITMAP_NAME_MAX ||
+            bitmap_dir_entry_size(name_size) > s->bitmap_directory_size - pos ||
+            offset_into_cluster(s, bm->data_offset) ||
+            bm->granularity_bits < BITMAP_MIN_GRANULARITY_BITS ||
+            bm->granularity_bits > BITMAP_MAX_GRANULARITY_BITS) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bm->name = g_strndup((char *)(e + 1), name_size);
+        pos += bitmap_dir_entry_size(name_size);
+    }
+
+    if (pos != s->bitmap_directory_size) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    g_free(dir);
+    *pbitmaps = bitmaps;
+    return s->nb_bitmaps;
+
+fail:
+    g_free(dir);
+    qcow2_free_bitmap_directory(bitmaps, s->nb_bitmaps);
+    return ret;
+}
+
+static uint64_t bitmap_directory_size(Qcow2Bitmap *bitmaps, int nb_bitmaps)
+{
+    uint64_t size = 0;
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        size += bitmap_dir_entry_size(strlen(bitmaps[i].name));
+    }
+    return size;
+}
+
+static int bitmap_write_directory(BlockDriverState *bs, Qcow2Bitmap *bitmaps,
+                                  int nb_bitmaps, uint64_t offset)
+{
+    uint64_t size = bitmap_directory_size(bitmaps, nb_bitmaps);
+    uint8_t *dir;
+    uint64_t pos;
+    int i, ret;
+
+    dir = g_try_malloc0(size);
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0, pos = 0; i < nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)(dir + pos);
+        size_t name_size = strlen(bitmaps[i].name);
+
+        e->data_offset = cpu_to_be64(bitmaps[i].data_offset);
+        e->data_size = cpu_to_be64(bitmaps[i].data_size);
+        e->flags = cpu_to_be32(bitmaps[i].flags);
+        e->granularity_bits = bitmaps[i].granularity_bits;
+        e->name_size = cpu_to_be16(name_size);
+        memcpy(e + 1, bitmaps[i].name, name_size);
+        pos += bitmap_dir_entry_size(name_size);
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, dir, size);
+    g_free(dir);
+    return ret < 0 ? ret : 0;
+}
+
+/* Set the in-use flag of all bitmaps in the image, so that they are dropped
+ * when the image is opened again without having been closed properly.
+ */
+int qcow2_mark_bitmaps_in_use(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    int i, nb, ret;
+
+    nb = qcow2_read_bitmap_directory(bs, &bitmaps);
+    if (nb <= 0) {
+        return nb;
+    }
+
+    for (i = 0; i < nb; i++) {
+        bitmaps[i].flags |= QCOW2_BITMAP_IN_USE;
+    }
+    ret = bitmap_write_directory(bs, bitmaps, nb, s->bitmap_directory_offset);
+    qcow2_free_bitmap_directory(bitmaps, nb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_flush(bs->file);
+}
+
+int qcow2_load_persistent_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    Qcow2Bitmap *bitmaps;
+    uint8_t *buf;
+    int i, nb, ret;
+
+    nb = qcow2_read_bitmap_directory(bs, &bitmaps);
+    if (nb < 0) {
+        error_setg_errno(errp, -nb, "Could not read dirty bitmap directory");
+        return nb;
+    }
+
+    for (i = 0; i < nb; i++) {
+        Qcow2Bitmap *qbm = &bitmaps[i];
+        BdrvDirtyBitmap *bm;
+
+        if (qbm->flags & ~QCOW2_BITMAP_FLAGS_MASK) {
+            error_report("Dirty bitmap '%s' in '%s' has unknown flags, "
+                         "ignoring it", qbm->name, bs->filename);
+            continue;
+        }
+        if (qbm->flags & QCOW2_BITMAP_IN_USE) {
+            /* QEMU did not exit cleanly while the bitmap was in use */
+            error_report("Dirty bitmap '%s' in '%s' is inconsistent, "
+                         "dropping it", qbm->name, bs->filename);
+            continue;
+        }
+        if (bdrv_find_dirty_bitmap(bs, qbm->name)) {
+            /* Already loaded, e.g. when reopening after migration */
+            continue;
+        }
+
+        bm = bdrv_create_dirty_bitmap(bs, 1U << qbm->granularity_bits,
+                                      qbm->name, errp);
+        if (!bm) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (qbm->data_size != bdrv_dirty_bitmap_serialization_size(bm)) {
+            error_report("Dirty bitmap '%s' in '%s' does not match the image "
+                         "size, dropping it", qbm->name, bs->filename);
+            bdrv_release_dirty_bitmap(bs, bm);
+            continue;
+        }
+
+        buf = g_try_malloc(qbm->data_size);
+        if (qbm->data_size && buf == NULL) {
+            error_setg(errp, "Could not allocate dirty bitmap '%s'",
+                       qbm->name);
+            bdrv_release_dirty_bitmap(bs, bm);
+            ret = -ENOMEM;
+            goto fail;
+        }
+        ret = bdrv_pread(bs->file, qbm->data_offset, buf, qbm->data_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read dirty bitmap '%s'",
+                             qbm->name);
+            g_free(buf);
+            bdrv_release_dirty_bitmap(bs, bm);
+            goto fail;
+        }
+        bdrv_dirty_bitmap_deserialize(bm, buf);
+        bdrv_dirty_bitmap_set_persistent(bm, true);
+        g_free(buf);
+    }
+
+    if (!bs->read_only) {
+        ret = qcow2_mark_bitmaps_in_use(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update dirty bitmap "
+                             "directory");
+            goto fail;
+        }
+    }
+
+    qcow2_free_bitmap_directory(bitmaps, nb);
+    return 0;
+
+fail:
+    qcow2_free_bitmap_directory(bitmaps, nb);
+    bdrv_release_named_dirty_bitmaps(bs);
+    return ret;
+}
+
+/* Replace the bitmaps in the image with the persistent bitmaps of @bs.  The
+ * new bitmaps are written to newly allocated clusters and only then
+ * referenced from the header, so a failure leaves the old bitmaps intact.
+ */
+int qcow2_store_persistent_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bm;
+    Qcow2Bitmap *old = NULL, *new = NULL;
+    uint64_t old_dir_offset = s->bitmap_directory_offset;
+    uint64_t old_dir_size = s->bitmap_directory_size;
+    uint64_t old_autoclear = s->autoclear_features;
+    int64_t dir_offset = 0;
+    uint64_t dir_size = 0;
+    int nb_old, nb_new = 0, i;
+    int ret;
+
+    for (bm = bdrv_dirty_bitmap_next(bs, NULL); bm;
+         bm = bdrv_dirty_bitmap_next(bs, bm)) {
+        if (bdrv_dirty_bitmap_persistent(bm)) {
+            nb_new++;
+        }
+    }
+    if (nb_new == 0 && s->nb_bitmaps == 0) {
+        return 0;
+    }
+    if (s->qcow_version < 3 || nb_new > QCOW2_MAX_BITMAPS) {
+        return -ENOTSUP;
+    }
+
+    nb_old = qcow2_read_bitmap_directory(bs, &old);
+    if (nb_old < 0) {
+        return nb_old;
+    }
+
+    /* Write the bitmap data */
+    new = g_new0(Qcow2Bitmap, nb_new);
+    i = 0;
+    for (bm = bdrv_dirty_bitmap_next(bs, NULL); bm;
+         bm = bdrv_dirty_bitmap_next(bs, bm)) {
+        Qcow2Bitmap *qbm = &new[i];
+        uint8_t *buf;
+
+        if (!bdrv_dirty_bitmap_persistent(bm)) {
+            continue;
+        }
+
+        qbm->name = g_strdup(bdrv_dirty_bitmap_name(bm));
+        qbm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bm));
+        qbm->data_size = bdrv_dirty_bitmap_serialization_size(bm);
+        i++;
+
+        if (qbm->data_size == 0) {
+            continue;
+        }
+        qbm->data_offset = qcow2_alloc_clusters(bs, qbm->data_size);
+        if ((int64_t)qbm->data_offset < 0) {
+            ret = qbm->data_offset;
+            qbm->data_offset = 0;
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, qbm->data_offset,
+                                            qbm->data_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf = g_try_malloc(qbm->data_size);
+        if (buf == NULL) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        bdrv_dirty_bitmap_serialize(bm, buf);
+        ret = bdrv_pwrite(bs->file, qbm->data_offset, buf, qbm->data_size);
+        g_free(buf);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* Write the directory */
+    if (nb_new) {
+        dir_size = bitmap_directory_size(new, nb_new);
+        if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+            ret = -EFBIG;
+            goto fail;
+        }
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            dir_offset = 0;
+            goto fail;
+        }
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bitmap_write_directory(bs, new, nb_new, dir_offset);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The new clusters must be allocated on disk before the header refers
+     * to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Switch to the new directory */
+    s->nb_bitmaps = nb_new;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_new) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    }
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = nb_old;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear;
+        goto fail;
+    }
+
+    /* And free the old one */
+    for (i = 0; i < nb_old; i++) {
+        if (old[i].data_size) {
+            qcow2_free_clusters(bs, old[i].data_offset, old[i].data_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (nb_old) {
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    qcow2_free_bitmap_directory(old, nb_old);
+    qcow2_free_bitmap_directory(new, nb_new);
+    return 0;
+
+fail:
+    for (i = 0; i < nb_new; i++) {
+        if (new[i].data_offset) {
+            qcow2_free_clusters(bs, new[i].data_offset, new[i].data_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+    if (dir_offset) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+    }
+    qcow2_free_bitmap_directory(old, nb_old);
+    qcow2_free_bitmap_directory(new, nb_new);
+    return ret;
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bm;
+    int nb_bitmaps = 0;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent dirty bitmaps require a qcow2 image "
+                   "with at least qemu 1.1 compatibility level");
+        return false;
+    }
+    if (bs->read_only) {
+        error_setg(errp, "Cannot store dirty bitmaps in read-only image '%s'",
+                   bs->filename);
+        return false;
+    }
+    if (strlen(name) > QCOW2_BITMAP_NAME_MAX) {
+        error_setg(errp, "Dirty bitmap name is longer than %d bytes",
+                   QCOW2_BITMAP_NAME_MAX);
+        return false;
+    }
+    if (ctz32(granularity) > BITMAP_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Dirty bitmap granularity is too large");
+        return false;
+    }
+
+    for (bm = bdrv_dirty_bitmap_next(bs, NULL); bm;
+         bm = bdrv_dirty_bitmap_next(bs, bm)) {
+        nb_bitmaps += bdrv_dirty_bitmap_persistent(bm);
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent dirty bitmaps");
+        return false;
+    }
+
+    return true;
+}
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -364,70 +365,141 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
     }
 }
 
-static int coroutine_fn copy_sectors(BlockDriverState *bs,
-                                     uint64_t start_sect,
-                                     uint64_t cluster_offset,
-                                     int n_start, int n_end)
+typedef struct Qcow2CryptTask {
+    BDRVQcowState *s;
+    int64_t sector_num;
+    uint8_t *buf;
+    int nb_sectors;
+    int enc;
+} Qcow2CryptTask;
+
+typedef struct Qcow2CryptCo {
+    Coroutine *co;
+    int in_flight;
+} Qcow2CryptCo;
+
+static int qcow2_crypt_worker(void *opaque)
+{
+    Qcow2CryptTask *task = opaque;
+    BDRVQcowState *s = task->s;
+
+    qcow2_encrypt_sectors(s, task->sector_num, task->buf, task->buf,
+                          task->nb_sectors, task->enc,
+                          task->enc ? &s->aes_encrypt_key
+                                    : &s->aes_decrypt_key);
+    return 0;
+}
+
+static void qcow2_crypt_cb(void *opaque, int ret)
+{
+    Qcow2CryptCo *crypt_co = opaque;
+
+    if (--crypt_co->in_flight == 0) {
+        qemu_coroutine_enter(crypt_co->co, NULL);
+    }
+}
+
+/*
+ * Encrypts (@enc = 1) or decrypts (@enc = 0) @nb_sectors sectors of @buf in
+ * place.  The buffer is split in chunks of QCOW_CRYPT_CHUNK_SECTORS that are
+ * processed in parallel by the thread pool, so that the cipher neither runs
+ * in the thread of the AioContext nor is limited to a single host CPU.
+ *
+ * The caller should not hold s->lock, since other requests can proceed
+ * while the data is being processed.
+ */
+int coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                          int64_t sector_num, uint8_t *buf,
+                                          int nb_sectors, int enc)
 {
     BDRVQcowState *s = bs->opaque;
-    QEMUIOVector qiov;
-    struct iovec iov;
-    int n, ret;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CryptCo crypt_co = {
+        .co = qemu_coroutine_self(),
+    };
+    Qcow2CryptTask *tasks;
+    int nb_tasks, i;
 
-    n = n_end - n_start;
-    if (n <= 0) {
+    if (nb_sectors <= 0) {
         return 0;
     }
 
-    iov.iov_len = n * BDRV_SECTOR_SIZE;
-    iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
-    if (iov.iov_base == NULL) {
-        return -ENOMEM;
+    nb_tasks = DIV_ROUND_UP(nb_sectors, QCOW_CRYPT_CHUNK_SECTORS);
+    tasks = g_new(Qcow2CryptTask, nb_tasks);
+
+    for (i = 0; i < nb_tasks; i++) {
+        int n = MIN(nb_sectors, QCOW_CRYPT_CHUNK_SECTORS);
+
+        tasks[i] = (Qcow2CryptTask) {
+            .s          = s,
+            .sector_num = sector_num,
+            .buf        = buf,
+            .nb_sectors = n,
+            .enc        = enc,
+        };
+        sector_num += n;
+        buf += n * BDRV_SECTOR_SIZE;
+        nb_sectors -= n;
+
+        crypt_co.in_flight++;
+        thread_pool_submit_aio(pool, qcow2_crypt_worker, &tasks[i],
+                               qcow2_crypt_cb, &crypt_co);
     }
 
-    qemu_iovec_init_external(&qiov, &iov, 1);
+    /* Completions are delivered from a bottom half, so none of them can
+     * have run yet */
+    qemu_coroutine_yield();
+    assert(crypt_co.in_flight == 0);
+
+    g_free(tasks);
+    return 0;
+}
+
+static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
+                                            uint64_t src_cluster_offset,
+                                            int n_start,
+                                            QEMUIOVector *qiov)
+{
+    if (qiov->size == 0) {
+        return 0;
+    }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
 
     if (!bs->drv) {
-        ret = -ENOMEDIUM;
-        goto out;
+        return -ENOMEDIUM;
     }
 
     /* Call .bdrv_co_readv() directly instead of using the public block-layer
      * interface.  This avoids double I/O throttling and request tracking,
      * which can lead to deadlock when block layer copy-on-read is enabled.
      */
-    ret = bs->drv->bdrv_co_readv(bs, start_sect + n_start, n, &qiov);
-    if (ret < 0) {
-        goto out;
-    }
+    return bs->drv->bdrv_co_readv(bs, (src_cluster_offset >> 9) + n_start,
+                                  qiov->size >> 9, qiov);
+}
 
-    if (s->crypt_method) {
-        qcow2_encrypt_sectors(s, start_sect + n_start,
-                        iov.iov_base, iov.iov_base, n, 1,
-                        &s->aes_encrypt_key);
+static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
+                                             uint64_t cluster_offset,
+                                             int n_start,
+                                             QEMUIOVector *qiov)
+{
+    int ret;
+
+    if (qiov->size == 0) {
+        return 0;
     }
 
     ret = qcow2_pre_write_overlap_check(bs, 0,
-            cluster_offset + n_start * BDRV_SECTOR_SIZE, n * BDRV_SECTOR_SIZE);
+            cluster_offset + n_start * BDRV_SECTOR_SIZE, qiov->size);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
-    ret = bdrv_co_writev(bs->file, (cluster_offset >> 9) + n_start, n, &qiov);
-    if (ret < 0) {
-        goto out;
-    }
-
-    ret = 0;
-out:
-    qemu_vfree(iov.iov_base);
-    return ret;
+    return bdrv_co_writev(bs->file, (cluster_offset >> 9) + n_start,
+                          qiov->size >> 9, qiov);
 }
 
-
 /*
  * get_cluster_offset
  *
@@ -702,33 +774,140 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     return cluster_offset;
 }
 
-static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
+/*
+ * Copies the unmodified head and tail of the newly allocated clusters
+ * described by @m from their old location (backing file or previously
+ * allocated cluster).
+ *
+ * If both regions are close to each other, they are read in a single
+ * request.  If the guest data has been attached to @m (see
+ * qcow2_co_writev()), the head, the guest data and the tail are written to
+ * the new clusters with a single vectored write.
+ */
+static int perform_cow(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2COWRegion *start = &m->cow_start;
+    Qcow2COWRegion *end = &m->cow_end;
+    unsigned start_sector = start->offset / BDRV_SECTOR_SIZE;
+    unsigned end_sector = end->offset / BDRV_SECTOR_SIZE;
+    unsigned buffer_sectors;
+    unsigned data_sectors;
+    uint8_t *start_buffer, *end_buffer;
+    QEMUIOVector qiov;
+    bool merge_reads;
     int ret;
 
-    if (r->nb_sectors == 0) {
+    assert(start->nb_sectors <= INT_MAX - end->nb_sectors);
+    assert(start_sector + start->nb_sectors <= end_sector);
+
+    if (start->nb_sectors == 0 && end->nb_sectors == 0) {
         return 0;
     }
 
+    /* If we have to read both the start and end COW regions and the
+     * middle region is not too large then perform just one read
+     * operation */
+    merge_reads = start->nb_sectors && end->nb_sectors &&
+        (end_sector - start_sector) * BDRV_SECTOR_SIZE <= 16384;
+    if (merge_reads) {
+        buffer_sectors = end_sector + end->nb_sectors - start_sector;
+    } else {
+        buffer_sectors = start->nb_sectors + end->nb_sectors;
+    }
+
+    start_buffer = qemu_try_blockalign(bs, buffer_sectors * BDRV_SECTOR_SIZE);
+    if (start_buffer == NULL) {
+        return -ENOMEM;
+    }
+    /* The part of the buffer where the end region is located */
+    end_buffer = start_buffer +
+                 (buffer_sectors - end->nb_sectors) * BDRV_SECTOR_SIZE;
+
+    data_sectors = end_sector - start_sector - start->nb_sectors;
+    qemu_iovec_init(&qiov, 2 + (m->data_qiov ? m->data_qiov->niov : 0));
+
     qemu_co_mutex_unlock(&s->lock);
-    ret = copy_sectors(bs, m->offset / BDRV_SECTOR_SIZE, m->alloc_offset,
-                       r->offset / BDRV_SECTOR_SIZE,
-                       r->offset / BDRV_SECTOR_SIZE + r->nb_sectors);
-    qemu_co_mutex_lock(&s->lock);
 
+    /* First we read the existing data from both COW regions. We either read
+     * the whole region in one go, or the start and end regions separately. */
+    if (merge_reads) {
+        qemu_iovec_add(&qiov, start_buffer, buffer_sectors * BDRV_SECTOR_SIZE);
+        ret = do_perform_cow_read(bs, m->offset, start_sector, &qiov);
+    } else {
+        qemu_iovec_add(&qiov, start_buffer,
+                       start->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = do_perform_cow_read(bs, m->offset, start_sector, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = do_perform_cow_read(bs, m->offset, end_sector, &qiov);
+    }
     if (ret < 0) {
-        return ret;
+        goto fail;
     }
 
+    if (s->crypt_method) {
+        uint64_t sector_num = m->offset / BDRV_SECTOR_SIZE;
+
+        qcow2_co_encrypt_sectors(bs, sector_num + start_sector,
+                                 start_buffer, start->nb_sectors, 1);
+        qcow2_co_encrypt_sectors(bs, sector_num + end_sector,
+                                 end_buffer, end->nb_sectors, 1);
+    }
+
+    /* And now we can write everything. If we have the guest data we can
+     * write everything in one single operation */
+    if (m->data_qiov) {
+        qemu_iovec_reset(&qiov);
+        if (start->nb_sectors) {
+            qemu_iovec_add(&qiov, start_buffer,
+                           start->nb_sectors * BDRV_SECTOR_SIZE);
+        }
+        qemu_iovec_concat(&qiov, m->data_qiov, 0,
+                          data_sectors * BDRV_SECTOR_SIZE);
+        if (end->nb_sectors) {
+            qemu_iovec_add(&qiov, end_buffer,
+                           end->nb_sectors * BDRV_SECTOR_SIZE);
+        }
+        /* NOTE: we have a write_aio blkdebug event here followed by
+         * a cow_write one in do_perform_cow_write(), but there's only
+         * one single I/O operation */
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start_sector, &qiov);
+    } else {
+        /* If there's no guest data then write both COW regions separately */
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, start_buffer,
+                       start->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start_sector, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end->nb_sectors * BDRV_SECTOR_SIZE);
+        ret = do_perform_cow_write(bs, m->alloc_offset, end_sector, &qiov);
+    }
+
+fail:
+    qemu_co_mutex_lock(&s->lock);
+
     /*
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
      * handled.
      */
-    qcow2_cache_depends_on_flush(s->l2_table_cache);
+    if (ret == 0) {
+        qcow2_cache_depends_on_flush(s->l2_table_cache);
+    }
 
-    return 0;
+    qemu_vfree(start_buffer);
+    qemu_iovec_destroy(&qiov);
+    return ret;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
@@ -748,12 +927,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
 
     /* copy content of unmodified sectors */
-    ret = perform_cow(bs, m, &m->cow_start);
-    if (ret < 0) {
-        goto err;
-    }
-
-    ret = perform_cow(bs, m, &m->cow_end);
+    ret = perform_cow(bs, m);
     if (ret < 0) {
         goto err;
     }
@@ -779,7 +953,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
-	 * copy_sectors()), update l2 table with its cluster pointer and free
+	 * perform_cow()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
         if(l2_table[l2_index + i] != 0)
             old_cluster[j++] = l2_table[l2_index + i];
@@ -1607,6 +1607,35 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* persistent dirty bitmaps */
+    if (s->nb_bitmaps) {
+        Qcow2Bitmap *bitmaps;
+        int nb_bitmaps;
+
+        nb_bitmaps = qcow2_read_bitmap_directory(bs, &bitmaps);
+        if (nb_bitmaps < 0) {
+            fprintf(stderr, "ERROR cannot read the dirty bitmap directory: "
+                    "%s\n", strerror(-nb_bitmaps));
+            res->corruptions++;
+        } else {
+            for (i = 0; i < nb_bitmaps && ret >= 0; i++) {
+                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                                    bitmaps[i].data_offset,
+                                    bitmaps[i].data_size);
+            }
+            qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                            s->bitmap_directory_offset,
+                            s->bitmap_directory_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* refcount data */
     ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
                         s->refcount_table_offset,
@@ -61,6 +61,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -159,6 +160,41 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+        {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+                /* Written by a program that did not know about the bitmaps,
+                 * so they may be stale; drop them */
+                break;
+            }
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: ext_dirty_bitmaps: invalid length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_dirty_bitmaps: "
+                                 "Could not read bitmap header");
+                return ret;
+            }
+            s->nb_bitmaps = be32_to_cpu(bitmaps_ext.nb_bitmaps);
+            s->bitmap_directory_size =
+                be64_to_cpu(bitmaps_ext.bitmap_directory_size);
+            s->bitmap_directory_offset =
+                be64_to_cpu(bitmaps_ext.bitmap_directory_offset);
+
+            if (s->nb_bitmaps > QCOW2_MAX_BITMAPS ||
+                s->bitmap_directory_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+                offset_into_cluster(s, s->bitmap_directory_offset)) {
+                error_setg(errp, "ERROR: ext_dirty_bitmaps: invalid bitmap "
+                           "directory");
+                return -EINVAL;
+            }
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -893,8 +929,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -981,6 +1018,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Load persistent dirty bitmaps, last as the bitmaps are attached to bs
+     * and would have to be released on failure */
+    if (!(flags & BDRV_O_INCOMING)) {
+        ret = qcow2_load_persistent_bitmaps(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1058,8 +1104,18 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     return 0;
 }
 
-/* We have no actual commit/abort logic for qcow2, but we need to write out any
- * unwritten data if we reopen read-only. */
+/* Persistent dirty bitmaps are written to the image when it becomes
+ * read-only, and marked in use again when it becomes writable. */
+static bool qcow2_reopen_stores_bitmaps(BDRVReopenState *state)
+{
+    BDRVQcowState *s = state->bs->opaque;
+
+    return !(s->flags & BDRV_O_INCOMING) &&
+           (state->bs->open_flags & BDRV_O_RDWR) &&
+           !(state->flags & BDRV_O_RDWR);
+}
+
+/* We need to write out any unwritten data if we reopen read-only. */
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
@@ -1071,6 +1127,14 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             return ret;
         }
 
+        if (qcow2_reopen_stores_bitmaps(state)) {
+            ret = qcow2_store_persistent_bitmaps(state->bs);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not store dirty bitmaps");
+                return ret;
+            }
+        }
+
         ret = qcow2_mark_clean(state->bs);
         if (ret < 0) {
             return ret;
@@ -1080,6 +1144,36 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 }
 
+static void qcow2_reopen_commit(BDRVReopenState *state)
+{
+    BDRVQcowState *s = state->bs->opaque;
+    int ret;
+
+    if (!(s->flags & BDRV_O_INCOMING) &&
+        !(state->bs->open_flags & BDRV_O_RDWR) &&
+        (state->flags & BDRV_O_RDWR)) {
+        ret = qcow2_mark_bitmaps_in_use(state->bs);
+        if (ret < 0) {
+            error_report("Could not mark dirty bitmaps in use: %s",
+                         strerror(-ret));
+        }
+    }
+}
+
+static void qcow2_reopen_abort(BDRVReopenState *state)
+{
+    int ret;
+
+    /* The image stays writable */
+    if (qcow2_reopen_stores_bitmaps(state)) {
+        ret = qcow2_mark_bitmaps_in_use(state->bs);
+        if (ret < 0) {
+            error_report("Could not mark dirty bitmaps in use: %s",
+                         strerror(-ret));
+        }
+    }
+}
+
 static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum)
 {
@@ -1245,16 +1339,16 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
+            if (ret >= 0 && s->crypt_method) {
+                qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                                         cur_nr_sectors, 0);
+                qemu_iovec_from_buf(qiov, bytes_done,
+                    cluster_data, 512 * cur_nr_sectors);
+            }
             qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
-            if (s->crypt_method) {
-                qcow2_encrypt_sectors(s, sector_num,  cluster_data,
-                    cluster_data, cur_nr_sectors, 0, &s->aes_decrypt_key);
-                qemu_iovec_from_buf(qiov, bytes_done,
-                    cluster_data, 512 * cur_nr_sectors);
-            }
             break;
 
         default:
@@ -1278,6 +1372,39 @@ fail:
     return ret;
 }
 
+/* Check if it's possible to merge a write request with the writing of
+ * the data from the COW regions */
+static bool merge_cow(uint64_t offset, unsigned bytes,
+                      QEMUIOVector *hd_qiov, QCowL2Meta *l2meta)
+{
+    QCowL2Meta *m;
+
+    for (m = l2meta; m != NULL; m = m->next) {
+        /* If both COW regions are empty then there's nothing to merge */
+        if (m->cow_start.nb_sectors == 0 && m->cow_end.nb_sectors == 0) {
+            continue;
+        }
+
+        /* The data (middle) region must be immediately after the
+         * start region */
+        if (m->offset + m->cow_start.offset +
+            m->cow_start.nb_sectors * BDRV_SECTOR_SIZE != offset) {
+            continue;
+        }
+
+        /* The end region must be immediately after the data (middle)
+         * region */
+        if (m->offset + m->cow_end.offset != offset + bytes) {
+            continue;
+        }
+
+        m->data_qiov = hd_qiov;
+        return true;
+    }
+
+    return false;
+}
+
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
@@ -1343,8 +1470,12 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
 
-            qcow2_encrypt_sectors(s, sector_num, cluster_data,
-                cluster_data, cur_nr_sectors, 1, &s->aes_encrypt_key);
+            /* The clusters are already reserved for this request, so other
+             * requests can go on while the data is being encrypted */
+            qemu_co_mutex_unlock(&s->lock);
+            qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                                     cur_nr_sectors, 1);
+            qemu_co_mutex_lock(&s->lock);
 
             qemu_iovec_reset(&hd_qiov);
             qemu_iovec_add(&hd_qiov, cluster_data,
@@ -1358,16 +1489,23 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                (cluster_offset >> 9) + index_in_cluster);
-        ret = bdrv_co_writev(bs->file,
-                             (cluster_offset >> 9) + index_in_cluster,
-                             cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0) {
-            goto fail;
+        /* If we need to do COW, check if it's possible to merge the
+         * writing of the guest data together with that of the COW regions.
+         * If it's not possible (or not necessary) then write the
+         * guest data now. */
+        if (!merge_cow(sector_num << 9, cur_nr_sectors << 9,
+                       &hd_qiov, l2meta)) {
+            qemu_co_mutex_unlock(&s->lock);
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    (cluster_offset >> 9) + index_in_cluster);
+            ret = bdrv_co_writev(bs->file,
+                                 (cluster_offset >> 9) + index_in_cluster,
+                                 cur_nr_sectors, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         while (l2meta != NULL) {
@@ -1423,6 +1561,15 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!bs->read_only && !(s->flags & BDRV_O_INCOMING)) {
+        ret = qcow2_store_persistent_bitmaps(bs);
+        if (ret < 0) {
+            error_report("Failed to store dirty bitmaps: %s", strerror(-ret));
+        }
+    }
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1657,6 +1804,25 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Dirty bitmaps */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size = cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -2603,6 +2769,13 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    /* dirty bitmaps need the autoclear bit, which version 2 does not have */
+    if (s->nb_bitmaps) {
+        error_report("Cannot downgrade an image with persistent dirty "
+                     "bitmaps");
+        return -ENOTSUP;
+    }
+
     /* since we can ignore compatible features, we can set them to 0 as well */
     s->compatible_features = 0;
     /* if lazy refcounts have been used, they have already been fixed through
@@ -2865,6 +3038,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_open          = qcow2_open,
     .bdrv_close         = qcow2_close,
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
+    .bdrv_reopen_commit   = qcow2_reopen_commit,
+    .bdrv_reopen_abort    = qcow2_reopen_abort,
     .bdrv_create        = qcow2_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = qcow2_co_get_block_status,
@@ -2897,6 +3072,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
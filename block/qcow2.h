@@ -38,6 +38,10 @@
 #define QCOW_CRYPT_AES  1
 
 #define QCOW_MAX_CRYPT_CLUSTERS 32
+
+/* Granularity at which encryption work is handed to the thread pool */
+#define QCOW_CRYPT_CHUNK_SECTORS 128
+
 #define QCOW_MAX_SNAPSHOTS 65536
 
 /* 8 MB refcount table is enough for 2 PB images at 64k cluster size
@@ -52,6 +56,11 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_BITMAP_NAME_MAX 1023
+/* Same reasoning as for snapshots, 1k per bitmap directory entry */
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -138,6 +147,40 @@ typedef struct QEMU_PACKED QCowSnapshotHeader {
     /* name follows  */
 } QCowSnapshotHeader;
 
+typedef struct QEMU_PACKED Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} Qcow2BitmapHeaderExt;
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    uint8_t reserved;
+    uint16_t name_size;
+    /* name follows, padded to a multiple of 8 bytes */
+} Qcow2BitmapDirEntry;
+
+/* Bitmap directory entry flags */
+enum {
+    QCOW2_BITMAP_IN_USE_BITNR = 0,
+    QCOW2_BITMAP_IN_USE       = 1 << QCOW2_BITMAP_IN_USE_BITNR,
+
+    QCOW2_BITMAP_FLAGS_MASK   = QCOW2_BITMAP_IN_USE,
+};
+
+typedef struct Qcow2Bitmap {
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    char *name;
+} Qcow2Bitmap;
+
 typedef struct QEMU_PACKED QCowSnapshotExtraData {
     uint64_t vm_state_size_large;
     uint64_t disk_size;
@@ -191,6 +234,15 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_DIRTY_BITMAPS       =
+        1 << QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_DIRTY_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -254,6 +306,10 @@ typedef struct BDRVQcowState {
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -338,6 +394,13 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * The I/O vector with the data from the actual guest write request.
+     * If non-NULL, this is meant to be merged together with the data
+     * from @cow_start and @cow_end into one single write operation.
+     */
+    QEMUIOVector *data_qiov;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -525,6 +588,9 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
                      const AES_KEY *key);
+int coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                          int64_t sector_num, uint8_t *buf,
+                                          int nb_sectors, int enc);
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
@@ -558,6 +624,15 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmap_directory(BlockDriverState *bs, Qcow2Bitmap **pbitmaps);
+void qcow2_free_bitmap_directory(Qcow2Bitmap *bitmaps, int nb_bitmaps);
+int qcow2_load_persistent_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_store_persistent_bitmaps(BlockDriverState *bs);
+int qcow2_mark_bitmaps_in_use(BlockDriverState *bs);
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -182,10 +182,8 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         return -ENOMEDIUM;
     }
     if (drv->bdrv_snapshot_goto) {
-        return drv->bdrv_snapshot_goto(bs, snapshot_id);
-    }
-
-    if (bs->file) {
+        ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+    } else if (bs->file) {
         drv->bdrv_close(bs);
         ret = bdrv_snapshot_goto(bs->file, snapshot_id);
         open_ret = drv->bdrv_open(bs, NULL, bs->open_flags, NULL);
@@ -194,10 +192,15 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
             bs->drv = NULL;
             return open_ret;
         }
-        return ret;
+    } else {
+        return -ENOTSUP;
     }
 
-    return -ENOTSUP;
+    if (ret == 0) {
+        /* Any sector may have changed */
+        bdrv_set_dirty_all(bs);
+    }
+    return ret;
 }
 
 /**
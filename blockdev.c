@@ -361,6 +361,9 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     bool has_driver_specific_opts;
     BlockdevDetectZeroesOptions detect_zeroes;
     BlockDriver *drv = NULL;
+    unsigned *stats_intervals = NULL;
+    int n_stats_intervals = 0;
+    int i;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -405,10 +408,18 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
-#ifdef CONFIG_LINUX_AIO
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
         if (!strcmp(buf, "native")) {
+#ifdef CONFIG_LINUX_AIO
             bdrv_flags |= BDRV_O_NATIVE_AIO;
+#endif
+        } else if (!strcmp(buf, "uring")) {
+#ifdef CONFIG_LINUX_IO_URING
+            bdrv_flags |= BDRV_O_IO_URING;
+#else
+            error_setg(errp, "aio=uring is not supported in this build");
+            goto early_err;
+#endif
         } else if (!strcmp(buf, "threads")) {
             /* this is the default */
         } else {
@@ -416,7 +427,6 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
            goto early_err;
         }
     }
-#endif
 
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
@@ -504,6 +514,24 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    if ((buf = qemu_opt_get(opts, "stats-intervals")) != NULL) {
+        char **lengths = g_strsplit(buf, ":", 0);
+
+        stats_intervals = g_new(unsigned, g_strv_length(lengths));
+        for (i = 0; lengths[i]; i++) {
+            unsigned long long length;
+
+            if (parse_uint_full(lengths[i], &length, 10) < 0 ||
+                length == 0 || length > UINT_MAX) {
+                error_setg(errp, "Invalid interval length: '%s'", lengths[i]);
+                g_strfreev(lengths);
+                goto early_err;
+            }
+            stats_intervals[n_stats_intervals++] = length;
+        }
+        g_strfreev(lengths);
+    }
+
     /* init */
     blk = blk_new_with_bs(qemu_opts_id(opts), errp);
     if (!blk) {
@@ -516,6 +544,12 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
     bdrv_set_on_error(bs, on_read_error, on_write_error);
 
+    for (i = 0; i < n_stats_intervals; i++) {
+        block_acct_add_interval(&bs->stats, stats_intervals[i]);
+    }
+    g_free(stats_intervals);
+    stats_intervals = NULL;
+
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
         bdrv_io_limits_enable(bs);
@@ -570,6 +604,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 err:
     blk_unref(blk);
 early_err:
+    g_free(stats_intervals);
     qemu_opts_del(opts);
 err_no_opts:
     QDECREF(bs_opts);
@@ -1527,6 +1562,7 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
                      backup->sync,
                      backup->has_mode, backup->mode,
                      backup->has_speed, backup->speed,
+                     backup->has_bitmap, backup->bitmap,
                      backup->has_on_source_error, backup->on_source_error,
                      backup->has_on_target_error, backup->on_target_error,
                      &local_err);
@@ -1894,6 +1930,49 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    uint64List *entry;
+    uint64_t *values = NULL;
+    int n = 0;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (has_boundaries) {
+        for (entry = boundaries; entry; entry = entry->next) {
+            if (n > 0 && entry->value <= values[n - 1]) {
+                error_setg(errp, "Histogram boundaries must be strictly "
+                           "ascending");
+                g_free(values);
+                return;
+            }
+            values = g_renew(uint64_t, values, n + 1);
+            values[n++] = entry->value;
+        }
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (has_boundaries) {
+        block_acct_set_latency_histogram(&bs->stats, values, n);
+    } else {
+        block_acct_set_default_latency_histogram(&bs->stats);
+    }
+
+    aio_context_release(aio_context);
+    g_free(values);
+}
+
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *id = qdict_get_str(qdict, "id");
@@ -2204,6 +2283,7 @@ void qmp_drive_backup(const char *device, const char *target,
                       enum MirrorSyncMode sync,
                       bool has_mode, enum NewImageMode mode,
                       bool has_speed, int64_t speed,
+                      bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       Error **errp)
@@ -2211,6 +2291,7 @@ void qmp_drive_backup(const char *device, const char *target,
     BlockDriverState *bs;
     BlockDriverState *target_bs;
     BlockDriverState *source = NULL;
+    BdrvDirtyBitmap *bmap = NULL;
     AioContext *aio_context;
     BlockDriver *drv = NULL;
     Error *local_err = NULL;
@@ -2260,6 +2341,27 @@ void qmp_drive_backup(const char *device, const char *target,
         goto out;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!has_bitmap) {
+            error_setg(errp, "Bitmap name must be specified for "
+                       "sync=incremental");
+            goto out;
+        }
+        bmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!bmap) {
+            error_setg(errp, "Bitmap '%s' could not be found", bitmap);
+            goto out;
+        }
+        if (bdrv_dirty_bitmap_frozen(bmap)) {
+            error_setg(errp, "Bitmap '%s' is in use by another operation",
+                       bitmap);
+            goto out;
+        }
+    } else if (has_bitmap) {
+        error_setg(errp, "A bitmap can only be used with sync=incremental");
+        goto out;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
 
     /* See if we have a backing HD we can use to create our new image
@@ -2306,7 +2408,8 @@ void qmp_drive_backup(const char *device, const char *target,
 
     bdrv_set_aio_context(target_bs, aio_context);
 
-    backup_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
+    backup_start(bs, target_bs, speed, sync, bmap,
+                 on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -2323,6 +2426,136 @@ BlockDeviceInfoList *qmp_query_named_block_nodes(Error **errp)
     return bdrv_named_nodes_list();
 }
 
+/**
+ * Return the BlockDriverState and the dirty bitmap called @name on @node,
+ * with the AioContext of the BlockDriverState acquired in *@paio.
+ */
+static BdrvDirtyBitmap *block_dirty_bitmap_lookup(const char *node,
+                                                  const char *name,
+                                                  BlockDriverState **pbs,
+                                                  AioContext **paio,
+                                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    AioContext *aio_context;
+
+    bs = bdrv_lookup_bs(node, node, errp);
+    if (!bs) {
+        return NULL;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        aio_context_release(aio_context);
+        return NULL;
+    }
+
+    *pbs = bs;
+    *paio = aio_context;
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_add(const char *node, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    AioContext *aio_context;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    if (!name || name[0] == '\0') {
+        error_setg(errp, "Bitmap name cannot be empty");
+        return;
+    }
+
+    bs = bdrv_lookup_bs(node, node, errp);
+    if (!bs) {
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (has_granularity) {
+        if (granularity < 512 || granularity > (64 << 20) ||
+            (granularity & (granularity - 1))) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                      "a power of 2 between 512 and 64M");
+            goto out;
+        }
+    } else {
+        /* Default to cluster size, if available: */
+        granularity = bdrv_get_default_bitmap_granularity(bs);
+    }
+
+    if (has_persistent && persistent &&
+        !bdrv_can_store_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistent(bitmap, persistent);
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
+void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
+                                   Error **errp)
+{
+    AioContext *aio_context;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = block_dirty_bitmap_lookup(node, name, &bs, &aio_context, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently frozen and cannot be removed",
+                   name);
+        goto out;
+    }
+    bdrv_release_dirty_bitmap(bs, bitmap);
+
+out:
+    aio_context_release(aio_context);
+}
+
+void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
+                                  Error **errp)
+{
+    AioContext *aio_context;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = block_dirty_bitmap_lookup(node, name, &bs, &aio_context, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently frozen and cannot be cleared",
+                   name);
+        goto out;
+    }
+    bdrv_clear_dirty_bitmap(bitmap);
+
+out:
+    aio_context_release(aio_context);
+}
+
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
 
 void qmp_drive_mirror(const char *device, const char *target,
@@ -2406,6 +2639,11 @@ void qmp_drive_mirror(const char *device, const char *target,
         goto out;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_setg(errp, "sync=incremental is not supported by drive-mirror");
+        goto out;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
     source = bs->backing_hd;
     if (!source && sync == MIRROR_SYNC_MODE_TOP) {
@@ -2819,7 +3057,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -2896,6 +3134,11 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "detect-zeroes",
             .type = QEMU_OPT_STRING,
             .help = "try to optimize zero writes (off, on, unmap)",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated list of intervals "
+                    "for collecting I/O statistics, in seconds",
         },
         { /* end of list */ }
     },
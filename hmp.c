@@ -172,6 +172,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -223,6 +227,25 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_sections) {
+        MigrationSectionInfoList *sec;
+
+        monitor_printf(mon, "sections (microseconds/bytes):\n");
+        for (sec = info->sections; sec; sec = sec->next) {
+            MigrationSectionInfo *s = sec->value;
+
+            monitor_printf(mon, "  %s/%" PRId64 ": setup %" PRId64 "/%" PRId64
+                           ", iterate %" PRId64 "/%" PRId64
+                           ", complete %" PRId64 "/%" PRId64
+                           ", load %" PRId64 "/%" PRId64 "\n",
+                           s->idstr, s->instance_id,
+                           s->setup_time, s->setup_bytes,
+                           s->iterate_time, s->iterate_bytes,
+                           s->complete_time, s->complete_bytes,
+                           s->load_time, s->load_bytes);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -246,6 +269,41 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    if (params) {
+        monitor_printf(mon, "parameters:");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_LEVEL],
+            params->compress_level);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_THREADS],
+            params->compress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+            params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_POSTCOPY_PASSES],
+            params->postcopy_passes);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL],
+            params->cpu_throttle_initial);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT],
+            params->cpu_throttle_increment);
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -454,9 +512,33 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
     qapi_free_BlockDeviceInfoList(blockdev_list);
 }
 
+/* Print as "rd_latency_histogram: <1000:3 <4000:10 ... >=4194304000:0",
+ * each bin labelled with its upper boundary in ns
+ */
+static void print_latency_histogram(Monitor *mon, const char *type,
+                                    BlockLatencyHistogramInfo *hist)
+{
+    uint64List *boundary = hist->boundaries, *bin;
+    uint64_t last = 0;
+
+    monitor_printf(mon, "  %s_latency_histogram:", type);
+    for (bin = hist->bins; bin; bin = bin->next) {
+        if (boundary) {
+            monitor_printf(mon, " <%" PRIu64 ":%" PRIu64,
+                           boundary->value, bin->value);
+            last = boundary->value;
+            boundary = boundary->next;
+        } else {
+            monitor_printf(mon, " >=%" PRIu64 ":%" PRIu64, last, bin->value);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
+    BlockDeviceTimedStatsList *ts;
 
     stats_list = qmp_query_blockstats(false, false, NULL);
 
@@ -483,6 +565,38 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+
+        for (ts = stats->value->stats->timed_stats; ts; ts = ts->next) {
+            BlockDeviceTimedStats *t = ts->value;
+
+            monitor_printf(mon, "  interval %" PRId64 "s:"
+                           " rd_latency_ns=%" PRId64 "/%" PRId64 "/%" PRId64
+                           " wr_latency_ns=%" PRId64 "/%" PRId64 "/%" PRId64
+                           " flush_latency_ns=%" PRId64 "/%" PRId64
+                           "/%" PRId64
+                           " rd_queue_depth=%.2f wr_queue_depth=%.2f\n",
+                           t->interval_length,
+                           t->min_rd_latency_ns, t->avg_rd_latency_ns,
+                           t->max_rd_latency_ns,
+                           t->min_wr_latency_ns, t->avg_wr_latency_ns,
+                           t->max_wr_latency_ns,
+                           t->min_flush_latency_ns, t->avg_flush_latency_ns,
+                           t->max_flush_latency_ns,
+                           t->avg_rd_queue_depth, t->avg_wr_queue_depth);
+        }
+
+        if (stats->value->stats->has_rd_latency_histogram) {
+            print_latency_histogram(mon, "rd",
+                                    stats->value->stats->rd_latency_histogram);
+        }
+        if (stats->value->stats->has_wr_latency_histogram) {
+            print_latency_histogram(mon, "wr",
+                                    stats->value->stats->wr_latency_histogram);
+        }
+        if (stats->value->stats->has_flush_latency_histogram) {
+            print_latency_histogram(mon, "flush",
+                                    stats->value->stats->flush_latency_histogram);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -1021,7 +1135,8 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
 
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0, false, 0, false, 0, &err);
+                     true, mode, false, 0, false, NULL,
+                     false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1077,6 +1192,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1134,6 +1257,68 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+    bool has_compress_level = false;
+    bool has_compress_threads = false;
+    bool has_decompress_threads = false;
+    bool has_multifd_channels = false;
+    bool has_postcopy_passes = false;
+    bool has_cpu_throttle_initial = false;
+    bool has_cpu_throttle_increment = false;
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            switch (i) {
+            case MIGRATION_PARAMETER_COMPRESS_LEVEL:
+                has_compress_level = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_THREADS:
+                has_compress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
+                has_decompress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_MULTIFD_CHANNELS:
+                has_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_POSTCOPY_PASSES:
+                has_postcopy_passes = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL:
+                has_cpu_throttle_initial = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT:
+                has_cpu_throttle_increment = true;
+                break;
+            }
+            qmp_migrate_set_parameters(has_compress_level, value,
+                                       has_compress_threads, value,
+                                       has_decompress_threads, value,
+                                       has_multifd_channels, value,
+                                       has_postcopy_passes, value,
+                                       has_cpu_throttle_initial, value,
+                                       has_cpu_throttle_increment, value,
+                                       &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_PARAMETER_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
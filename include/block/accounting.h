@@ -27,6 +27,8 @@
 #include <stdint.h>
 
 #include "qemu/typedefs.h"
+#include "qemu/queue.h"
+#include "qemu/timed-average.h"
 
 enum BlockAcctType {
     BLOCK_ACCT_READ,
@@ -35,11 +37,32 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+typedef struct BlockAcctTimedStats BlockAcctTimedStats;
+
+/* Latency statistics over a sliding window of @interval_length seconds */
+struct BlockAcctTimedStats {
+    TimedAverage latency[BLOCK_MAX_IOTYPE];
+    unsigned interval_length;
+    QSLIST_ENTRY(BlockAcctTimedStats) entries;
+};
+
+/* Latency histogram: bins[i] counts the requests whose latency in ns lies in
+ * [boundaries[i - 1], boundaries[i]), with the first and last bin open-ended.
+ * There are nbins - 1 boundaries.  A histogram with nbins == 0 is disabled.
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;
+    uint64_t *boundaries;
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
 } BlockAcctStats;
 
 typedef struct BlockAcctCookie {
@@ -53,5 +76,17 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors);
+void block_acct_cleanup(BlockAcctStats *stats);
+
+void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length);
+BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
+                                              BlockAcctTimedStats *s);
+double block_acct_queue_depth(BlockAcctTimedStats *stats,
+                              enum BlockAcctType type);
+
+void block_acct_set_latency_histogram(BlockAcctStats *stats,
+                                      const uint64_t *boundaries,
+                                      int nboundaries);
+void block_acct_set_default_latency_histogram(BlockAcctStats *stats);
 
 #endif
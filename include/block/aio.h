@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -90,6 +91,20 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive busy polling, see aio_poll().  poll_max_ns == 0 disables
+     * polling, poll_ns is the current self-tuned polling interval.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Blocking aio_poll() calls that were satisfied by polling, and those
+     * that polled without result and went on to wait in ppoll().
+     */
+    uint64_t poll_hits;
+    uint64_t poll_misses;
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
@@ -266,6 +281,38 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Attach a busy-poll callback to the handler registered for @fd.  When
+ * polling is enabled, a blocking aio_poll() calls @io_poll with the handler's
+ * opaque pointer in a loop before sleeping.  @io_poll must check for new work
+ * without blocking, process it and return true if it made progress.
+ *
+ * The poll callback goes away together with the fd handler.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Same as aio_set_fd_poll for an event notifier registered with
+ * aio_set_event_notifier.  @io_poll is called with @notifier as argument.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds, 0 disables polling
+ * @grow: polling time growth factor, 0 selects the default
+ * @shrink: polling time shrink factor, 0 stops polling at once on a miss
+ * @errp: error object
+ *
+ * Configure adaptive busy polling.  The polling interval starts small and
+ * grows by @grow while events keep arriving shortly after aio_poll() would
+ * have gone to sleep; it shrinks by @shrink when waits are longer than
+ * @max_ns and polling would only have burnt CPU.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
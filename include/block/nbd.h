@@ -59,23 +59,61 @@ struct nbd_reply {
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)       /* Block status: one extent */
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_QEMU_BLOCK_STATUS = 0x8000
 };
 
+/* QEMU extensions stay out of the flag and command numbers of the NBD
+ * protocol.  The server lists them in a big-endian 32-bit word at the start
+ * of the reserved bytes after the export flags, which other servers fill
+ * with zeroes and other clients skip, and their commands are numbered from
+ * 0x8000 up.
+ */
+#define NBD_QEMU_FLAG_BLOCK_STATUS  (1 << 0)    /* Send QEMU_BLOCK_STATUS */
+
+/* NBD_CMD_QEMU_BLOCK_STATUS, offered by the server with
+ * NBD_QEMU_FLAG_BLOCK_STATUS.  The request describes a range like a READ.
+ * A successful reply is followed by a big-endian 32-bit extent count and
+ * that many struct nbd_extent, also big-endian.  The extents are contiguous,
+ * start at the requested offset, and may cover less than the requested
+ * length but never more; there is at least one and at most NBD_MAX_EXTENTS,
+ * or exactly one if the request has NBD_CMD_FLAG_REQ_ONE.
+ */
+struct nbd_extent {
+    uint32_t length;
+    uint32_t flags;                             /* NBD_STATE_* */
+} QEMU_PACKED;
+
+#define NBD_STATE_HOLE          (1 << 0)        /* Not allocated */
+#define NBD_STATE_ZERO          (1 << 1)        /* Reads as zeroes */
+
+#define NBD_MAX_EXTENTS         256
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
 #define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
 
+/* Default and maximum number of requests in flight on one connection.  The
+ * server allocates a data buffer for each request it is processing, so its
+ * default stays low; clients may queue more requests than the server
+ * processes at once and the socket buffers them.
+ */
+#define NBD_DEFAULT_SERVER_REQUESTS 16
+#define NBD_DEFAULT_CLIENT_REQUESTS 64
+#define NBD_MAX_REQUESTS            1024
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize);
+                          uint32_t *qemu_flags, off_t *size,
+                          size_t *blocksize);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size, size_t blocksize);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
@@ -87,6 +125,7 @@ typedef struct NBDClient NBDClient;
 
 NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
                           uint32_t nbdflags, void (*close)(NBDExport *));
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
@@ -311,6 +311,12 @@ typedef struct RAMBlock {
      */
     QTAILQ_ENTRY(RAMBlock) next;
     int fd;
+    /* Where the block lives in a fixed-ram migration file, and which of
+     * its pages have been written there.
+     */
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+    unsigned long *file_bmap;
 } RAMBlock;
 
 static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
@@ -18,6 +18,7 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/event_notifier.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
@@ -33,6 +34,7 @@
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_COMMAND              0x06
 
 struct MigrationParams {
     bool blk;
@@ -41,6 +43,45 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Post-copy state of the incoming side, see migration/migration.c */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,
+    POSTCOPY_INCOMING_ADVISE,
+    POSTCOPY_INCOMING_LISTENING,
+    POSTCOPY_INCOMING_RUNNING,
+    POSTCOPY_INCOMING_END
+} PostcopyIncomingState;
+
+typedef struct MigrationIncomingState {
+    QEMUFile *file;
+    int postcopy_state;
+
+    /* Loads the stream, see process_incoming_migration() */
+    bool have_incoming_thread;
+    QemuThread incoming_thread;
+    QEMUBH *incoming_bh;
+    int incoming_ret;
+
+    /* Opened on the listen command, writes serialised by rp_mutex */
+    QEMUFile *return_path;
+    QemuMutex rp_mutex;
+
+    /* The rest of the stream is loaded by this thread once the guest runs */
+    bool have_listen_thread;
+    QemuThread listen_thread;
+    /* Set once the main loop is done with the stream that started it */
+    QemuEvent main_done;
+
+    /* Demand paging of the guest RAM */
+    int userfault_fd;
+    bool have_fault_thread;
+    QemuThread fault_thread;
+    EventNotifier userfault_quit;
+    uint8_t *postcopy_tmp_page;
+} MigrationIncomingState;
+
+MigrationIncomingState *migration_incoming_get_current(void);
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -59,12 +100,24 @@ struct MigrationState
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    /* destination of the multifd connections, only set for TCP */
+    char *tcp_host_port;
+
+    /* Post-copy: the return path is only opened if postcopy-ram is on */
+    QEMUFile *rp_file;
+    bool rp_thread_created;
+    QemuThread rp_thread;
+    bool rp_error;
+    /* set by migrate-start-postcopy */
+    bool start_postcopy;
 };
 
 void process_incoming_migration(QEMUFile *f);
+void process_incoming_migration_coroutine(QEMUFile *f);
 
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
@@ -82,6 +135,12 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+int tcp_connect_migration_channel(MigrationState *s, Error **errp);
+
+int tcp_accept_migration_channel(Error **errp);
+
+void tcp_finish_incoming_migration(void);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -90,6 +149,10 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -98,6 +161,10 @@ void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
 
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
+
 int migrate_fd_close(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
@@ -110,7 +177,18 @@ MigrationState *migrate_get_current(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
-void free_xbzrle_decoded_buf(void);
+void migrate_decompress_threads_join(void);
+void migrate_multifd_recv_join(void);
+void multifd_send_cancel(void);
+
+/* Post-copy, implemented next to the rest of the RAM migration code */
+bool postcopy_ram_supported_by_host(void);
+int postcopy_ram_incoming_init(MigrationIncomingState *mis);
+int postcopy_ram_enable_notify(MigrationIncomingState *mis);
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
+int ram_discard_range(const char *block_name, uint64_t start, uint64_t length);
+int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -125,6 +203,7 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+int mig_throttle_get_percentage(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -146,14 +225,30 @@ bool migrate_rdma_pin_all(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+int migrate_cpu_throttle_initial(void);
+int migrate_cpu_throttle_increment(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+const char *xbzrle_encode_buffer_accel(void);
+bool test_xbzrle_encode_buffer_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+
+bool migrate_use_fixed_ram(void);
+
+bool migrate_postcopy_ram(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
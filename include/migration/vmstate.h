@@ -54,8 +54,17 @@ typedef struct SaveVMHandlers {
     /* This runs outside the iothread lock!  */
     int (*save_live_setup)(QEMUFile *f, void *opaque);
     uint64_t (*save_live_pending)(QEMUFile *f, void *opaque, uint64_t max_size);
+    /* Can the section keep iterating after the guest has been started on
+     * the destination?  Only RAM can, see the postcopy-ram capability.
+     */
+    bool (*can_postcopy)(void *opaque);
 
     LoadStateHandler *load_state;
+    /* Incoming migration runs load_state outside the iothread lock if this
+     * is set, like save_live_iterate it had better only use data that is
+     * local to the migration or protected by other locks.
+     */
+    bool load_state_unlocked;
 } SaveVMHandlers;
 
 int register_savevm(DeviceState *dev,
@@ -458,14 +458,9 @@ void qemu_hexdump(const char *buf, FILE *fp, const char *prefix, size_t size);
 #endif
 
 #define BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR 8
-static inline bool
-can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
-{
-    return (len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
-                   * sizeof(VECTYPE)) == 0
-            && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
-}
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+const char *buffer_find_nonzero_offset_accel(void);
+bool test_buffer_find_nonzero_offset_next_accel(void);
 
 /*
  * helper to parse debug environment variables
@@ -125,6 +125,46 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item);
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * hbitmap_merge:
+ * @a: HBitmap to store the result in.
+ * @b: HBitmap to merge into @a.
+ *
+ * Set in @a every bit that is set in @b.  The two bitmaps must have the
+ * same size and granularity.
+ */
+void hbitmap_merge(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes hbitmap_serialize() produces for @hb, one bit
+ * per group of 2^granularity bits rounded up to a multiple of 8 bytes.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb);
+
+/**
+ * hbitmap_serialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes.
+ *
+ * Store the contents of @hb in @buf.  Bit N of byte M represents the group
+ * of bits number M * 8 + N, independent of the host's endianness and word
+ * size.
+ */
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf);
+
+/**
+ * hbitmap_deserialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes.
+ *
+ * Replace the contents of @hb with data from hbitmap_serialize().  Bits
+ * beyond the size of @hb are ignored.
+ */
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
@@ -0,0 +1,70 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Interval tree
+ *
+ * Indexes half-open intervals [start, end) and finds those overlapping a
+ * query range in O(log n + k) expected time.  The tree is a treap ordered by
+ * start address, where every node also records the largest end address in
+ * its subtree so that searches can skip subtrees that end before the query.
+ *
+ * Nodes are embedded in the caller's structure, the tree never allocates.
+ * A zero-initialized IntervalTree is empty.
+ */
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    uint64_t start;             /* first unit covered, read-only */
+    uint64_t end;               /* one past the last unit, read-only */
+
+    /* private: */
+    uint64_t subtree_end;       /* largest end in this subtree */
+    uint32_t priority;          /* heap order of the treap */
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+};
+
+typedef struct {
+    IntervalTreeNode *root;
+    uint32_t seed;              /* random number state for priorities */
+} IntervalTree;
+
+/* Return true to select @node, false to keep searching */
+typedef bool IntervalTreeMatchFunc(IntervalTreeNode *node, void *opaque);
+
+/* Insert @node covering [@start, @end).  The interval must not be changed
+ * while the node is in the tree; remove and re-insert it instead.
+ */
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node,
+                          uint64_t start, uint64_t end);
+
+/* Remove @node, which must be in @tree */
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node);
+
+/* Return the node with the lowest start that overlaps [@start, @end) and for
+ * which @match returns true, or NULL.  Two intervals overlap if each starts
+ * before the other ends.  A NULL @match selects every overlapping node.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTree *tree,
+                                     uint64_t start, uint64_t end,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque);
+
+static inline bool interval_tree_empty(IntervalTree *tree)
+{
+    return tree->root == NULL;
+}
+
+#endif /* QEMU_INTERVAL_TREE_H */
@@ -82,13 +82,25 @@ void do_info_snapshots(Monitor *mon, const QDict *qdict);
 void qemu_announce_self(void);
 
 bool qemu_savevm_state_blocked(Error **errp);
+void qemu_savevm_state_header(QEMUFile *f);
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params);
-int qemu_savevm_state_iterate(QEMUFile *f);
+int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy);
 void qemu_savevm_state_complete(QEMUFile *f);
+void qemu_savevm_state_switch_postcopy(QEMUFile *f);
+void qemu_savevm_state_complete_postcopy(QEMUFile *f);
 void qemu_savevm_state_cancel(void);
-uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
+uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size,
+                                   bool postcopy);
+void qemu_savevm_send_postcopy_advise(QEMUFile *f);
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t count, uint64_t *start,
+                                           uint64_t *length);
+void qemu_savevm_send_postcopy_listen(QEMUFile *f);
+void qemu_savevm_send_postcopy_run(QEMUFile *f);
+int qemu_savevm_send_packaged(QEMUFile *f, QEMUFile *package);
 int qemu_loadvm_state(QEMUFile *f);
+MigrationSectionInfoList *qemu_savevm_section_info(void);
 
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
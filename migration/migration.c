@@ -23,6 +23,7 @@
 #include "qemu/sockets.h"
 #include "migration/block.h"
 #include "qemu/thread.h"
+#include "qemu/error-report.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -34,6 +35,17 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
+};
+
+/* Messages sent by the destination on the return path: a be16 type, a be16
+ * length and the data.
+ */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,
+    MIG_RP_MSG_SHUT,          /* be32 status, 0 if the load succeeded */
+    MIG_RP_MSG_REQ_PAGES,     /* be64 start, be32 length, RAMBlock name */
+    MIG_RP_MSG_MAX
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -46,6 +58,25 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default compression parameters, the level is the zlib level */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define MAX_MIGRATE_COMPRESS_THREAD_COUNT 255
+
+/* Default number of additional connections for multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define MAX_MIGRATE_MULTIFD_CHANNELS 255
+
+/* Default number of RAM passes before the switch to post-copy */
+#define DEFAULT_MIGRATE_POSTCOPY_PASSES 3
+#define MAX_MIGRATE_POSTCOPY_PASSES 255
+
+/* Percentage of VCPU time auto-converge takes away at first, and on each
+ * further step */
+#define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
+#define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -60,11 +91,51 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+                DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+                DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_POSTCOPY_PASSES] =
+                DEFAULT_MIGRATE_POSTCOPY_PASSES,
+        .parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL] =
+                DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
+        .parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT] =
+                DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
     };
 
     return &current_migration;
 }
 
+static MigrationIncomingState incoming_migration;
+
+MigrationIncomingState *migration_incoming_get_current(void)
+{
+    return &incoming_migration;
+}
+
+static void migration_incoming_state_init(QEMUFile *f)
+{
+    MigrationIncomingState *mis = &incoming_migration;
+    static bool rp_mutex_initialized;
+
+    assert(!mis->have_listen_thread);
+    mis->file = f;
+    mis->postcopy_state = POSTCOPY_INCOMING_NONE;
+    mis->return_path = NULL;
+    mis->userfault_fd = -1;
+    mis->have_fault_thread = false;
+    if (!rp_mutex_initialized) {
+        qemu_mutex_init(&mis->rp_mutex);
+        qemu_event_init(&mis->main_done, false);
+        rp_mutex_initialized = true;
+    }
+    qemu_event_reset(&mis->main_done);
+}
+
 void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
@@ -82,21 +153,29 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
 }
 
-static void process_incoming_migration_co(void *opaque)
+static void process_incoming_migration_finish(QEMUFile *f, int ret)
 {
-    QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
     Error *local_err = NULL;
-    int ret;
 
-    ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
-    free_xbzrle_decoded_buf();
+    if (mis->postcopy_state == POSTCOPY_INCOMING_ADVISE) {
+        /* The source did not switch to post-copy in the end */
+        postcopy_ram_incoming_cleanup(mis);
+    }
+    if (!mis->have_listen_thread) {
+        qemu_fclose(f);
+    }
+    migrate_decompress_threads_join();
+    migrate_multifd_recv_join();
+    tcp_finish_incoming_migration();
     if (ret < 0) {
         error_report("load of migration failed: %s", strerror(-ret));
         exit(EXIT_FAILURE);
@@ -116,14 +195,69 @@ static void process_incoming_migration_co(void *opaque)
     } else {
         runstate_set(RUN_STATE_PAUSED);
     }
+    qemu_event_set(&mis->main_done);
 }
 
+static void process_incoming_migration_bh(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    qemu_bh_delete(mis->incoming_bh);
+    mis->incoming_bh = NULL;
+    qemu_thread_join(&mis->incoming_thread);
+    mis->have_incoming_thread = false;
+
+    process_incoming_migration_finish(f, mis->incoming_ret);
+}
+
+static void *process_incoming_migration_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    mis->incoming_ret = qemu_loadvm_state(f);
+    qemu_bh_schedule(mis->incoming_bh);
+    return NULL;
+}
+
+/* The stream is loaded by a thread of its own, so that neither waiting for
+ * data nor loading RAM holds up the main loop and the monitor.  The thread
+ * only takes the iothread lock to load device state, and the main loop
+ * finishes the migration once it is done.
+ */
 void process_incoming_migration(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int fd = qemu_get_fd(f);
+
+    assert(fd != -1);
+    migration_incoming_state_init(f);
+    qemu_set_block(fd);
+    mis->incoming_bh = qemu_bh_new(process_incoming_migration_bh, f);
+    mis->have_incoming_thread = true;
+    qemu_thread_create(&mis->incoming_thread, "incoming",
+                       process_incoming_migration_thread, f,
+                       QEMU_THREAD_JOINABLE);
+}
+
+static void process_incoming_migration_co(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    process_incoming_migration_finish(f, qemu_loadvm_state(f));
+}
+
+/* RDMA waits for completions in a coroutine, so it keeps loading the stream
+ * from the main loop.
+ */
+void process_incoming_migration_coroutine(QEMUFile *f)
 {
     Coroutine *co = qemu_coroutine_create(process_incoming_migration_co);
     int fd = qemu_get_fd(f);
 
     assert(fd != -1);
+    migration_incoming_state_init(f);
     qemu_set_nonblock(fd);
     qemu_coroutine_enter(co, f);
 }
@@ -164,6 +298,29 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    params->postcopy_passes =
+            s->parameters[MIGRATION_PARAMETER_POSTCOPY_PASSES];
+    params->cpu_throttle_initial =
+            s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL];
+    params->cpu_throttle_increment =
+            s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT];
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -194,8 +351,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
     case MIG_STATE_CANCELLING:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->state == MIG_STATE_POSTCOPY_ACTIVE ?
+                                "postcopy-active" : "active");
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
             - s->total_time;
@@ -217,6 +376,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
 
+        if (migrate_auto_converge()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = mig_throttle_get_percentage();
+        }
+
         if (blk_mig_active()) {
             info->has_disk = true;
             info->disk = g_malloc0(sizeof(*info->disk));
@@ -261,6 +425,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     }
 
+    /* Also set on the destination, which has no migration state */
+    info->sections = qemu_savevm_section_info();
+    info->has_sections = info->sections != NULL;
+
     return info;
 }
 
@@ -270,7 +438,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -280,6 +449,115 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels,
+                                bool has_postcopy_passes,
+                                int64_t postcopy_passes,
+                                bool has_cpu_throttle_initial,
+                                int64_t cpu_throttle_initial,
+                                bool has_cpu_throttle_increment,
+                                int64_t cpu_throttle_increment, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+            (compress_threads < 1 ||
+             compress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+            (decompress_threads < 1 ||
+             decompress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_multifd_channels &&
+            (multifd_channels < 1 ||
+             multifd_channels > MAX_MIGRATE_MULTIFD_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_channels",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_postcopy_passes &&
+            (postcopy_passes < 0 ||
+             postcopy_passes > MAX_MIGRATE_POSTCOPY_PASSES)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "postcopy_passes",
+                  "is invalid, it should be in the range of 0 to 255");
+        return;
+    }
+    if (has_cpu_throttle_initial &&
+            (cpu_throttle_initial < 1 || cpu_throttle_initial > 99)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpu_throttle_initial",
+                  "is invalid, it should be in the range of 1 to 99");
+        return;
+    }
+    if (has_cpu_throttle_increment &&
+            (cpu_throttle_increment < 1 || cpu_throttle_increment > 99)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpu_throttle_increment",
+                  "is invalid, it should be in the range of 1 to 99");
+        return;
+    }
+
+    /* The thread counts only take effect on the next migration, the level
+     * is read for every page */
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                decompress_threads;
+    }
+    if (has_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] = multifd_channels;
+    }
+    if (has_postcopy_passes) {
+        s->parameters[MIGRATION_PARAMETER_POSTCOPY_PASSES] = postcopy_passes;
+    }
+    if (has_cpu_throttle_initial) {
+        s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL] =
+                cpu_throttle_initial;
+    }
+    if (has_cpu_throttle_increment) {
+        s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT] =
+                cpu_throttle_increment;
+    }
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable the postcopy-ram capability before "
+                   "starting post-copy");
+        return;
+    }
+    if (s->state != MIG_STATE_SETUP && s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "Post-copy can only be started during migration");
+        return;
+    }
+
+    /* Picked up by the migration thread */
+    atomic_set(&s->start_postcopy, true);
+}
+
 /* shared migration helpers */
 
 static void migrate_set_state(MigrationState *s, int old_state, int new_state)
@@ -305,8 +583,13 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_fclose(s->file);
         s->file = NULL;
     }
+    if (s->rp_file) {
+        qemu_fclose(s->rp_file);
+        s->rp_file = NULL;
+    }
 
     assert(s->state != MIG_STATE_ACTIVE);
+    assert(s->state != MIG_STATE_POSTCOPY_ACTIVE);
 
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -339,6 +622,10 @@ static void migrate_fd_cancel(MigrationState *s)
         }
         migrate_set_state(s, old_state, MIG_STATE_CANCELLING);
     } while (s->state != MIG_STATE_CANCELLING);
+
+    if (old_state == MIG_STATE_SETUP || old_state == MIG_STATE_ACTIVE) {
+        multifd_send_cancel();
+    }
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -373,14 +660,18 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int parameters[MIGRATION_PARAMETER_MAX];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
+    g_free(s->tcp_host_port);
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(s->parameters, parameters, sizeof(parameters));
     s->xbzrle_cache_size = xbzrle_cache_size;
 
     s->bandwidth_limit = bandwidth_limit;
@@ -416,7 +707,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
-        s->state == MIG_STATE_CANCELLING) {
+        s->state == MIG_STATE_CANCELLING ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -450,6 +742,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -546,6 +840,24 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+int migrate_cpu_throttle_initial(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL];
+}
+
+int migrate_cpu_throttle_increment(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -573,8 +885,277 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+}
+
+bool migrate_use_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
+/* Return path, written by the destination */
+
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type type,
+                                    uint16_t len, uint8_t *data)
+{
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->return_path, (unsigned int)type);
+    qemu_put_be16(mis->return_path, len);
+    qemu_put_buffer(mis->return_path, data, len);
+    qemu_fflush(mis->return_path);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/* Tell the source that the incoming migration is over, @value is 0 if it
+ * succeeded.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value)
+{
+    uint32_t buf = cpu_to_be32(value);
+
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf),
+                            (uint8_t *)&buf);
+}
+
+/* Ask the source for @len bytes of RAMBlock @rbname, from @start */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t buf[8 + 4 + 1 + 255];
+    size_t name_len = strlen(rbname);
+
+    assert(name_len <= 255);
+    stq_be_p(buf, start);
+    stl_be_p(buf + 8, len);
+    buf[12] = name_len;
+    memcpy(buf + 13, rbname, name_len);
+
+    migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES, 13 + name_len, buf);
+}
+
+/* Return path, read by the source */
+
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    QEMUFile *rp = s->rp_file;
+    uint8_t buf[8 + 4 + 1 + 255 + 1];
+    uint16_t type, len;
+    char *rbname;
+    int name_len;
+
+    while (true) {
+        type = qemu_get_be16(rp);
+        len = qemu_get_be16(rp);
+        if (qemu_file_get_error(rp)) {
+            error_report("Post-copy return path closed by the destination");
+            goto fail;
+        }
+        if (len >= sizeof(buf) ||
+            qemu_get_buffer(rp, buf, len) != len) {
+            error_report("Invalid return path message length %d", len);
+            goto fail;
+        }
+
+        switch (type) {
+        case MIG_RP_MSG_SHUT:
+            if (len != 4) {
+                goto invalid;
+            }
+            trace_source_return_path_thread_shut(ldl_be_p(buf));
+            if (ldl_be_p(buf)) {
+                error_report("Post-copy failed on the destination");
+                goto fail;
+            }
+            return NULL;
+        case MIG_RP_MSG_REQ_PAGES:
+            if (len < 13 || len != 13 + buf[12]) {
+                goto invalid;
+            }
+            name_len = buf[12];
+            rbname = (char *)buf + 13;
+            rbname[name_len] = 0;
+            if (ram_save_queue_pages(rbname, ldq_be_p(buf),
+                                     ldl_be_p(buf + 8)) < 0) {
+                goto fail;
+            }
+            break;
+        default:
+            goto invalid;
+        }
+    }
+
+invalid:
+    error_report("Invalid return path message %d, length %d", type, len);
+fail:
+    s->rp_error = true;
+    /* Stop the migration thread, unless it is already done */
+    qemu_file_set_error(s->file, -EIO);
+    return NULL;
+}
+
+/* Wait for the destination to finish, or make the thread give up */
+static int await_return_path_close_on_source(MigrationState *s, bool abort)
+{
+    if (!s->rp_thread_created) {
+        return 0;
+    }
+    if (abort) {
+        /* Also wakes up the thread if it is blocked reading */
+        shutdown(qemu_get_fd(s->rp_file), 2);
+    }
+    qemu_thread_join(&s->rp_thread);
+    s->rp_thread_created = false;
+    return s->rp_error ? -EIO : 0;
+}
+
 /* migration thread support */
 
+/* Post-copy starts after the configured number of passes over RAM, or
+ * when asked with migrate-start-postcopy.
+ */
+static bool migration_should_start_postcopy(MigrationState *s)
+{
+    int passes = s->parameters[MIGRATION_PARAMETER_POSTCOPY_PASSES];
+
+    if (!s->rp_file) {
+        return false;
+    }
+    if (atomic_read(&s->start_postcopy)) {
+        return true;
+    }
+    /* The first sync is done at setup, each later one ends a pass */
+    return passes && s->dirty_sync_count > passes;
+}
+
+/*
+ * Switch to post-copy: stop the guest, make the destination drop the pages
+ * that are dirty and send everything but the RAM in a package.  The guest
+ * runs on the destination once that is loaded.
+ */
+static int postcopy_start(MigrationState *s, int64_t *start_time,
+                          bool *old_vm_running)
+{
+    QEMUFile *fb;
+    int ret;
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    /* migrate_cancel may have got in before we took the lock; the guest
+     * must then keep running here.
+     */
+    if (s->state != MIG_STATE_ACTIVE) {
+        qemu_mutex_unlock_iothread();
+        return -ECANCELED;
+    }
+    *start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Page requests must be answered without delay */
+    qemu_file_set_rate_limit(s->file, INT64_MAX);
+
+    s->rp_thread_created = true;
+    qemu_thread_create(&s->rp_thread, "return_path",
+                       source_return_path_thread, s, QEMU_THREAD_JOINABLE);
+
+    ret = ram_postcopy_send_discard_bitmap(s);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    fb = qemu_bufopen("w", NULL);
+    qemu_savevm_send_postcopy_listen(fb);
+    qemu_savevm_state_switch_postcopy(fb);
+    qemu_savevm_send_postcopy_run(fb);
+    ret = qemu_savevm_send_packaged(s->file, fb);
+    qemu_fclose(fb);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* From now on the guest only exists on the destination */
+    *old_vm_running = false;
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - *start_time;
+    migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+    qemu_mutex_unlock_iothread();
+    return 0;
+
+fail:
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -585,20 +1166,63 @@ static void *migration_thread(void *opaque)
     int64_t start_time = initial_time;
     bool old_vm_running = false;
 
+    qemu_savevm_state_header(s->file);
+
+    if (migrate_postcopy_ram()) {
+        s->rp_file = qemu_file_get_return_path(s->file);
+        if (s->rp_file) {
+            qemu_savevm_send_postcopy_advise(s->file);
+        } else {
+            error_report("postcopy-ram needs a migration transport with a "
+                         "return path, using pre-copy only");
+        }
+    }
+
     qemu_savevm_state_begin(s->file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ACTIVE);
 
-    while (s->state == MIG_STATE_ACTIVE) {
+    while (s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
+        bool in_postcopy = s->state == MIG_STATE_POSTCOPY_ACTIVE;
 
         if (!qemu_file_rate_limit(s->file)) {
-            pending_size = qemu_savevm_state_pending(s->file, max_size);
+            pending_size = qemu_savevm_state_pending(s->file, max_size,
+                                                     in_postcopy);
             trace_migrate_pending(pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
-                qemu_savevm_state_iterate(s->file);
+            if (in_postcopy) {
+                if (pending_size) {
+                    qemu_savevm_state_iterate(s->file, true);
+                } else {
+                    qemu_mutex_lock_iothread();
+                    qemu_savevm_state_complete_postcopy(s->file);
+                    qemu_mutex_unlock_iothread();
+
+                    if (!qemu_file_get_error(s->file) &&
+                        !await_return_path_close_on_source(s, false)) {
+                        migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                          MIG_STATE_COMPLETED);
+                        break;
+                    }
+                }
+            } else if (pending_size && pending_size >= max_size) {
+                if (migration_should_start_postcopy(s)) {
+                    int ret = postcopy_start(s, &start_time, &old_vm_running);
+
+                    if (ret < 0) {
+                        if (ret != -ECANCELED) {
+                            error_report("Failed to start post-copy");
+                        }
+                        migrate_set_state(s, MIG_STATE_ACTIVE,
+                                          MIG_STATE_ERROR);
+                        break;
+                    }
+                    continue;
+                }
+                qemu_savevm_state_iterate(s->file, false);
             } else {
                 int ret;
 
@@ -627,7 +1251,9 @@ static void *migration_thread(void *opaque)
         }
 
         if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+            migrate_set_state(s, in_postcopy ? MIG_STATE_POSTCOPY_ACTIVE
+                                             : MIG_STATE_ACTIVE,
+                              MIG_STATE_ERROR);
             break;
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -658,12 +1284,17 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    await_return_path_close_on_source(s, true);
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!s->downtime) {
+            /* With post-copy, this was set when the guest was started */
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
@@ -691,6 +1322,10 @@ void migrate_fd_connect(MigrationState *s)
 
     qemu_file_set_rate_limit(s->file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
+    /* Pages go out in large writes, the thread flushes at least every
+     * BUFFER_DELAY through qemu_ftell()
+     */
+    qemu_file_set_batch(s->file, true);
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
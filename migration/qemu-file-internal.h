@@ -30,6 +30,8 @@
 
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/* With batching, see qemu_file_set_batch() */
+#define MAX_BATCH_IOV_SIZE IOV_MAX
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -44,8 +46,9 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
-    struct iovec iov[MAX_IOV_SIZE];
+    struct iovec iov[MAX_BATCH_IOV_SIZE];
     unsigned int iovcnt;
+    unsigned int iov_limit; /* flush when this many iovecs are queued */
 
     int last_error;
 };
@@ -191,16 +191,45 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
     return s->file;
 }
 
+/*
+ * The return path gets its own descriptor so that the two files can be
+ * closed independently.  Note that the descriptors share their file
+ * status flags, the read side must only be used blocking from a thread.
+ */
+static QEMUFile *socket_open_return_path(void *opaque, const char *mode)
+{
+    QEMUFileSocket *s = opaque;
+    int fd;
+
+    fd = dup(s->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+    return qemu_fopen_socket(fd, mode);
+}
+
+static QEMUFile *socket_get_return_path_rb(void *opaque)
+{
+    return socket_open_return_path(opaque, "rb");
+}
+
+static QEMUFile *socket_get_return_path_wb(void *opaque)
+{
+    return socket_open_return_path(opaque, "wb");
+}
+
 static const QEMUFileOps socket_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = socket_get_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path_wb
 };
 
 static const QEMUFileOps socket_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = socket_writev_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path_rb
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
@@ -50,9 +50,28 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->iov_limit = MAX_IOV_SIZE;
     return f;
 }
 
+/*
+ * Batch writes
+ *
+ * By default the buffers queued with qemu_put_buffer_async() are written
+ * out every MAX_IOV_SIZE iovecs.  A stream of pages, each with its header,
+ * then costs a system call every few pages.  With batching the queue takes
+ * up to IOV_MAX iovecs, so that a single writev()/sendmsg() carries hundreds
+ * of pages.  Only useful for files that are flushed regularly anyway, the
+ * data may sit in the queue longer.
+ */
+void qemu_file_set_batch(QEMUFile *f, bool batch)
+{
+    f->iov_limit = batch ? MAX_BATCH_IOV_SIZE : MAX_IOV_SIZE;
+    if (f->iovcnt >= f->iov_limit) {
+        qemu_fflush(f);
+    }
+}
+
 /*
  * Get last error for stream f
  *
@@ -213,11 +232,81 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+/* Open the reverse direction of @f, NULL if the transport is one-way */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
 }
 
+/* Account for @size bytes that were sent on behalf of @f through another
+ * channel, both in the position and against the rate limit.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+}
+
+/* Offset of the next byte of the stream in the file descriptor of @f, or a
+ * negative errno if the descriptor is not seekable.  Flushes a file that is
+ * being written.
+ */
+int64_t qemu_file_fd_offset(QEMUFile *f)
+{
+    int fd = qemu_get_fd(f);
+    off_t pos;
+
+    if (fd == -1) {
+        return -EINVAL;
+    }
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        if (f->last_error) {
+            return f->last_error;
+        }
+    }
+    pos = lseek(fd, 0, SEEK_CUR);
+    if (pos == (off_t)-1) {
+        return -errno;
+    }
+    if (!qemu_file_is_writable(f)) {
+        pos -= f->buf_size - f->buf_index;
+    }
+    return pos;
+}
+
+/* Go on with the stream at @offset of the file descriptor of @f, which must
+ * be seekable.  What is in between is left alone when writing and skipped
+ * when reading.
+ */
+int qemu_file_fd_seek(QEMUFile *f, int64_t offset)
+{
+    int fd = qemu_get_fd(f);
+
+    if (fd == -1) {
+        qemu_file_set_error(f, -EINVAL);
+        return -EINVAL;
+    }
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+        qemu_file_set_error(f, -errno);
+    }
+    return f->last_error;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -260,7 +349,7 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_limit) {
         qemu_fflush(f);
     }
 }
@@ -446,6 +535,27 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/* Like qemu_ftell(), without flushing: counts the bytes queued on a file
+ * being written, and leaves out those read ahead on a file being read.
+ */
+int64_t qemu_ftell_fast(QEMUFile *f)
+{
+    int64_t ret = f->pos;
+    int i;
+
+    if (!qemu_file_is_writable(f)) {
+        return ret - (f->buf_size - f->buf_index);
+    }
+    if (f->ops->writev_buffer) {
+        for (i = 0; i < f->iovcnt; i++) {
+            ret += f->iov[i].iov_len;
+        }
+    } else {
+        ret += f->buf_index;
+    }
+    return ret;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -472,24 +582,31 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* These go through qemu_put_buffer() rather than byte by byte, RAM page
+ * headers are made of them.
+ */
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[2];
+
+    stw_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be32(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 24);
-    qemu_put_byte(f, v >> 16);
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[4];
+
+    stl_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be64(QEMUFile *f, uint64_t v)
 {
-    qemu_put_be32(f, v >> 32);
-    qemu_put_be32(f, v);
+    uint8_t buf[8];
+
+    stq_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 unsigned int qemu_get_be16(QEMUFile *f)
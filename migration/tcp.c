@@ -33,6 +33,10 @@
     do { } while (0)
 #endif
 
+/* Listening socket of the incoming migration, kept open after the main
+ * connection has been accepted so that multifd connections can follow */
+static int incoming_listen_fd = -1;
+
 static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 {
     MigrationState *s = opaque;
@@ -50,9 +54,20 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    s->tcp_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* Open an additional, blocking connection to the destination of @s */
+int tcp_connect_migration_channel(MigrationState *s, Error **errp)
+{
+    if (!s->tcp_host_port) {
+        error_setg(errp, "Migration is not using TCP");
+        return -1;
+    }
+    return inet_connect(s->tcp_host_port, errp);
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -66,15 +81,16 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
+        closesocket(s);
         error_report("could not accept migration connection (%s)",
                      strerror(err));
         return;
     }
+    incoming_listen_fd = s;
 
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
@@ -87,6 +103,44 @@ static void tcp_accept_incoming_migration(void *opaque)
 
 out:
     closesocket(c);
+    tcp_finish_incoming_migration();
+}
+
+/* Accept an additional connection of the incoming migration.  Blocks until
+ * the source has connected.
+ */
+int tcp_accept_migration_channel(Error **errp)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int c, err;
+
+    if (incoming_listen_fd < 0) {
+        error_setg(errp, "Incoming migration is not using TCP");
+        return -1;
+    }
+
+    qemu_set_block(incoming_listen_fd);
+    do {
+        c = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                        &addrlen);
+        err = socket_error();
+    } while (c < 0 && err == EINTR);
+
+    if (c < 0) {
+        error_setg_errno(errp, err, "could not accept migration connection");
+        return -1;
+    }
+    qemu_set_block(c);
+    return c;
+}
+
+void tcp_finish_incoming_migration(void)
+{
+    if (incoming_listen_fd >= 0) {
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -97,6 +151,9 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp)
     if (s < 0) {
         return;
     }
+    /* The source opens all multifd connections before the destination
+     * accepts any of them, make room for them in the backlog */
+    listen(s, 256);
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
                          (void *)(intptr_t)s);
@@ -12,6 +12,7 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "qemu/host-utils.h"
 
 /*
   page = zrun nzrun
@@ -23,45 +24,97 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/*
+ * Run boundaries
+ *
+ * The encoder only needs to know where the current run ends: the first byte
+ * at or after @i that differs (for a zrun) or that is unchanged (for an
+ * nzrun).  Every variant returns exactly the same offsets, so they all
+ * produce the same encoded stream.
+ */
+
+static int find_zrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
 
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
 
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
+static int find_nzrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
 
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < slen) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
                 i++;
             }
+            break;
         }
+        i += sizeof(long);
+    }
+    return i;
+}
+
+static inline int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen,
+                                int (*find_zrun_end)(const uint8_t *,
+                                                     const uint8_t *,
+                                                     int, int),
+                                int (*find_nzrun_end)(const uint8_t *,
+                                                      const uint8_t *,
+                                                      int, int))
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = find_zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,56 +128,244 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = find_nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = end;
     }
 
     return d;
 }
 
+static int xbzrle_encode_long(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_zrun_end_long, find_nzrun_end_long);
+}
+
+/*
+ * The vector variants compare a whole vector of bytes at once and turn the
+ * result into a bit mask with movemask; the run ends at the first bit that
+ * flips.  Loads are unaligned, the tail is done a byte at a time.
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline uint32_t cmpeq_mask_sse2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)old_buf);
+    __m128i b = _mm_loadu_si128((const __m128i *)new_buf);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+}
+
+static int find_zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        mask = cmpeq_mask_sse2(old_buf + i, new_buf + i);
+        if (mask != 0xffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        mask = cmpeq_mask_sse2(old_buf + i, new_buf + i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_zrun_end_sse2, find_nzrun_end_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint32_t cmpeq_mask_avx2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)old_buf);
+    __m256i b = _mm256_loadu_si256((const __m256i *)new_buf);
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
+
+static int find_zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 32 <= slen; i += 32) {
+        mask = cmpeq_mask_avx2(old_buf + i, new_buf + i);
+        if (mask != 0xffffffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 32 <= slen; i += 32) {
+        mask = cmpeq_mask_avx2(old_buf + i, new_buf + i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         find_zrun_end_avx2, find_nzrun_end_avx2);
+}
+#pragma GCC pop_options
+#endif
+
+typedef struct XBZRLEAccel {
+    const char *name;
+    int (*encode)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                  uint8_t *dst, int dlen);
+    bool available;
+} XBZRLEAccel;
+
+/* Fastest first */
+static XBZRLEAccel xbzrle_accels[] = {
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", xbzrle_encode_avx2, false },
+#endif
+#ifdef __SSE2__
+    { "sse2", xbzrle_encode_sse2, true },
+#endif
+    { "long", xbzrle_encode_long, true },
+};
+
+static XBZRLEAccel *xbzrle_accel = &xbzrle_accels[0];
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE     (1 << 27)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2        (1 << 5)
+#endif
+
+/* XCR0 bits for the SSE and AVX register state */
+#define XCR0_YMM        0x06
+
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+    unsigned a, b, c, d;
+    uint32_t xcr0_lo = 0, xcr0_hi = 0;
+    int i;
+
+    if (__get_cpuid_max(0, 0) >= 7) {
+        /* The OS must save the wider registers on context switch */
+        __cpuid(1, a, b, c, d);
+        if (c & bit_OSXSAVE) {
+            asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+            __cpuid_count(7, 0, a, b, c, d);
+            xbzrle_accels[0].available = (b & bit_AVX2) &&
+                                         (xcr0_lo & XCR0_YMM) == XCR0_YMM;
+        }
+    }
+
+    for (i = 0; !xbzrle_accels[i].available; i++) {
+        /* the last entry is always available */
+    }
+    xbzrle_accel = &xbzrle_accels[i];
+}
+#endif
+
+const char *xbzrle_encode_buffer_accel(void)
+{
+    return xbzrle_accel->name;
+}
+
+/* Switch to the next slower variant.  After the slowest one, go back to the
+ * fastest and return false, so that callers can loop over all of them.
+ */
+bool test_xbzrle_encode_buffer_next_accel(void)
+{
+    XBZRLEAccel *end = &xbzrle_accels[ARRAY_SIZE(xbzrle_accels)];
+    XBZRLEAccel *accel;
+
+    for (accel = xbzrle_accel + 1; accel < end; accel++) {
+        if (accel->available) {
+            xbzrle_accel = accel;
+            return true;
+        }
+    }
+
+    for (accel = xbzrle_accels; !accel->available; accel++) {
+        /* the last entry is always available */
+    }
+    xbzrle_accel = accel;
+    return false;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_accel->encode(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -105,6 +105,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 
@@ -432,7 +433,8 @@ static int nbd_send_negotiate(NBDClient *client)
         [16 ..  23]   size
         [24 ..  25]   server flags (0)
         [26 ..  27]   export flags
-        [28 .. 151]   reserved     (0)
+        [28 ..  31]   QEMU extension flags
+        [32 .. 151]   reserved     (0)
 
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -442,7 +444,8 @@ static int nbd_send_negotiate(NBDClient *client)
        part 2 (after options are sent):
         [18 ..  25]   size
         [26 ..  27]   export flags
-        [28 .. 151]   reserved     (0)
+        [28 ..  31]   QEMU extension flags
+        [32 .. 151]   reserved     (0)
      */
 
     qemu_set_block(csock);
@@ -451,6 +454,7 @@ static int nbd_send_negotiate(NBDClient *client)
     TRACE("Beginning negotiation.");
     memset(buf, 0, sizeof(buf));
     memcpy(buf, "NBDMAGIC", 8);
+    stl_be_p(buf + 28, NBD_QEMU_FLAG_BLOCK_STATUS);
     if (client->exp) {
         assert ((client->exp->nbdflags & ~65535) == 0);
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_CLIENT_MAGIC);
@@ -494,7 +498,8 @@ fail:
 }
 
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize)
+                          uint32_t *qemu_flags, off_t *size,
+                          size_t *blocksize)
 {
     char buf[256];
     uint64_t magic, s;
@@ -614,6 +619,9 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
         LOG("read failed (buf)");
         goto fail;
     }
+    if (qemu_flags) {
+        *qemu_flags = ldl_be_p(buf);
+    }
     rc = 0;
 
 fail:
@@ -855,8 +863,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -904,7 +910,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests < client->exp->max_requests);
     client->nb_requests++;
     nbd_update_can_read(client);
 
@@ -965,6 +971,7 @@ NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
     exp->blk = blk;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->max_requests = NBD_DEFAULT_SERVER_REQUESTS;
     exp->size = size == -1 ? blk_getlength(blk) : size;
     exp->close = close;
     exp->ctx = blk_get_aio_context(blk);
@@ -979,6 +986,15 @@ NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
     return exp;
 }
 
+/* Set how many requests of each client are processed concurrently; further
+ * requests are left in the socket until one completes.
+ */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests > 0 && max_requests <= NBD_MAX_REQUESTS);
+    exp->max_requests = max_requests;
+}
+
 NBDExport *nbd_export_find(const char *name)
 {
     NBDExport *exp;
@@ -1117,7 +1133,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if ((command == NBD_CMD_READ || command == NBD_CMD_WRITE) &&
+        request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1133,7 +1151,6 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
         req->data = blk_blockalign(client->exp->blk, request->len);
     }
@@ -1155,6 +1172,84 @@ out:
     return rc;
 }
 
+/* Fill req->data with at most @max_extents extents of [from, from + len) and
+ * return the payload length, or a negative errno.  Adjacent ranges with the
+ * same state are merged.
+ */
+static int coroutine_fn nbd_co_block_status(NBDRequest *req, uint64_t from,
+                                            uint32_t len, uint32_t max_extents)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    struct nbd_extent *extents;
+    int64_t sector_num;
+    int64_t nb_sectors;
+    uint32_t count = 0;
+    uint32_t i;
+
+    if ((from | len) & (BDRV_SECTOR_SIZE - 1) || len == 0) {
+        return -EINVAL;
+    }
+
+    req->data = blk_blockalign(exp->blk, sizeof(count) +
+                               NBD_MAX_EXTENTS * sizeof(*extents));
+    extents = (struct nbd_extent *)(req->data + sizeof(count));
+
+    sector_num = (from + exp->dev_offset) >> BDRV_SECTOR_BITS;
+    nb_sectors = len >> BDRV_SECTOR_BITS;
+
+    while (nb_sectors > 0) {
+        int64_t ret;
+        uint64_t length;
+        uint32_t flags;
+        int n;
+
+        ret = bdrv_get_block_status(bs, sector_num, MIN(nb_sectors, INT_MAX),
+                                    &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        /* A hole that isn't known to read as zeroes (e.g. it is backed by
+         * a backing file) does not have NBD_STATE_ZERO set.
+         */
+        flags = (ret & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (ret & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+
+        /* len is 32 bits wide, so a single range always fits in an extent;
+         * a merged one is split before it would wrap.
+         */
+        length = (uint64_t)n << BDRV_SECTOR_BITS;
+        if (count > 0 && extents[count - 1].flags == flags &&
+            extents[count - 1].length + length <= UINT32_MAX) {
+            extents[count - 1].length += length;
+        } else if (count == max_extents) {
+            break;
+        } else {
+            extents[count].length = length;
+            extents[count].flags = flags;
+            count++;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    if (count == 0) {
+        return -EIO;
+    }
+
+    stl_be_p(req->data, count);
+    for (i = 0; i < count; i++) {
+        extents[i].length = cpu_to_be32(extents[i].length);
+        extents[i].flags = cpu_to_be32(extents[i].flags);
+    }
+    return sizeof(count) + count * sizeof(*extents);
+}
+
 static void nbd_trip(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1271,6 +1366,21 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_QEMU_BLOCK_STATUS:
+        TRACE("Request type is QEMU_BLOCK_STATUS");
+
+        ret = nbd_co_block_status(req, request.from, request.len,
+                                  request.type & NBD_CMD_FLAG_REQ_ONE ?
+                                  1 : NBD_MAX_EXTENTS);
+        if (ret < 0) {
+            LOG("block status failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+        if (nbd_co_send_reply(req, &reply, ret) < 0) {
+            goto out;
+        }
+        break;
     case NBD_CMD_TRIM:
         TRACE("Request type is TRIM");
         ret = blk_co_discard(exp->blk, (request.from + exp->dev_offset)
@@ -1344,7 +1454,7 @@ static void nbd_unset_handlers(NBDClient *client)
 static void nbd_update_can_read(NBDClient *client)
 {
     bool can_read = client->recv_coroutine ||
-                    client->nb_requests < MAX_NBD_REQUESTS;
+                    client->nb_requests < client->exp->max_requests;
 
     if (can_read != client->can_read) {
         client->can_read = can_read;
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,19 +33,35 @@
     do { } while (0)
 #endif
 
+/* Pages that collide in a direct-mapped cache keep evicting each other, so
+ * the cache is split into sets of PAGE_CACHE_WAYS entries.  A page can live
+ * in any entry of the set its address maps to.
+ */
+#define PAGE_CACHE_WAYS 8
+
+/* Replacement within a set is a CLOCK with small reference counters: each
+ * hit bumps the counter of the entry, and the hand of the set decrements
+ * counters as it sweeps past them until it finds one at zero.  A page that
+ * is re-dirtied often survives several sweeps, one that was only sent once
+ * goes first.
+ */
+#define PAGE_CACHE_MAX_REF 3
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
-    uint64_t it_age;
     uint8_t *it_data;
+    uint8_t it_ref;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *clock_hand;
     unsigned int page_size;
     int64_t max_num_items;
-    uint64_t max_item_age;
+    int64_t num_sets;
+    unsigned int num_ways;
     int64_t num_items;
 };
 
@@ -73,23 +89,28 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->clock_hand = g_try_malloc0(cache->num_sets);
+    if (!cache->page_cache || !cache->clock_hand) {
         DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->clock_hand);
         g_free(cache);
         return NULL;
     }
 
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_ref = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -109,46 +130,77 @@ void cache_fini(PageCache *cache)
 
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    g_free(cache->clock_hand);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static int64_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
-
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+/* Returns the entry holding @addr, or NULL */
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int way;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->num_ways];
+    for (way = 0; way < cache->num_ways; way++) {
+        if (set[way].it_addr == addr) {
+            return &set[way];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Pick the entry of @addr's set that a new page replaces: a free one if
+ * there is any, otherwise the first one the clock hand finds unreferenced.
+ */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    int64_t set_idx = cache_get_set(cache, addr);
+    CacheItem *set = &cache->page_cache[set_idx * cache->num_ways];
+    unsigned int way;
+    CacheItem *it;
+
+    for (way = 0; way < cache->num_ways; way++) {
+        if (!set[way].it_data) {
+            return &set[way];
+        }
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    for (;;) {
+        way = cache->clock_hand[set_idx];
+        cache->clock_hand[set_idx] = (way + 1) % cache->num_ways;
+        it = &set[way];
+        if (!it->it_ref) {
+            return it;
+        }
+        it->it_ref--;
+    }
+}
 
-    return &cache->page_cache[pos];
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+    if (it->it_ref < PAGE_CACHE_MAX_REF) {
+        it->it_ref++;
+    }
+    return it->it_data;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
@@ -161,6 +213,10 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        it->it_ref = 0;
+    }
 
     /* allocate page */
     if (!it->it_data) {
@@ -174,7 +230,6 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 
     memcpy(it->it_data, pdata, cache->page_size);
 
-    it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
 
     return 0;
@@ -205,30 +260,27 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /* move all data from old cache, if a set overflows the clock decides */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
+        if (old_it->it_data) {
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
+            if (new_it->it_data) {
                 g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+            } else {
+                new_cache->num_items++;
             }
+            *new_it = *old_it;
         }
     }
 
     g_free(cache->page_cache);
+    g_free(cache->clock_hand);
     cache->page_cache = new_cache->page_cache;
+    cache->clock_hand = new_cache->clock_hand;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
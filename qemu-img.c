@@ -129,6 +129,11 @@ static void QEMU_NORETURN help(void)
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -984,6 +989,12 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
         return 0;
     }
 
+    /* Most of the time the buffers are identical, check them in one go */
+    if (!memcmp(buf1, buf2, n * 512)) {
+        *pnum = n;
+        return 0;
+    }
+
     res = !!memcmp(buf1, buf2, 512);
     for(i = 1; i < n; i++) {
         buf1 += 512;
@@ -1010,6 +1021,84 @@ static int64_t sectors_to_process(int64_t total, int64_t from)
     return MIN(total - from, IO_BUF_SIZE >> BDRV_SECTOR_BITS);
 }
 
+/* Number of coroutines that compare and rebase keep busy */
+#define IO_COROUTINES 8
+
+/* Start @n coroutines running @entry and wait until they have all returned.
+ * Each coroutine must increment *@running before it yields for the first
+ * time and decrement it when it is done.
+ */
+static void run_coroutines(CoroutineEntry *entry, void *opaque, int n,
+                           int *running)
+{
+    Coroutine *co;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        co = qemu_coroutine_create(entry);
+        qemu_coroutine_enter(co, opaque);
+    }
+
+    while (*running) {
+        main_loop_wait(false);
+    }
+}
+
+static int coroutine_fn img_co_read(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+}
+
+static void report_throughput(bool progress, int64_t bytes, int64_t start_ns)
+{
+    double secs;
+
+    if (!progress) {
+        return;
+    }
+
+    secs = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns) / 1e9;
+    printf("Read %" PRId64 " MB in %.2f s (%.1f MB/s)\n", bytes >> 20, secs,
+           secs > 0 ? (bytes >> 20) / secs : 0);
+}
+
+typedef struct ImgCompareState {
+    BlockDriverState *bs1;
+    BlockDriverState *bs2;          /* NULL: check that bs1 reads as zeroes */
+    const char *filename1;
+    const char *filename2;
+    int64_t sector_num;             /* next sector to be claimed */
+    int64_t end_sector;
+    int64_t progress_base;
+    bool strict;
+
+    /* The lowest offset at which the images were found to differ */
+    int64_t mismatch_sector;
+    bool mismatch_strict;
+
+    int64_t bytes_read;
+    int running_coroutines;
+    CoMutex lock;
+    int ret;                        /* 0, or the exit code of an error */
+} ImgCompareState;
+
+static void compare_set_mismatch(ImgCompareState *s, int64_t sector_num,
+                                 bool strict)
+{
+    if (sector_num < s->mismatch_sector) {
+        s->mismatch_sector = sector_num;
+        s->mismatch_strict = strict;
+    }
+}
+
 /*
  * Check if passed sectors are empty (not allocated or contain only 0 bytes)
  *
@@ -1021,27 +1110,144 @@ static int64_t sectors_to_process(int64_t total, int64_t from)
  * @param sect_count: Number of sectors to check
  * @param filename: Name of disk file we are checking (logging purpose)
  * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * @param mismatch: Set to the first non-zero sector if 1 is returned
  */
-static int check_empty_sectors(BlockDriverState *bs, int64_t sect_num,
-                               int sect_count, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int coroutine_fn check_empty_sectors(BlockDriverState *bs,
+                                            int64_t sect_num, int sect_count,
+                                            const char *filename,
+                                            uint8_t *buffer, int64_t *mismatch)
 {
     int pnum, ret = 0;
-    ret = bdrv_read(bs, sect_num, buffer, sect_count);
+
+    ret = img_co_read(bs, sect_num, sect_count, buffer);
     if (ret < 0) {
         error_report("Error while reading offset %" PRId64 " of %s: %s",
                      sectors_to_bytes(sect_num), filename, strerror(-ret));
         return ret;
     }
+    if (buffer_is_zero(buffer, sect_count * BDRV_SECTOR_SIZE)) {
+        return 0;
+    }
     ret = is_allocated_sectors(buffer, sect_count, &pnum);
-    if (ret || pnum != sect_count) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                sectors_to_bytes(ret ? sect_num : sect_num + pnum));
-        return 1;
+    *mismatch = ret ? sect_num : sect_num + pnum;
+    return 1;
+}
+
+/* Claim the next chunk of the range and compare it, until the range is done,
+ * an error occurred, or a mismatch was found before the next chunk.
+ */
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2 = NULL;
+
+    s->running_coroutines++;
+    buf1 = qemu_blockalign(s->bs1, IO_BUF_SIZE);
+    if (s->bs2) {
+        buf2 = qemu_blockalign(s->bs2, IO_BUF_SIZE);
     }
 
-    return 0;
+    for (;;) {
+        int64_t sector_num, nb_sectors, mismatch;
+        int allocated1, allocated2, pnum1, pnum2, pnum, ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        sector_num = s->sector_num;
+        nb_sectors = sectors_to_process(s->end_sector, sector_num);
+        if (s->ret || nb_sectors <= 0 || sector_num >= s->mismatch_sector) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        allocated1 = bdrv_is_allocated_above(s->bs1, NULL, sector_num,
+                                             nb_sectors, &pnum1);
+        if (allocated1 < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->filename1);
+            s->ret = 3;
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        allocated2 = 0;
+        pnum2 = pnum1;
+        if (s->bs2) {
+            allocated2 = bdrv_is_allocated_above(s->bs2, NULL, sector_num,
+                                                 nb_sectors, &pnum2);
+            if (allocated2 < 0) {
+                error_report("Sector allocation test failed for %s",
+                             s->filename2);
+                s->ret = 3;
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+        }
+        nb_sectors = MIN(pnum1, pnum2);
+        s->sector_num += nb_sectors;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (allocated1 && allocated2) {
+            ret = img_co_read(s->bs1, sector_num, nb_sectors, buf1);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64 " of %s:"
+                             " %s", sectors_to_bytes(sector_num), s->filename1,
+                             strerror(-ret));
+                s->ret = 4;
+                break;
+            }
+            ret = img_co_read(s->bs2, sector_num, nb_sectors, buf2);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64
+                             " of %s: %s", sectors_to_bytes(sector_num),
+                             s->filename2, strerror(-ret));
+                s->ret = 4;
+                break;
+            }
+            s->bytes_read += 2 * sectors_to_bytes(nb_sectors);
+
+            ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                compare_set_mismatch(s, ret ? sector_num : sector_num + pnum,
+                                     false);
+            }
+        } else if (allocated1 != allocated2) {
+            if (s->strict) {
+                compare_set_mismatch(s, sector_num, true);
+                continue;
+            }
+
+            if (allocated1) {
+                ret = check_empty_sectors(s->bs1, sector_num, nb_sectors,
+                                          s->filename1, buf1, &mismatch);
+            } else {
+                ret = check_empty_sectors(s->bs2, sector_num, nb_sectors,
+                                          s->filename2, buf1, &mismatch);
+            }
+            if (ret < 0) {
+                if (s->bs2) {
+                    error_report("Error while reading offset %" PRId64 ": %s",
+                                 sectors_to_bytes(sector_num), strerror(-ret));
+                } else {
+                    error_report("Error while reading offset %" PRId64
+                                 " of %s: %s", sectors_to_bytes(sector_num),
+                                 s->filename1, strerror(-ret));
+                }
+                s->ret = 4;
+                break;
+            }
+            s->bytes_read += sectors_to_bytes(nb_sectors);
+            if (ret) {
+                compare_set_mismatch(s, mismatch, false);
+            }
+        }
+
+        qemu_progress_print(((float) nb_sectors / s->progress_base) * 100,
+                            100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
 }
 
 /*
@@ -1057,17 +1263,14 @@ static int img_compare(int argc, char **argv)
     BlockBackend *blk1, *blk2;
     BlockDriverState *bs1, *bs2;
     int64_t total_sectors1, total_sectors2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     int64_t total_sectors;
-    int64_t sector_num = 0;
-    int64_t nb_sectors;
-    int c, pnum;
+    int64_t start_ns;
+    int c;
     uint64_t progress_base;
+    ImgCompareState s;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1115,6 +1318,8 @@ static int img_compare(int argc, char **argv)
 
     /* Initialize before goto out */
     qemu_progress_init(progress, 2.0);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s.bytes_read = 0;
 
     flags = BDRV_O_FLAGS;
     ret = bdrv_parse_cache_flags(cache, &flags);
@@ -1138,8 +1343,6 @@ static int img_compare(int argc, char **argv)
     }
     bs2 = blk_bs(blk2);
 
-    buf1 = qemu_blockalign(bs1, IO_BUF_SIZE);
-    buf2 = qemu_blockalign(bs2, IO_BUF_SIZE);
     total_sectors1 = bdrv_nb_sectors(bs1);
     if (total_sectors1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1165,161 +1368,489 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    for (;;) {
-        nb_sectors = sectors_to_process(total_sectors, sector_num);
-        if (nb_sectors <= 0) {
-            break;
+    s = (ImgCompareState) {
+        .bs1                = bs1,
+        .bs2                = bs2,
+        .filename1          = filename1,
+        .filename2          = filename2,
+        .sector_num         = 0,
+        .end_sector         = total_sectors,
+        .progress_base      = progress_base,
+        .strict             = strict,
+        .mismatch_sector    = INT64_MAX,
+    };
+    qemu_co_mutex_init(&s.lock);
+
+    /* Compare the range both images have in common */
+    run_coroutines(compare_co_do_compare, &s, IO_COROUTINES,
+                   &s.running_coroutines);
+    if (s.ret) {
+        ret = s.ret;
+        goto out;
+    }
+
+    /* The part of the larger image that goes beyond the smaller one must
+     * read as zeroes */
+    if (s.mismatch_sector == INT64_MAX && total_sectors1 != total_sectors2) {
+        qprintf(quiet, "Warning: Image size mismatch!\n");
+        if (total_sectors1 > total_sectors2) {
+            s.end_sector = total_sectors1;
+        } else {
+            s.bs1 = bs2;
+            s.filename1 = filename2;
+            s.end_sector = total_sectors2;
         }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
+        s.bs2 = NULL;
+        s.filename2 = NULL;
+
+        run_coroutines(compare_co_do_compare, &s, IO_COROUTINES,
+                       &s.running_coroutines);
+        if (s.ret) {
+            ret = s.ret;
             goto out;
         }
+    }
 
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
+    if (s.mismatch_sector != INT64_MAX) {
+        if (s.mismatch_strict) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " allocation mismatch!\n",
+                    sectors_to_bytes(s.mismatch_sector));
+        } else {
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    sectors_to_bytes(s.mismatch_sector));
         }
-        nb_sectors = MIN(pnum1, pnum2);
+        ret = 1;
+        goto out;
+    }
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
+    qprintf(quiet, "Images are identical.\n");
+    ret = 0;
+
+out:
+    blk_unref(blk2);
+out2:
+    blk_unref(blk1);
+out3:
+    qemu_progress_end();
+    report_throughput(progress, s.bytes_read, start_ns);
+    return ret;
+}
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    size_t cluster_sectors;
+    size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/* Returns the number of sectors starting at @sector_num that can be handled
+ * with a single request, and sets s->status to the way they are copied.
+ * Must be called with increasing @sector_num (or with s->sector_next_status
+ * reset to 0 for a new pass).
+ */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int ret, n, src_cur;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+
+    assert(s->total_sectors > sector_num);
+    n = MIN(s->total_sectors - sector_num, INT_MAX);
+
+    if (s->sector_next_status <= sector_num) {
+        ret = bdrv_get_block_status(s->src[src_cur],
+                                    sector_num - src_cur_offset, n, &n);
+        if (ret < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num - src_cur_offset,
+                         strerror(-ret));
+            return ret;
+        }
+
+        if (ret & BDRV_BLOCK_ZERO) {
+            /* -S 0: the target must be fully allocated */
+            s->status = s->min_sparse ? BLK_ZERO : BLK_DATA;
+        } else if (ret & BDRV_BLOCK_DATA) {
+            s->status = BLK_DATA;
+        } else if (!s->target_has_backing) {
+            /* Without a target backing file we must copy over the contents
+             * of the backing file as well. */
+            s->status = BLK_DATA;
+        } else {
+            s->status = BLK_BACKING_FILE;
+        }
+
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+
+        /* round down request length to an aligned sector, but do not bother
+         * doing this on short requests.  They happen when we found an
+         * all-zero area, and the next sector to write will not be
+         * sector_num + n. */
+        if (!s->compressed && s->cluster_sectors > 0 &&
+            n >= s->cluster_sectors) {
+            int64_t next_aligned_sector = sector_num + n;
+            next_aligned_sector -= next_aligned_sector % s->cluster_sectors;
+            if (sector_num + n > next_aligned_sector) {
+                n = next_aligned_sector - sector_num;
+            }
+        }
+    }
+
+    /* We need to write complete clusters for compressed images, so if an
+     * unallocated area is shorter than that, we must consider the whole
+     * cluster allocated. */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+        } else {
+            n = QEMU_ALIGN_DOWN(n, s->cluster_sectors);
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    assert(nb_sectors <= s->buf_sectors);
+    while (nb_sectors > 0) {
+        BlockDriverState *bs;
+        int src_cur;
+        int64_t src_cur_offset;
+
+        /* A compressed cluster may span two source images */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        bs = s->src[src_cur];
+
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(bs, sector_num - src_cur_offset, n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         sector_num - src_cur_offset, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            /* If we have a backing file, leave clusters unallocated that are
+             * unallocated in the source image, so that the backing file is
+             * visible at the respective offset. */
+            assert(s->target_has_backing);
+            break;
+
+        case BLK_DATA:
+            /* We must always write compressed clusters as a whole, so don't
+             * try to find zeroed parts in the buffer. We can only save the
+             * write if the buffer is completely zeroed and we're allowed to
+             * keep the target sparse. */
+            if (s->compressed) {
+                if (s->has_zero_init && s->min_sparse &&
+                    buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))
+                {
+                    assert(!s->target_has_backing);
+                    break;
                 }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
+
+                ret = bdrv_write_compressed(s->target, sector_num, buf, n);
                 if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    ret = 1;
-                    goto out;
+                    error_report("error while compressing sector %" PRId64
+                                 ": %s", sector_num, strerror(-ret));
+                    return ret;
                 }
-            }
-        } else {
-            if (strict) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
-                goto out;
+                break;
             }
 
-            if (allocated1) {
-                ret = check_empty_sectors(bs1, sector_num, nb_sectors,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(bs2, sector_num, nb_sectors,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
+            /* If there is real non-zero data or we're told to keep the
+             * target fully allocated (-S 0), we must write it. Otherwise we
+             * can treat it as zero sectors. */
+            if (!s->min_sparse ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse))
+            {
+                iov.iov_base = buf;
+                iov.iov_len = n * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 ": %s",
-                                 sectors_to_bytes(sector_num), strerror(-ret));
-                    ret = 4;
+                    error_report("error while writing sector %" PRId64
+                                 ": %s", sector_num, strerror(-ret));
+                    return ret;
                 }
-                goto out;
+                break;
+            }
+            /* fall-through */
+
+        case BLK_ZERO:
+            if (s->has_zero_init) {
+                break;
             }
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n, 0);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+            break;
         }
-        sector_num += nb_sectors;
-        qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
     }
 
-    if (total_sectors1 != total_sectors2) {
-        BlockDriverState *bs_over;
-        int64_t total_sectors_over;
-        const char *filename_over;
+    return 0;
+}
 
-        qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_sectors1 > total_sectors2) {
-            total_sectors_over = total_sectors1;
-            bs_over = bs1;
-            filename_over = filename1;
-        } else {
-            total_sectors_over = total_sectors2;
-            bs_over = bs2;
-            filename_over = filename2;
+/* Each coroutine claims the next chunk of the image under s->lock, reads it
+ * into its own buffer and writes it out.  Reads complete out of order; with
+ * s->wr_in_order the writes are issued in image order, so that the target is
+ * allocated sequentially.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
         }
+    }
+    assert(index >= 0);
 
-        for (;;) {
-            nb_sectors = sectors_to_process(total_sectors_over, sector_num);
-            if (nb_sectors <= 0) {
-                break;
-            }
-            ret = bdrv_is_allocated_above(bs_over, NULL, sector_num,
-                                          nb_sectors, &pnum);
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* Claim the chunk so that other coroutines can already continue
+         * beyond it */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
+                s->ret = ret;
+            }
+        }
 
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
             }
-            nb_sectors = pnum;
-            if (ret) {
-                ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    if (ret < 0) {
-                        error_report("Error while reading offset %" PRId64
-                                     " of %s: %s", sectors_to_bytes(sector_num),
-                                     filename_over, strerror(-ret));
-                        ret = 4;
-                    }
-                    goto out;
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited for this write
+             * to complete */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
                 }
             }
-            sector_num += nb_sectors;
-            qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
         }
     }
 
-    qprintf(quiet, "Images are identical.\n");
-    ret = 0;
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
 
-out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
-    blk_unref(blk2);
-out2:
-    blk_unref(blk1);
-out3:
-    qemu_progress_end();
-    return ret;
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
+
+    /* Check whether we have zero initialisation or can get it efficiently */
+    s->has_zero_init = s->min_sparse ? bdrv_has_zero_init(s->target) : false;
+
+    if (!s->has_zero_init && bdrv_can_write_zeroes_with_unmap(s->target)) {
+        ret = bdrv_make_zero(s->target, BDRV_REQ_MAY_UNMAP);
+        if (ret < 0) {
+            return ret;
+        }
+        s->has_zero_init = true;
+    }
+
+    /* Allocate buffer for copied data. For compressed images, only one cluster
+     * can be copied at a time. */
+    if (s->compressed) {
+        if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
+            error_report("invalid cluster size");
+            return -EINVAL;
+        }
+        s->buf_sectors = s->cluster_sectors;
+    }
+
+    /* Calculate allocated sectors for progress */
+    while (sector_num < s->total_sectors) {
+        n = convert_iteration_sectors(s, sector_num);
+        if (n < 0) {
+            return n;
+        }
+        if (s->status == BLK_DATA) {
+            s->allocated_sectors += n;
+        }
+        sector_num += n;
+    }
+
+    /* Do the copy */
+    s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        main_loop_wait(false);
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
 {
-    int c, n, n1, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    int c, bs_n, bs_i, compress, cluster_sectors, skip_create;
     int64_t ret = 0;
     int progress = 0, flags, src_flags;
     const char *fmt, *out_fmt, *cache, *src_cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockBackend **blk = NULL, *out_blk = NULL;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     int64_t *bs_sectors = NULL;
-    uint8_t * buf = NULL;
     size_t bufsectors = IO_BUF_SIZE / BDRV_SECTOR_SIZE;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QemuOpts *opts = NULL;
     QemuOptsList *create_opts = NULL;
@@ -1330,6 +1861,9 @@ static int img_convert(int argc, char **argv)
     bool quiet = false;
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
+    ImgConvertState state;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1339,7 +1873,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1429,6 +1963,24 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1622,9 +2174,6 @@ static int img_convert(int argc, char **argv)
     }
     out_bs = blk_bs(out_blk);
 
-    bs_i = 0;
-    bs_offset = 0;
-
     /* increase bufsectors from the default 4096 (2M) if opt_transfer_length
      * or discard_alignment of the out_bs is greater. Limit to 32768 (16MB)
      * as maximum. */
@@ -1633,8 +2182,6 @@ static int img_convert(int argc, char **argv)
                                          out_bs->bl.discard_alignment))
                     );
 
-    buf = qemu_blockalign(out_bs, bufsectors * BDRV_SECTOR_SIZE);
-
     if (skip_create) {
         int64_t output_sectors = bdrv_nb_sectors(out_bs);
         if (output_sectors < 0) {
@@ -1661,203 +2208,28 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
-    if (compress) {
-        if (cluster_sectors <= 0 || cluster_sectors > bufsectors) {
-            error_report("invalid cluster size");
-            ret = -1;
-            goto out;
-        }
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors[bs_i]) {
-                    bs_offset += bs_sectors[bs_i];
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors[bs_i]); */
-                }
-                assert (bs_num < bs_sectors[bs_i]);
-
-                nlow = remainder > bs_sectors[bs_i] - bs_num
-                    ? bs_sectors[bs_i] - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(100.0 * sector_num / total_sectors, 0);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int64_t sectors_to_read, sectors_read, sector_num_next_status;
-        bool count_allocated_sectors;
-        int has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
-
-        if (!has_zero_init && bdrv_can_write_zeroes_with_unmap(out_bs)) {
-            ret = bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP);
-            if (ret < 0) {
-                goto out;
-            }
-            has_zero_init = 1;
-        }
-
-        sectors_to_read = total_sectors;
-        count_allocated_sectors = progress && (out_baseimg || has_zero_init);
-restart:
-        sector_num = 0; // total number of sectors converted so far
-        sectors_read = 0;
-        sector_num_next_status = 0;
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                if (count_allocated_sectors) {
-                    sectors_to_read = sectors_read;
-                    count_allocated_sectors = false;
-                    goto restart;
-                }
-                ret = 0;
-                break;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors[bs_i]) {
-                bs_offset += bs_sectors[bs_i];
-                bs_i ++;
-                assert (bs_i < bs_n);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors[bs_i]); */
-            }
-
-            if ((out_baseimg || has_zero_init) &&
-                sector_num >= sector_num_next_status) {
-                n = nb_sectors > INT_MAX ? INT_MAX : nb_sectors;
-                ret = bdrv_get_block_status(bs[bs_i], sector_num - bs_offset,
-                                            n, &n1);
-                if (ret < 0) {
-                    error_report("error while reading block status of sector %"
-                                 PRId64 ": %s", sector_num - bs_offset,
-                                 strerror(-ret));
-                    goto out;
-                }
-                /* If the output image is zero initialized, we are not working
-                 * on a shared base and the input is zero we can skip the next
-                 * n1 sectors */
-                if (has_zero_init && !out_baseimg && (ret & BDRV_BLOCK_ZERO)) {
-                    sector_num += n1;
-                    continue;
-                }
-                /* If the output image is being created as a copy on write
-                 * image, assume that sectors which are unallocated in the
-                 * input image are present in both the output's and input's
-                 * base images (no need to copy them). */
-                if (out_baseimg) {
-                    if (!(ret & BDRV_BLOCK_DATA)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image.
-                     * Copy only those as they may be followed by unallocated
-                     * sectors. */
-                    nb_sectors = n1;
-                }
-                /* avoid redundant callouts to get_block_status */
-                sector_num_next_status = sector_num + n1;
-            }
-
-            n = MIN(nb_sectors, bufsectors);
-
-            /* round down request length to an aligned sector, but
-             * do not bother doing this on short requests. They happen
-             * when we found an all-zero area, and the next sector to
-             * write will not be sector_num + n. */
-            if (cluster_sectors > 0 && n >= cluster_sectors) {
-                int64_t next_aligned_sector = (sector_num + n);
-                next_aligned_sector -= next_aligned_sector % cluster_sectors;
-                if (sector_num + n > next_aligned_sector) {
-                    n = next_aligned_sector - sector_num;
-                }
-            }
-
-            n = MIN(n, bs_sectors[bs_i] - (sector_num - bs_offset));
+    if (compress && !wr_in_order) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
 
-            sectors_read += n;
-            if (count_allocated_sectors) {
-                sector_num += n;
-                continue;
-            }
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = (bool) out_baseimg,
+        .min_sparse         = min_sparse,
+        .cluster_sectors    = cluster_sectors,
+        .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
+    };
+    ret = convert_do_copy(&state);
 
-            n1 = n;
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (!has_zero_init ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(100.0 * sectors_read / sectors_to_read, 0);
-        }
-    }
 out:
     if (!ret) {
         qemu_progress_print(100, 0);
@@ -1865,7 +2237,6 @@ out:
     qemu_progress_end();
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
-    qemu_vfree(buf);
     qemu_opts_del(sn_opts);
     blk_unref(out_blk);
     g_free(bs);
@@ -2434,6 +2805,147 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+typedef struct ImgRebaseState {
+    BlockDriverState *bs;
+    BlockDriverState *bs_old_backing;
+    BlockDriverState *bs_new_backing;   /* NULL when removing the backing */
+    int64_t num_sectors;
+    int64_t old_backing_num_sectors;
+    int64_t new_backing_num_sectors;
+    int64_t sector_num;                 /* next sector to be claimed */
+    int64_t bytes_read;
+    int running_coroutines;
+    CoMutex lock;
+    int ret;
+} ImgRebaseState;
+
+/* Claim the next chunk of the image and, if it is unallocated in the COW
+ * image, copy the parts in which old and new backing file differ.
+ */
+static void coroutine_fn rebase_co_do_rebase(void *opaque)
+{
+    ImgRebaseState *s = opaque;
+    uint8_t *buf_old, *buf_new;
+
+    s->running_coroutines++;
+    buf_old = qemu_blockalign(s->bs, IO_BUF_SIZE);
+    buf_new = qemu_blockalign(s->bs, IO_BUF_SIZE);
+
+    for (;;) {
+        int64_t sector;
+        int n, old_allocated, new_allocated, ret;
+        uint64_t written;
+
+        qemu_co_mutex_lock(&s->lock);
+        sector = s->sector_num;
+        if (s->ret || sector >= s->num_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        /* How many sectors can we handle with the next read? */
+        n = MIN(s->num_sectors - sector, IO_BUF_SIZE / 512);
+
+        /* If the cluster is allocated, we don't need to take action */
+        ret = bdrv_is_allocated(s->bs, sector, n, &n);
+        if (ret < 0) {
+            error_report("error while reading image metadata: %s",
+                         strerror(-ret));
+            s->ret = ret;
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        /*
+         * Take into consideration that backing files may be smaller than the
+         * COW image, and skip areas that are unallocated in both backing
+         * chains: both read as zeroes there.
+         */
+        old_allocated = new_allocated = 0;
+        if (!ret && sector < s->old_backing_num_sectors) {
+            n = MIN(n, s->old_backing_num_sectors - sector);
+            old_allocated = bdrv_is_allocated_above(s->bs_old_backing, NULL,
+                                                    sector, n, &n);
+        }
+        if (!ret && old_allocated >= 0 && s->bs_new_backing &&
+            sector < s->new_backing_num_sectors) {
+            n = MIN(n, s->new_backing_num_sectors - sector);
+            new_allocated = bdrv_is_allocated_above(s->bs_new_backing, NULL,
+                                                    sector, n, &n);
+        }
+        if (old_allocated < 0 || new_allocated < 0) {
+            ret = MIN(old_allocated, new_allocated);
+            error_report("error while reading image metadata: %s",
+                         strerror(-ret));
+            s->ret = ret;
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        qemu_progress_print(100.0 * n / s->num_sectors, 100);
+        if (ret || (!old_allocated && !new_allocated)) {
+            continue;
+        }
+
+        if (old_allocated) {
+            ret = img_co_read(s->bs_old_backing, sector, n, buf_old);
+            if (ret < 0) {
+                error_report("error while reading from old backing file");
+                s->ret = ret;
+                break;
+            }
+            s->bytes_read += sectors_to_bytes(n);
+        } else {
+            memset(buf_old, 0, n * BDRV_SECTOR_SIZE);
+        }
+
+        if (new_allocated) {
+            ret = img_co_read(s->bs_new_backing, sector, n, buf_new);
+            if (ret < 0) {
+                error_report("error while reading from new backing file");
+                s->ret = ret;
+                break;
+            }
+            s->bytes_read += sectors_to_bytes(n);
+        } else {
+            memset(buf_new, 0, n * BDRV_SECTOR_SIZE);
+        }
+
+        /* If they differ, we need to write to the COW file */
+        written = 0;
+        while (written < n) {
+            QEMUIOVector qiov;
+            struct iovec iov;
+            int pnum;
+
+            if (compare_sectors(buf_old + written * 512,
+                buf_new + written * 512, n - written, &pnum))
+            {
+                iov.iov_base = buf_old + written * 512;
+                iov.iov_len = pnum * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->bs, sector + written, pnum, &qiov);
+                if (ret < 0) {
+                    error_report("Error while writing to COW image: %s",
+                        strerror(-ret));
+                    s->ret = ret;
+                    break;
+                }
+            }
+
+            written += pnum;
+        }
+    }
+
+    qemu_vfree(buf_old);
+    qemu_vfree(buf_new);
+    s->running_coroutines--;
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockBackend *blk = NULL, *blk_old_backing = NULL, *blk_new_backing = NULL;
@@ -2446,6 +2958,7 @@ static int img_rebase(int argc, char **argv)
     int progress = 0;
     bool quiet = false;
     Error *local_err = NULL;
+    int64_t start_ns, bytes_read = 0;
 
     /* Parse commandline parameters */
     fmt = NULL;
@@ -2504,6 +3017,7 @@ static int img_rebase(int argc, char **argv)
 
     qemu_progress_init(progress, 2.0);
     qemu_progress_print(0, 100);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     flags = BDRV_O_RDWR | (unsafe ? BDRV_O_NO_BACKING : 0);
     ret = bdrv_parse_cache_flags(cache, &flags);
@@ -2593,127 +3107,47 @@ static int img_rebase(int argc, char **argv)
      * the image is the same as the original one at any time.
      */
     if (!unsafe) {
-        int64_t num_sectors;
-        int64_t old_backing_num_sectors;
-        int64_t new_backing_num_sectors = 0;
-        uint64_t sector;
-        int n;
-        uint8_t * buf_old;
-        uint8_t * buf_new;
-        float local_progress = 0;
-
-        buf_old = qemu_blockalign(bs, IO_BUF_SIZE);
-        buf_new = qemu_blockalign(bs, IO_BUF_SIZE);
+        ImgRebaseState s = {
+            .bs                 = bs,
+            .bs_old_backing     = bs_old_backing,
+            .bs_new_backing     = bs_new_backing,
+        };
 
-        num_sectors = bdrv_nb_sectors(bs);
-        if (num_sectors < 0) {
+        s.num_sectors = bdrv_nb_sectors(bs);
+        if (s.num_sectors < 0) {
             error_report("Could not get size of '%s': %s",
-                         filename, strerror(-num_sectors));
+                         filename, strerror(-s.num_sectors));
             ret = -1;
             goto out;
         }
-        old_backing_num_sectors = bdrv_nb_sectors(bs_old_backing);
-        if (old_backing_num_sectors < 0) {
+        s.old_backing_num_sectors = bdrv_nb_sectors(bs_old_backing);
+        if (s.old_backing_num_sectors < 0) {
             char backing_name[1024];
 
             bdrv_get_backing_filename(bs, backing_name, sizeof(backing_name));
             error_report("Could not get size of '%s': %s",
-                         backing_name, strerror(-old_backing_num_sectors));
+                         backing_name, strerror(-s.old_backing_num_sectors));
             ret = -1;
             goto out;
         }
         if (bs_new_backing) {
-            new_backing_num_sectors = bdrv_nb_sectors(bs_new_backing);
-            if (new_backing_num_sectors < 0) {
+            s.new_backing_num_sectors = bdrv_nb_sectors(bs_new_backing);
+            if (s.new_backing_num_sectors < 0) {
                 error_report("Could not get size of '%s': %s",
-                             out_baseimg, strerror(-new_backing_num_sectors));
+                             out_baseimg, strerror(-s.new_backing_num_sectors));
                 ret = -1;
                 goto out;
             }
         }
 
-        if (num_sectors != 0) {
-            local_progress = (float)100 /
-                (num_sectors / MIN(num_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for (sector = 0; sector < num_sectors; sector += n) {
-
-            /* How many sectors can we handle with the next read? */
-            if (sector + (IO_BUF_SIZE / 512) <= num_sectors) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = num_sectors - sector;
-            }
-
-            /* If the cluster is allocated, we don't need to take action */
-            ret = bdrv_is_allocated(bs, sector, n, &n);
-            if (ret < 0) {
-                error_report("error while reading image metadata: %s",
-                             strerror(-ret));
-                goto out;
-            }
-            if (ret) {
-                continue;
-            }
-
-            /*
-             * Read old and new backing file and take into consideration that
-             * backing files may be smaller than the COW image.
-             */
-            if (sector >= old_backing_num_sectors) {
-                memset(buf_old, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > old_backing_num_sectors) {
-                    n = old_backing_num_sectors - sector;
-                }
-
-                ret = bdrv_read(bs_old_backing, sector, buf_old, n);
-                if (ret < 0) {
-                    error_report("error while reading from old backing file");
-                    goto out;
-                }
-            }
-
-            if (sector >= new_backing_num_sectors || !bs_new_backing) {
-                memset(buf_new, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > new_backing_num_sectors) {
-                    n = new_backing_num_sectors - sector;
-                }
-
-                ret = bdrv_read(bs_new_backing, sector, buf_new, n);
-                if (ret < 0) {
-                    error_report("error while reading from new backing file");
-                    goto out;
-                }
-            }
-
-            /* If they differ, we need to write to the COW file */
-            uint64_t written = 0;
-
-            while (written < n) {
-                int pnum;
-
-                if (compare_sectors(buf_old + written * 512,
-                    buf_new + written * 512, n - written, &pnum))
-                {
-                    ret = bdrv_write(bs, sector + written,
-                        buf_old + written * 512, pnum);
-                    if (ret < 0) {
-                        error_report("Error while writing to COW image: %s",
-                            strerror(-ret));
-                        goto out;
-                    }
-                }
-
-                written += pnum;
-            }
-            qemu_progress_print(local_progress, 100);
+        qemu_co_mutex_init(&s.lock);
+        run_coroutines(rebase_co_do_rebase, &s, IO_COROUTINES,
+                       &s.running_coroutines);
+        bytes_read = s.bytes_read;
+        if (s.ret < 0) {
+            ret = s.ret;
+            goto out;
         }
-
-        qemu_vfree(buf_old);
-        qemu_vfree(buf_new);
     }
 
     /*
@@ -2744,6 +3178,7 @@ static int img_rebase(int argc, char **argv)
      */
 out:
     qemu_progress_end();
+    report_throughput(progress, bytes_read, start_ns);
     /* Cleanup */
     if (!unsafe) {
         blk_unref(blk_old_backing);
@@ -23,6 +23,8 @@
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "block/snapshot.h"
 #include "qapi/util.h"
 
@@ -44,14 +46,34 @@
 #define QEMU_NBD_OPT_AIO           2
 #define QEMU_NBD_OPT_DISCARD       3
 #define QEMU_NBD_OPT_DETECT_ZEROES 4
+#define QEMU_NBD_OPT_MAX_REQUESTS  5
+#define QEMU_NBD_OPT_IOTHREADS     6
 
-static NBDExport *exp;
+/* One export of the image.  Without --iothreads there is a single export
+ * served by the main loop.  With --iothreads each I/O thread opens the image
+ * on its own and runs its export in its own AioContext, and new connections
+ * are handed out round-robin.
+ */
+typedef struct NBDServer {
+    BlockBackend *blk;
+    NBDExport *exp;
+    AioContext *ctx;
+    QemuThread thread;
+    bool stopping;
+} NBDServer;
+
+static NBDServer *servers;
+static int nb_servers = 1;
+static int nb_iothreads;
+static int next_server;
+static int nb_exports_open;
 static int verbose;
 static char *srcpath;
 static char *sockpath;
 static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
+static int max_requests = NBD_DEFAULT_SERVER_REQUESTS;
 static int nb_fds;
 
 static void usage(const char *name)
@@ -69,6 +91,10 @@ static void usage(const char *name)
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"      --max-requests=NUM    process up to NUM requests of each client\n"
+"                            in parallel (default '%d')\n"
+"      --iothreads=NUM       serve clients from NUM I/O threads; more than\n"
+"                            one requires a read-only export\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "\n"
@@ -96,14 +122,14 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-#ifdef CONFIG_LINUX_AIO
-"      --aio=MODE            set AIO mode (native or threads)\n"
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+"      --aio=MODE            set AIO mode (native, uring or threads)\n"
 #endif
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, discard)\n"
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_SERVER_REQUESTS);
 }
 
 static void version(const char *name)
@@ -290,7 +316,7 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
+    ret = nbd_receive_negotiate(sock, NULL, &nbdflags, NULL,
                                 &size, &blocksize);
     if (ret < 0) {
         goto out_socket;
@@ -341,28 +367,64 @@ static int nbd_can_accept(void *opaque)
     return nb_fds < shared;
 }
 
+/* Both callbacks may run in an I/O thread */
 static void nbd_export_closed(NBDExport *exp)
 {
     assert(state == TERMINATING);
-    state = TERMINATED;
+    if (atomic_fetch_dec(&nb_exports_open) == 1) {
+        atomic_mb_set(&state, TERMINATED);
+        qemu_notify_event();
+    }
 }
 
 static void nbd_client_closed(NBDClient *client)
 {
-    nb_fds--;
-    if (nb_fds == 0 && !persistent && state == RUNNING) {
-        state = TERMINATE;
+    if (atomic_fetch_dec(&nb_fds) == 1 && !persistent && state == RUNNING) {
+        atomic_mb_set(&state, TERMINATE);
     }
     qemu_notify_event();
     nbd_client_put(client);
 }
 
+static void *nbd_server_thread(void *opaque)
+{
+    NBDServer *server = opaque;
+    bool blocking;
+
+    while (!atomic_read(&server->stopping)) {
+        aio_context_acquire(server->ctx);
+        blocking = true;
+        while (!atomic_read(&server->stopping) &&
+               aio_poll(server->ctx, blocking)) {
+            /* Progress was made, keep going */
+            blocking = false;
+        }
+        aio_context_release(server->ctx);
+    }
+    return NULL;
+}
+
+static void nbd_server_stop(NBDServer *server)
+{
+    atomic_mb_set(&server->stopping, true);
+    aio_notify(server->ctx);
+    qemu_thread_join(&server->thread);
+
+    /* Hand the image back to the main loop, which closes it */
+    bdrv_set_aio_context(blk_bs(server->blk), qemu_get_aio_context());
+    aio_context_unref(server->ctx);
+    server->ctx = NULL;
+}
+
 static void nbd_accept(void *opaque)
 {
     int server_fd = (uintptr_t) opaque;
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
 
+    NBDServer *server;
+    NBDClient *client;
+
     int fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
     if (fd < 0) {
         perror("accept");
@@ -374,18 +436,65 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (nbd_client_new(exp, fd, nbd_client_closed)) {
-        nb_fds++;
-    } else {
+    server = &servers[next_server];
+    next_server = (next_server + 1) % nb_servers;
+
+    /* Count the client first, it may be closed as soon as the handlers
+     * are installed in an I/O thread.
+     */
+    atomic_inc(&nb_fds);
+    aio_context_acquire(server->ctx);
+    client = nbd_client_new(server->exp, fd, nbd_client_closed);
+    aio_context_release(server->ctx);
+    if (!client) {
+        atomic_dec(&nb_fds);
         shutdown(fd, 2);
         close(fd);
     }
 }
 
-int main(int argc, char **argv)
+static BlockBackend *open_image(const char *name, const char *filename,
+                                int flags, BlockDriver *drv,
+                                QemuOpts *sn_opts, const char *sn_id_or_name,
+                                BlockdevDetectZeroesOptions detect_zeroes)
 {
     BlockBackend *blk;
     BlockDriverState *bs;
+    Error *local_err = NULL;
+    int ret = 0;
+
+    blk = blk_new_with_bs(name, &error_abort);
+    bs = blk_bs(blk);
+
+    ret = bdrv_open(&bs, filename, NULL, NULL, flags, drv, &local_err);
+    if (ret < 0) {
+        errno = -ret;
+        err(EXIT_FAILURE, "Failed to bdrv_open '%s': %s", filename,
+            error_get_pretty(local_err));
+    }
+
+    if (sn_opts) {
+        ret = bdrv_snapshot_load_tmp(bs,
+                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_ID),
+                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_NAME),
+                                     &local_err);
+    } else if (sn_id_or_name) {
+        ret = bdrv_snapshot_load_tmp_by_id_or_name(bs, sn_id_or_name,
+                                                   &local_err);
+    }
+    if (ret < 0) {
+        errno = -ret;
+        err(EXIT_FAILURE,
+            "Failed to load snapshot: %s",
+            error_get_pretty(local_err));
+    }
+
+    bs->detect_zeroes = detect_zeroes;
+    return blk;
+}
+
+int main(int argc, char **argv)
+{
     BlockDriver *drv;
     off_t dev_offset = 0;
     uint32_t nbdflags = 0;
@@ -412,12 +521,14 @@ int main(int argc, char **argv)
         { "load-snapshot", 1, NULL, 'l' },
         { "nocache", 0, NULL, 'n' },
         { "cache", 1, NULL, QEMU_NBD_OPT_CACHE },
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
         { "detect-zeroes", 1, NULL, QEMU_NBD_OPT_DETECT_ZEROES },
         { "shared", 1, NULL, 'e' },
+        { "max-requests", 1, NULL, QEMU_NBD_OPT_MAX_REQUESTS },
+        { "iothreads", 1, NULL, QEMU_NBD_OPT_IOTHREADS },
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
@@ -431,9 +542,10 @@ int main(int argc, char **argv)
     int partition = -1;
     int ret;
     int fd;
+    int i;
     bool seen_cache = false;
     bool seen_discard = false;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     bool seen_aio = false;
 #endif
     pthread_t client_thread;
@@ -467,14 +579,26 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid cache mode `%s'", optarg);
             }
             break;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         case QEMU_NBD_OPT_AIO:
             if (seen_aio) {
                 errx(EXIT_FAILURE, "--aio can only be specified once");
             }
             seen_aio = true;
             if (!strcmp(optarg, "native")) {
+#ifdef CONFIG_LINUX_AIO
                 flags |= BDRV_O_NATIVE_AIO;
+#else
+                errx(EXIT_FAILURE, "aio mode `native' is not supported "
+                     "in this build");
+#endif
+            } else if (!strcmp(optarg, "uring")) {
+#ifdef CONFIG_LINUX_IO_URING
+                flags |= BDRV_O_IO_URING;
+#else
+                errx(EXIT_FAILURE, "aio mode `uring' is not supported "
+                     "in this build");
+#endif
             } else if (!strcmp(optarg, "threads")) {
                 /* this is the default */
             } else {
@@ -575,6 +699,27 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Shared device number must be greater than 0\n");
             }
             break;
+        case QEMU_NBD_OPT_MAX_REQUESTS:
+            max_requests = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of requests '%s'", optarg);
+            }
+            if (max_requests < 1 || max_requests > NBD_MAX_REQUESTS) {
+                errx(EXIT_FAILURE, "Number of requests must be between 1 "
+                     "and %d", NBD_MAX_REQUESTS);
+            }
+            break;
+        case QEMU_NBD_OPT_IOTHREADS:
+            nb_iothreads = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of I/O threads '%s'",
+                     optarg);
+            }
+            if (nb_iothreads < 1) {
+                errx(EXIT_FAILURE, "Number of I/O threads must be greater "
+                     "than 0");
+            }
+            break;
         case 'f':
             fmt = optarg;
             break;
@@ -604,6 +749,15 @@ int main(int argc, char **argv)
              argv[0]);
     }
 
+    /* Each I/O thread opens the image separately, which is only safe as
+     * long as nobody writes to it.
+     */
+    if (nb_iothreads > 1 && ((flags & BDRV_O_RDWR) ||
+                             (flags & BDRV_O_SNAPSHOT))) {
+        errx(EXIT_FAILURE, "More than one I/O thread requires a read-only "
+             "export (-r) without -s");
+    }
+
     if (disconnect) {
         fd = open(argv[optind], O_RDWR);
         if (fd < 0) {
@@ -692,45 +846,56 @@ int main(int argc, char **argv)
         drv = NULL;
     }
 
-    blk = blk_new_with_bs("hda", &error_abort);
-    bs = blk_bs(blk);
-
     srcpath = argv[optind];
-    ret = bdrv_open(&bs, srcpath, NULL, NULL, flags, drv, &local_err);
-    if (ret < 0) {
-        errno = -ret;
-        err(EXIT_FAILURE, "Failed to bdrv_open '%s': %s", argv[optind],
-            error_get_pretty(local_err));
+    if (nb_iothreads) {
+        nb_servers = nb_iothreads;
     }
+    servers = g_new0(NBDServer, nb_servers);
 
-    if (sn_opts) {
-        ret = bdrv_snapshot_load_tmp(bs,
-                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_ID),
-                                     qemu_opt_get(sn_opts, SNAPSHOT_OPT_NAME),
-                                     &local_err);
-    } else if (sn_id_or_name) {
-        ret = bdrv_snapshot_load_tmp_by_id_or_name(bs, sn_id_or_name,
-                                                   &local_err);
-    }
-    if (ret < 0) {
-        errno = -ret;
-        err(EXIT_FAILURE,
-            "Failed to load snapshot: %s",
-            error_get_pretty(local_err));
-    }
+    for (i = 0; i < nb_servers; i++) {
+        NBDServer *server = &servers[i];
+        char *name = i ? g_strdup_printf("hda%d", i) : g_strdup("hda");
 
-    bs->detect_zeroes = detect_zeroes;
-    fd_size = blk_getlength(blk);
+        server->blk = open_image(name, srcpath, flags, drv, sn_opts,
+                                 sn_id_or_name, detect_zeroes);
+        g_free(name);
+
+        if (i == 0) {
+            fd_size = blk_getlength(server->blk);
 
-    if (partition != -1) {
-        ret = find_partition(blk, partition, &dev_offset, &fd_size);
-        if (ret < 0) {
-            errno = -ret;
-            err(EXIT_FAILURE, "Could not find partition %d", partition);
+            if (partition != -1) {
+                ret = find_partition(server->blk, partition, &dev_offset,
+                                     &fd_size);
+                if (ret < 0) {
+                    errno = -ret;
+                    err(EXIT_FAILURE, "Could not find partition %d",
+                        partition);
+                }
+            }
+        }
+
+        if (nb_iothreads) {
+            server->ctx = aio_context_new(&local_err);
+            if (!server->ctx) {
+                errx(EXIT_FAILURE, "Failed to create AIO context: %s",
+                     error_get_pretty(local_err));
+            }
+            bdrv_set_aio_context(blk_bs(server->blk), server->ctx);
+        } else {
+            server->ctx = qemu_get_aio_context();
         }
-    }
 
-    exp = nbd_export_new(blk, dev_offset, fd_size, nbdflags, nbd_export_closed);
+        server->exp = nbd_export_new(server->blk, dev_offset, fd_size,
+                                     nbdflags, nbd_export_closed);
+        nbd_export_set_max_requests(server->exp, max_requests);
+        nb_exports_open++;
+
+        if (nb_iothreads) {
+            qemu_thread_create(&server->thread, "nbd-iothread",
+                               nbd_server_thread, server,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
@@ -767,15 +932,27 @@ int main(int argc, char **argv)
     state = RUNNING;
     do {
         main_loop_wait(false);
-        if (state == TERMINATE) {
+        if (atomic_mb_read(&state) == TERMINATE) {
             state = TERMINATING;
-            nbd_export_close(exp);
-            nbd_export_put(exp);
-            exp = NULL;
+            for (i = 0; i < nb_servers; i++) {
+                NBDServer *server = &servers[i];
+
+                aio_context_acquire(server->ctx);
+                nbd_export_close(server->exp);
+                nbd_export_put(server->exp);
+                server->exp = NULL;
+                aio_context_release(server->ctx);
+            }
         }
-    } while (state != TERMINATED);
+    } while (atomic_mb_read(&state) != TERMINATED);
 
-    blk_unref(blk);
+    for (i = 0; i < nb_servers; i++) {
+        if (nb_iothreads) {
+            nbd_server_stop(&servers[i]);
+        }
+        blk_unref(servers[i].blk);
+    }
+    g_free(servers);
     if (sockpath) {
         unlink(sockpath);
     }
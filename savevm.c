@@ -221,6 +221,22 @@ typedef struct CompatEntry {
     int instance_id;
 } CompatEntry;
 
+/* Phases of a migration that time and bytes are accounted to */
+typedef enum SaveVMPhase {
+    SAVEVM_PHASE_SETUP,
+    SAVEVM_PHASE_ITERATE,
+    SAVEVM_PHASE_COMPLETE,
+    SAVEVM_PHASE_LOAD,
+    SAVEVM_PHASE_MAX
+} SaveVMPhase;
+
+static const char *const savevm_phase_names[SAVEVM_PHASE_MAX] = {
+    [SAVEVM_PHASE_SETUP] = "setup",
+    [SAVEVM_PHASE_ITERATE] = "iterate",
+    [SAVEVM_PHASE_COMPLETE] = "complete",
+    [SAVEVM_PHASE_LOAD] = "load",
+};
+
 typedef struct SaveStateEntry {
     QTAILQ_ENTRY(SaveStateEntry) entry;
     char idstr[256];
@@ -233,8 +249,27 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* spent on the section by the last migration, sent or received */
+    int64_t time_ns[SAVEVM_PHASE_MAX];
+    int64_t bytes[SAVEVM_PHASE_MAX];
 } SaveStateEntry;
 
+/* Where a section started, see savevm_section_account() */
+typedef struct SaveVMSectionMark {
+    int64_t start_ns;
+    int64_t start_pos;
+} SaveVMSectionMark;
+
+/* Protects time_ns and bytes of every SaveStateEntry.  Sections are saved
+ * and loaded by the migration threads, mostly without the iothread lock,
+ * while the monitor reads the statistics from the main loop.
+ */
+static QemuMutex savevm_stats_lock;
+
+static void __attribute__((constructor)) savevm_stats_init(void)
+{
+    qemu_mutex_init(&savevm_stats_lock);
+}
 
 static QTAILQ_HEAD(savevm_handlers, SaveStateEntry) savevm_handlers =
     QTAILQ_HEAD_INITIALIZER(savevm_handlers);
@@ -563,6 +598,81 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
     }
 }
 
+static void savevm_section_mark(QEMUFile *f, SaveVMSectionMark *mark)
+{
+    mark->start_ns = get_clock();
+    mark->start_pos = qemu_ftell_fast(f);
+}
+
+/* Account the time and the bytes of @f since @mark to @se */
+static void savevm_section_account(QEMUFile *f, SaveStateEntry *se,
+                                   SaveVMPhase phase, SaveVMSectionMark *mark)
+{
+    int64_t ns = get_clock() - mark->start_ns;
+    int64_t bytes = qemu_ftell_fast(f) - mark->start_pos;
+
+    qemu_mutex_lock(&savevm_stats_lock);
+    se->time_ns[phase] += ns;
+    se->bytes[phase] += bytes;
+    qemu_mutex_unlock(&savevm_stats_lock);
+    trace_savevm_section_stats(se->idstr, se->instance_id,
+                               savevm_phase_names[phase], ns, bytes);
+}
+
+static void savevm_stats_reset(void)
+{
+    SaveStateEntry *se;
+
+    qemu_mutex_lock(&savevm_stats_lock);
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        memset(se->time_ns, 0, sizeof(se->time_ns));
+        memset(se->bytes, 0, sizeof(se->bytes));
+    }
+    qemu_mutex_unlock(&savevm_stats_lock);
+}
+
+/* Time and bytes of the sections in the last migration, sent or received */
+MigrationSectionInfoList *qemu_savevm_section_info(void)
+{
+    MigrationSectionInfoList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+    int i;
+
+    qemu_mutex_lock(&savevm_stats_lock);
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        MigrationSectionInfoList *entry;
+        MigrationSectionInfo *info;
+
+        for (i = 0; i < SAVEVM_PHASE_MAX; i++) {
+            if (se->time_ns[i] || se->bytes[i]) {
+                break;
+            }
+        }
+        if (i == SAVEVM_PHASE_MAX) {
+            continue;
+        }
+
+        info = g_new0(MigrationSectionInfo, 1);
+        info->idstr = g_strdup(se->idstr);
+        info->instance_id = se->instance_id;
+        info->setup_time = se->time_ns[SAVEVM_PHASE_SETUP] / 1000;
+        info->setup_bytes = se->bytes[SAVEVM_PHASE_SETUP];
+        info->iterate_time = se->time_ns[SAVEVM_PHASE_ITERATE] / 1000;
+        info->iterate_bytes = se->bytes[SAVEVM_PHASE_ITERATE];
+        info->complete_time = se->time_ns[SAVEVM_PHASE_COMPLETE] / 1000;
+        info->complete_bytes = se->bytes[SAVEVM_PHASE_COMPLETE];
+        info->load_time = se->time_ns[SAVEVM_PHASE_LOAD] / 1000;
+        info->load_bytes = se->bytes[SAVEVM_PHASE_LOAD];
+
+        entry = g_new0(MigrationSectionInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&savevm_stats_lock);
+    return head;
+}
+
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se, int version_id)
 {
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
@@ -596,6 +706,146 @@ bool qemu_savevm_state_blocked(Error **errp)
     return false;
 }
 
+/* Commands carried by QEMU_VM_COMMAND sections.  A command is a be16 command
+ * number, a be16 length and that many bytes of arguments.
+ */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,
+    MIG_CMD_POSTCOPY_ADVISE,       /* be64 page size, precopy starts */
+    MIG_CMD_POSTCOPY_LISTEN,       /* start the listen thread */
+    MIG_CMD_POSTCOPY_RUN,          /* start the guest */
+    MIG_CMD_POSTCOPY_RAM_DISCARD,  /* ranges of pages dirtied since sent */
+    MIG_CMD_PACKAGED,              /* be32 length, then a nested stream */
+    MIG_CMD_MAX
+};
+
+/* Arbitrary limit, the sender never gets near it */
+#define MAX_VM_CMD_PACKAGED_SIZE (1ul << 30)
+
+/* Returned by the loading functions when the guest has been started on
+ * the destination, while the rest of the stream is loaded by the listen
+ * thread.
+ */
+#define LOADVM_QUIT 1
+
+static void qemu_savevm_command_send(QEMUFile *f, enum qemu_vm_cmd command,
+                                     uint16_t len, uint8_t *data)
+{
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, (uint16_t)command);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+/* Tell the destination that post-copy may be used, at the very start */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    uint64_t page_size = cpu_to_be64(TARGET_PAGE_SIZE);
+
+    trace_qemu_savevm_send_postcopy_advise();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, sizeof(page_size),
+                             (uint8_t *)&page_size);
+}
+
+/* Ask the destination to drop the pages in the @count ranges of RAMBlock
+ * @name, that have been dirtied since they were sent.  Ranges are bytes
+ * from the start of the block.
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t count, uint64_t *start,
+                                           uint64_t *length)
+{
+    size_t name_len = strlen(name);
+    size_t len = 1 + name_len + count * 16;
+    uint8_t *buf = g_malloc(len);
+    uint8_t *p = buf;
+    int i;
+
+    assert(len <= UINT16_MAX);
+    trace_qemu_savevm_send_postcopy_ram_discard(name, count);
+
+    *p++ = name_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    for (i = 0; i < count; i++) {
+        stq_be_p(p, start[i]);
+        stq_be_p(p + 8, length[i]);
+        p += 16;
+    }
+
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, len, buf);
+    g_free(buf);
+}
+
+/* Let the destination serve the RAM from page faults, before the devices
+ * are loaded since loading them can touch the RAM already.
+ */
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    trace_qemu_savevm_send_postcopy_listen();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    trace_qemu_savevm_send_postcopy_run();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
+/* Send the content of @package, a file opened with qemu_bufopen(), as a
+ * single command.  The destination reads all of it before processing it,
+ * so that the main stream is free for the pages the devices fault on while
+ * they are loaded.
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, QEMUFile *package)
+{
+    const QEMUSizedBuffer *qsb;
+    size_t len;
+    uint32_t be_len;
+    uint8_t *buf;
+    int ret;
+
+    qemu_fflush(package);
+    ret = qemu_file_get_error(package);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qsb = qemu_buf_get(package);
+    len = qsb_get_length(qsb);
+    if (len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %zu", len);
+        return -EINVAL;
+    }
+
+    buf = g_malloc(len);
+    qsb_get_buffer(qsb, 0, len, buf);
+    trace_qemu_savevm_send_packaged(len);
+
+    be_len = cpu_to_be32(len);
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, sizeof(be_len),
+                             (uint8_t *)&be_len);
+    qemu_put_buffer(f, buf, len);
+    qemu_fflush(f);
+    g_free(buf);
+
+    return qemu_file_get_error(f);
+}
+
+void qemu_savevm_state_header(QEMUFile *f)
+{
+    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
+}
+
+/* After the switch to post-copy, only sections that can post-copy go on */
+static bool savevm_section_skipped(SaveStateEntry *se, bool postcopy)
+{
+    return postcopy && (!se->ops->can_postcopy ||
+                        !se->ops->can_postcopy(se->opaque));
+}
+
 void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
@@ -603,6 +853,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
     int ret;
 
     trace_savevm_state_begin();
+    savevm_stats_reset();
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->set_params) {
             continue;
@@ -610,10 +861,8 @@ void qemu_savevm_state_begin(QEMUFile *f,
         se->ops->set_params(params, se->opaque);
     }
 
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        SaveVMSectionMark mark;
         int len;
 
         if (!se->ops || !se->ops->save_live_setup) {
@@ -624,6 +873,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
                 continue;
             }
         }
+        savevm_section_mark(f, &mark);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_START);
         qemu_put_be32(f, se->section_id);
@@ -637,6 +887,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
         qemu_put_be32(f, se->version_id);
 
         ret = se->ops->save_live_setup(f, se->opaque);
+        savevm_section_account(f, se, SAVEVM_PHASE_SETUP, &mark);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             break;
@@ -650,9 +901,10 @@ void qemu_savevm_state_begin(QEMUFile *f,
  *   0 : We haven't finished, caller have to go again
  *   1 : We have finished, we can go to complete phase
  */
-int qemu_savevm_state_iterate(QEMUFile *f)
+int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
+    SaveVMSectionMark mark;
     int ret = 1;
 
     trace_savevm_state_iterate();
@@ -665,15 +917,20 @@ int qemu_savevm_state_iterate(QEMUFile *f)
                 continue;
             }
         }
+        if (savevm_section_skipped(se, postcopy)) {
+            continue;
+        }
         if (qemu_file_rate_limit(f)) {
             return 0;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        savevm_section_mark(f, &mark);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
+        savevm_section_account(f, se, SAVEVM_PHASE_ITERATE, &mark);
         trace_savevm_section_end(se->idstr, se->section_id);
 
         if (ret < 0) {
@@ -690,15 +947,18 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+/* Complete the live sections: all of them, only those that can post-copy
+ * (@postcopy_only) or only those that cannot (@postcopy_switch).  Returns
+ * false on errors.
+ */
+static bool savevm_state_complete_live(QEMUFile *f, bool postcopy_only,
+                                       bool postcopy_switch)
 {
     SaveStateEntry *se;
+    SaveVMSectionMark mark;
+    bool can_postcopy;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -708,18 +968,33 @@ void qemu_savevm_state_complete(QEMUFile *f)
                 continue;
             }
         }
+        can_postcopy = se->ops->can_postcopy &&
+                       se->ops->can_postcopy(se->opaque);
+        if ((postcopy_only && !can_postcopy) ||
+            (postcopy_switch && can_postcopy)) {
+            continue;
+        }
         trace_savevm_section_start(se->idstr, se->section_id);
+        savevm_section_mark(f, &mark);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_complete(f, se->opaque);
+        savevm_section_account(f, se, SAVEVM_PHASE_COMPLETE, &mark);
         trace_savevm_section_end(se->idstr, se->section_id);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return false;
         }
     }
+    return true;
+}
+
+static void savevm_state_save_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    SaveVMSectionMark mark;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -728,6 +1003,7 @@ void qemu_savevm_state_complete(QEMUFile *f)
             continue;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        savevm_section_mark(f, &mark);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
         qemu_put_be32(f, se->section_id);
@@ -741,14 +1017,56 @@ void qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         vmstate_save(f, se);
+        savevm_section_account(f, se, SAVEVM_PHASE_COMPLETE, &mark);
         trace_savevm_section_end(se->idstr, se->section_id);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (!savevm_state_complete_live(f, false, false)) {
+        return;
+    }
+    savevm_state_save_devices(f);
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/* Switch to post-copy: the sections that cannot post-copy are completed and
+ * the devices saved, like in qemu_savevm_state_complete().  The stream goes
+ * on with the sections that can, see qemu_savevm_state_complete_postcopy().
+ */
+void qemu_savevm_state_switch_postcopy(QEMUFile *f)
+{
+    trace_savevm_state_switch_postcopy();
+
+    cpu_synchronize_all_states();
+
+    if (!savevm_state_complete_live(f, false, true)) {
+        return;
+    }
+    savevm_state_save_devices(f);
+}
+
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    trace_savevm_state_complete_postcopy();
+
+    if (!savevm_state_complete_live(f, true, false)) {
+        return;
+    }
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
 }
 
-uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
+uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size,
+                                   bool postcopy)
 {
     SaveStateEntry *se;
     uint64_t ret = 0;
@@ -762,6 +1080,9 @@ uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
                 continue;
             }
         }
+        if (savevm_section_skipped(se, postcopy)) {
+            continue;
+        }
         ret += se->ops->save_live_pending(f, se->opaque, max_size);
     }
     return ret;
@@ -792,11 +1113,12 @@ static int qemu_savevm_state(QEMUFile *f)
     }
 
     qemu_mutex_unlock_iothread();
+    qemu_savevm_state_header(f);
     qemu_savevm_state_begin(f, &params);
     qemu_mutex_lock_iothread();
 
     while (qemu_file_get_error(f) == 0) {
-        if (qemu_savevm_state_iterate(f) > 0) {
+        if (qemu_savevm_state_iterate(f, false) > 0) {
             break;
         }
     }
@@ -878,39 +1200,326 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+/* Live sections of the incoming migration.  With post-copy, the listen
+ * thread goes on using them after qemu_loadvm_state() has returned.
+ */
+static QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
+    QLIST_HEAD_INITIALIZER(loadvm_handlers);
+
+static void loadvm_free_handlers(void)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f);
+
+/* Set while the incoming migration thread holds the iothread lock */
+static bool loadvm_iothread_locked;
+
+/* The incoming migration thread reads the stream without the iothread lock,
+ * and only takes it to look up and load sections and to run commands, see
+ * process_incoming_migration().  load_vmstate() and RDMA load from the main
+ * loop, which already holds the lock.  Returns true if the lock was taken
+ * by this call.
+ */
+static bool loadvm_lock_iothread(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (!mis->have_incoming_thread ||
+        !qemu_thread_is_self(&mis->incoming_thread) ||
+        loadvm_iothread_locked) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    loadvm_iothread_locked = true;
+    return true;
+}
+
+static void loadvm_unlock_iothread(bool locked)
+{
+    if (locked) {
+        loadvm_iothread_locked = false;
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Load a section.  If @locked, the lock was taken for this section and is
+ * dropped again while loading sections that can do without it.
+ */
+static int loadvm_load_section(QEMUFile *f, SaveStateEntry *se,
+                               int version_id, bool locked)
+{
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
+    if (locked && se->ops && se->ops->load_state_unlocked) {
+        loadvm_unlock_iothread(true);
+        ret = vmstate_load(f, se, version_id);
+        loadvm_lock_iothread();
+    } else {
+        ret = vmstate_load(f, se, version_id);
+    }
+    return ret;
+}
+
+/* Loads the rest of the stream while the guest runs on the destination,
+ * then tells the source whether that worked.  A failure here cannot be
+ * recovered from, the guest lost its memory.
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int ret;
+
+    ret = qemu_loadvm_state_main(f);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    } else if (ret == LOADVM_QUIT) {
+        ret = -EINVAL;
+    }
+    if (ret == 0) {
+        ret = postcopy_ram_incoming_cleanup(mis);
+    }
+    if (ret < 0) {
+        error_report("Post-copy migration failed: %s", strerror(-ret));
+        migrate_send_rp_shut(mis, 1);
+        exit(EXIT_FAILURE);
+    }
+    migrate_send_rp_shut(mis, 0);
+    trace_postcopy_ram_listen_thread_exit();
+
+    /* Wait for the main loop to be done with the package.  The iothread
+     * lock alone is not enough, devices may drop it while they load.
+     */
+    qemu_event_wait(&mis->main_done);
+    qemu_mutex_lock_iothread();
+    loadvm_free_handlers();
+    qemu_fclose(mis->return_path);
+    mis->return_path = NULL;
+    qemu_fclose(f);
+    mis->file = NULL;
+    mis->have_listen_thread = false;
+    mis->postcopy_state = POSTCOPY_INCOMING_END;
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
+                                         uint64_t page_size)
+{
+    if (mis->postcopy_state != POSTCOPY_INCOMING_NONE) {
+        error_report("Post-copy advise in the wrong state (%d)",
+                     mis->postcopy_state);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Post-copy page size mismatch: source %" PRIu64
+                     ", destination %d", page_size, TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+    if (!postcopy_ram_supported_by_host()) {
+        return -EINVAL;
+    }
+    if (postcopy_ram_incoming_init(mis) < 0) {
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
+    mis->postcopy_state = POSTCOPY_INCOMING_ADVISE;
+    return 0;
+}
+
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              uint16_t len, uint8_t *buf)
+{
+    char name[256];
+    uint8_t name_len;
+    int i, count;
+
+    if (mis->postcopy_state != POSTCOPY_INCOMING_ADVISE) {
+        error_report("Post-copy discard in the wrong state (%d)",
+                     mis->postcopy_state);
+        return -EINVAL;
+    }
+    if (len < 1 || len < 1 + buf[0] || (len - 1 - buf[0]) % 16) {
+        error_report("Invalid post-copy discard length %d", len);
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    name_len = buf[0];
+    memcpy(name, buf + 1, name_len);
+    name[name_len] = 0;
+    buf += 1 + name_len;
+    count = (len - 1 - name_len) / 16;
+
+    for (i = 0; i < count; i++) {
+        int ret = ram_discard_range(name, ldq_be_p(buf), ldq_be_p(buf + 8));
+        if (ret < 0) {
+            return ret;
+        }
+        buf += 16;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        return -ENOTSUP;
+    return 0;
+}
+
+static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
+{
+    if (mis->postcopy_state != POSTCOPY_INCOMING_ADVISE) {
+        error_report("Post-copy listen in the wrong state (%d)",
+                     mis->postcopy_state);
+        return -EINVAL;
+    }
+
+    mis->return_path = qemu_file_get_return_path(mis->file);
+    if (!mis->return_path) {
+        error_report("Post-copy needs a return path to the source");
+        return -EINVAL;
+    }
+    /* The listen thread reads the stream outside of any coroutine */
+    qemu_set_block(qemu_get_fd(mis->file));
+
+    if (postcopy_ram_enable_notify(mis) < 0) {
+        return -EINVAL;
+    }
+
+    mis->postcopy_state = POSTCOPY_INCOMING_LISTENING;
+    mis->have_listen_thread = true;
+    qemu_thread_create(&mis->listen_thread, "postcopy_listen",
+                       postcopy_ram_listen_thread, mis->file,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
+{
+    if (mis->postcopy_state != POSTCOPY_INCOMING_LISTENING) {
+        error_report("Post-copy run in the wrong state (%d)",
+                     mis->postcopy_state);
+        return -EINVAL;
     }
 
-    while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
+    cpu_synchronize_all_post_init();
+    mis->postcopy_state = POSTCOPY_INCOMING_RUNNING;
+
+    /* The caller starts the guest once qemu_loadvm_state() returns */
+    return LOADVM_QUIT;
+}
+
+/* Load the nested stream of @len bytes of a MIG_CMD_PACKAGED command */
+static int loadvm_handle_cmd_packaged(QEMUFile *f, uint32_t len)
+{
+    QEMUSizedBuffer *qsb;
+    QEMUFile *packf;
+    uint8_t *buf;
+    int ret;
+
+    if (len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", len);
+        return -EINVAL;
+    }
+
+    buf = g_malloc(len);
+    if (qemu_get_buffer(f, buf, len) != len) {
+        g_free(buf);
+        return -EIO;
+    }
+    qsb = qsb_create(buf, len);
+    g_free(buf);
+    if (!qsb) {
+        return -ENOMEM;
+    }
+    trace_loadvm_handle_cmd_packaged(len);
+
+    packf = qemu_bufopen("r", qsb);
+    ret = qemu_loadvm_state_main(packf);
+    if (ret == 0) {
+        ret = qemu_file_get_error(packf);
+    }
+    qemu_fclose(packf);
+    return ret;
+}
+
+static int loadvm_process_command(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint16_t cmd, len;
+    uint8_t *buf;
+    bool locked;
+    int ret;
+
+    cmd = qemu_get_be16(f);
+    len = qemu_get_be16(f);
+    buf = g_malloc(len);
+    if (qemu_get_buffer(f, buf, len) != len) {
+        g_free(buf);
+        return -EIO;
+    }
+    trace_loadvm_process_command(cmd, len);
+
+    /* A package is loaded as a whole, the post-copy listen thread must not
+     * see it half done
+     */
+    locked = loadvm_lock_iothread();
+
+    switch (cmd) {
+    case MIG_CMD_POSTCOPY_ADVISE:
+        ret = len == 8 ? loadvm_postcopy_handle_advise(mis, ldq_be_p(buf))
+                       : -EINVAL;
+        break;
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        ret = loadvm_postcopy_ram_handle_discard(mis, len, buf);
+        break;
+    case MIG_CMD_POSTCOPY_LISTEN:
+        ret = loadvm_postcopy_handle_listen(mis);
+        break;
+    case MIG_CMD_POSTCOPY_RUN:
+        ret = loadvm_postcopy_handle_run(mis);
+        break;
+    case MIG_CMD_PACKAGED:
+        ret = len == 4 ? loadvm_handle_cmd_packaged(f, ldl_be_p(buf))
+                       : -EINVAL;
+        break;
+    default:
+        error_report("Unknown migration command %d", cmd);
+        ret = -EINVAL;
+        break;
+    }
+
+    loadvm_unlock_iothread(locked);
+    g_free(buf);
+    return ret;
+}
+
+/* Load sections until the end of the stream.  Returns 0 at QEMU_VM_EOF,
+ * LOADVM_QUIT when the guest has been started in post-copy, or a negative
+ * error code.
+ */
+static int qemu_loadvm_state_main(QEMUFile *f)
+{
+    LoadStateEntry *le;
+    SaveVMSectionMark mark;
+    uint8_t section_type;
+    bool locked;
+    int ret;
+
+    for (;;) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
         char idstr[257];
         int len;
 
+        savevm_section_mark(f, &mark);
+        section_type = qemu_get_byte(f);
+        if (section_type == QEMU_VM_EOF) {
+            break;
+        }
+
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
@@ -922,35 +1531,44 @@ int qemu_loadvm_state(QEMUFile *f)
             instance_id = qemu_get_be32(f);
             version_id = qemu_get_be32(f);
 
+            locked = loadvm_lock_iothread();
+
             /* Find savevm section */
             se = find_se(idstr, instance_id);
             if (se == NULL) {
+                loadvm_unlock_iothread(locked);
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
+                loadvm_unlock_iothread(locked);
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            /* Add entry */
-            le = g_malloc0(sizeof(*le));
-
-            le->se = se;
-            le->section_id = section_id;
-            le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            /* Add entry, only live sections are looked up again.  This
+             * keeps the list untouched by the devices that are loaded
+             * while the post-copy listen thread uses it.
+             */
+            if (section_type == QEMU_VM_SECTION_START) {
+                le = g_malloc0(sizeof(*le));
+
+                le->se = se;
+                le->section_id = section_id;
+                le->version_id = version_id;
+                QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            ret = loadvm_load_section(f, se, version_id, locked);
+            loadvm_unlock_iothread(locked);
+            savevm_section_account(f, se, SAVEVM_PHASE_LOAD, &mark);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
@@ -964,32 +1582,76 @@ int qemu_loadvm_state(QEMUFile *f)
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            locked = loadvm_lock_iothread();
+            ret = loadvm_load_section(f, le->se, le->version_id, locked);
+            loadvm_unlock_iothread(locked);
+            savevm_section_account(f, le->se, SAVEVM_PHASE_LOAD, &mark);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            if (ret != 0) {
+                return ret;
             }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    unsigned int v;
+    bool locked, blocked;
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    locked = loadvm_lock_iothread();
+    blocked = qemu_savevm_state_blocked(NULL);
+    savevm_stats_reset();
+    loadvm_unlock_iothread(locked);
+    if (blocked) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        return -ENOTSUP;
+    }
+
+    ret = qemu_loadvm_state_main(f);
+    if (ret == LOADVM_QUIT) {
+        /* The listen thread loads the rest and frees the sections */
+        return 0;
+    }
+    if (ret == 0) {
+        locked = loadvm_lock_iothread();
+        cpu_synchronize_all_post_init();
+        loadvm_unlock_iothread(locked);
+    }
+
+    if (!mis->have_listen_thread) {
+        loadvm_free_handlers();
     }
 
     if (ret == 0) {
@@ -1233,6 +1895,7 @@ int load_vmstate(const char *name)
 
     qemu_system_reset(VMRESET_SILENT);
     ret = qemu_loadvm_state(f);
+    migrate_decompress_threads_join();
 
     qemu_fclose(f);
     if (ret < 0) {
@@ -0,0 +1,619 @@
+/*
+ * QTest testcase for migration statistics, fixed-ram files and migration with
+ * multiple connections, compression threads or post-copy
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "qemu-common.h"
+#include "libqtest.h"
+#include "qemu/osdep.h"
+#include "qapi/qmp/types.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+
+#define MACHINE "-machine pc -m 128 -device e1000 -device virtio-net-pci " \
+                "-device virtio-balloon-pci -device ich9-usb-uhci1 "
+
+/* Guest memory that the fixed-ram and live tests fill before migrating */
+#define FILL_START (32 << 20)
+#define FILL_SIZE (8 << 20)
+#define REWRITE_SIZE (256 << 10)
+#define PAGE_SIZE 4096
+
+/* Send @command and return the response, skipping events */
+static QDict *wait_command(QTestState *s, const char *command)
+{
+    QDict *response = qtest_qmp(s, command);
+
+    while (qdict_haskey(response, "event")) {
+        QDECREF(response);
+        response = qtest_qmp_receive(s);
+    }
+    g_assert(qdict_haskey(response, "return"));
+    return response;
+}
+
+static bool migration_done(QTestState *src, QTestState *dst)
+{
+    QDict *response, *ret;
+    const char *status;
+    bool done;
+
+    response = wait_command(src, "{ 'execute': 'query-migrate' }");
+    ret = qdict_get_qdict(response, "return");
+    status = qdict_get_try_str(ret, "status");
+    g_assert(!status || (strcmp(status, "failed") &&
+                         strcmp(status, "cancelled")));
+    done = status && !strcmp(status, "completed");
+    QDECREF(response);
+    if (!done) {
+        return false;
+    }
+
+    response = wait_command(dst, "{ 'execute': 'query-status' }");
+    ret = qdict_get_qdict(response, "return");
+    done = strcmp(qdict_get_str(ret, "status"), "inmigrate");
+    QDECREF(response);
+    return done;
+}
+
+/* Migrate from a new guest to another, return the time it took in seconds */
+static double migrate(QTestState **src, QTestState **dst)
+{
+    char *path = g_strdup_printf("/tmp/migration-test-%d.sock", getpid());
+    char *args;
+    QDict *response;
+
+    args = g_strdup_printf(MACHINE "-incoming unix:%s", path);
+    *dst = qtest_init(args);
+    g_free(args);
+    *src = qtest_init(MACHINE);
+
+    g_test_timer_start();
+    args = g_strdup_printf("{ 'execute': 'migrate',"
+                           "  'arguments': { 'uri': 'unix:%s' } }", path);
+    response = wait_command(*src, args);
+    QDECREF(response);
+    g_free(args);
+
+    while (!migration_done(*src, *dst)) {
+        g_usleep(1000);
+    }
+
+    unlink(path);
+    g_free(path);
+    return g_test_timer_elapsed();
+}
+
+static QList *get_sections(QTestState *s, QDict **response)
+{
+    QDict *ret;
+
+    *response = wait_command(s, "{ 'execute': 'query-migrate' }");
+    ret = qdict_get_qdict(*response, "return");
+    g_assert(qdict_haskey(ret, "sections"));
+    return qobject_to_qlist(qdict_get(ret, "sections"));
+}
+
+static QDict *find_section(QList *sections, const char *idstr,
+                           int64_t instance_id)
+{
+    QListEntry *entry;
+
+    QLIST_FOREACH_ENTRY(sections, entry) {
+        QDict *sec = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(sec, "idstr"), idstr) &&
+            qdict_get_int(sec, "instance-id") == instance_id) {
+            return sec;
+        }
+    }
+    return NULL;
+}
+
+/* Every section is loaded from as many bytes as were sent for it */
+static void test_sections(void)
+{
+    QTestState *src, *dst;
+    QDict *src_response, *dst_response, *ram;
+    QList *src_sections, *dst_sections;
+    QListEntry *entry;
+    bool e1000 = false, virtio_net = false;
+
+    migrate(&src, &dst);
+    src_sections = get_sections(src, &src_response);
+    dst_sections = get_sections(dst, &dst_response);
+
+    ram = find_section(src_sections, "ram", 0);
+    g_assert(ram);
+    g_assert_cmpint(qdict_get_int(ram, "setup-bytes"), >, 0);
+    g_assert_cmpint(qdict_get_int(ram, "complete-bytes"), >, 0);
+    g_assert_cmpint(qdict_get_int(ram, "load-bytes"), ==, 0);
+
+    QLIST_FOREACH_ENTRY(src_sections, entry) {
+        QDict *sec = qobject_to_qdict(qlist_entry_obj(entry));
+        const char *idstr = qdict_get_str(sec, "idstr");
+        QDict *loaded;
+        int64_t sent;
+
+        sent = qdict_get_int(sec, "setup-bytes") +
+               qdict_get_int(sec, "iterate-bytes") +
+               qdict_get_int(sec, "complete-bytes");
+        loaded = find_section(dst_sections, idstr,
+                              qdict_get_int(sec, "instance-id"));
+        g_assert(loaded);
+        g_assert_cmpint(qdict_get_int(loaded, "load-bytes"), ==, sent);
+        g_assert_cmpint(qdict_get_int(loaded, "complete-bytes"), ==, 0);
+        e1000 |= strstr(idstr, "/e1000") != NULL;
+        virtio_net |= strstr(idstr, "/virtio-net") != NULL;
+    }
+    g_assert(e1000 && virtio_net);
+
+    QDECREF(src_response);
+    QDECREF(dst_response);
+    qtest_quit(src);
+    qtest_quit(dst);
+}
+
+static char *migrate_status(QTestState *s, int64_t *normal_pages)
+{
+    QDict *response, *ret;
+    char *status;
+
+    response = wait_command(s, "{ 'execute': 'query-migrate' }");
+    ret = qdict_get_qdict(response, "return");
+    status = g_strdup(qdict_get_try_str(ret, "status"));
+    if (normal_pages) {
+        *normal_pages = qdict_haskey(ret, "ram") ?
+            qdict_get_int(qdict_get_qdict(ret, "ram"), "normal") : 0;
+    }
+    QDECREF(response);
+    return status;
+}
+
+static gchar *read_memory(QTestState *s, uint64_t addr, size_t size)
+{
+    char *path = g_strdup_printf("/tmp/migration-test-%d.mem", getpid());
+    QDict *response;
+    char *args;
+    gchar *data;
+    gsize len;
+
+    args = g_strdup_printf("{ 'execute': 'pmemsave',"
+                           "  'arguments': { 'val': %" PRIu64 ", 'size': %zu,"
+                           "                 'filename': '%s' } }",
+                           addr, size, path);
+    response = wait_command(s, args);
+    QDECREF(response);
+    g_free(args);
+
+    g_assert(g_file_get_contents(path, &data, &len, NULL));
+    g_assert_cmpint(len, ==, size);
+    unlink(path);
+    g_free(path);
+    return data;
+}
+
+static void compare_memory(QTestState *src, QTestState *dst, uint64_t addr,
+                           size_t size)
+{
+    gchar *src_mem = read_memory(src, addr, size);
+    gchar *dst_mem = read_memory(dst, addr, size);
+
+    g_assert(memcmp(src_mem, dst_mem, size) == 0);
+    g_free(src_mem);
+    g_free(dst_mem);
+}
+
+/* Put @value at the start of every page in [@start, @start + @size) */
+static void fill_pages(QTestState *s, uint64_t start, uint64_t size,
+                       uint64_t value)
+{
+    uint64_t addr;
+
+    for (addr = start; addr < start + size; addr += PAGE_SIZE) {
+        qtest_writeq(s, addr, value ? value + addr : 0);
+    }
+}
+
+/* Save a guest to a fixed-ram file and load it back.  Once the first pass
+ * has written the filled pages to the file, some of them are rewritten and
+ * some are zeroed: the load must take the new copies, and must leave the
+ * zeroed pages zero although their old data is still in the file.
+ */
+static void test_fixed_ram(void)
+{
+    char *file = g_strdup_printf("/tmp/migration-test-%d.img", getpid());
+    QTestState *src, *dst;
+    int64_t normal_pages;
+    char *args, *status;
+    QDict *response;
+
+    src = qtest_init(MACHINE);
+    fill_pages(src, FILL_START, FILL_SIZE, 0x1111);
+
+    response = wait_command(src, "{ 'execute': 'migrate-set-capabilities',"
+                            "  'arguments': { 'capabilities': ["
+                            "    { 'capability': 'fixed-ram', 'state': true },"
+                            "    { 'capability': 'multifd', 'state': true }"
+                            "  ] } }");
+    QDECREF(response);
+    response = wait_command(src, "{ 'execute': 'migrate_set_speed',"
+                            "  'arguments': { 'value': 4194304 } }");
+    QDECREF(response);
+
+    args = g_strdup_printf("{ 'execute': 'migrate',"
+                           "  'arguments': { 'uri': 'file:%s' } }", file);
+    response = wait_command(src, args);
+    QDECREF(response);
+    g_free(args);
+
+    /* Pages go out in address order, so once half of the filled memory
+     * has been written its first pages are in the file.
+     */
+    do {
+        status = migrate_status(src, &normal_pages);
+        g_assert(!strcmp(status, "setup") || !strcmp(status, "active"));
+        g_free(status);
+        g_usleep(1000);
+    } while (normal_pages < FILL_SIZE / 2 / PAGE_SIZE);
+
+    fill_pages(src, FILL_START, REWRITE_SIZE, 0x2222);
+    fill_pages(src, FILL_START + REWRITE_SIZE, REWRITE_SIZE, 0);
+    response = wait_command(src, "{ 'execute': 'migrate_set_speed',"
+                            "  'arguments': { 'value': 1073741824 } }");
+    QDECREF(response);
+
+    for (;;) {
+        status = migrate_status(src, NULL);
+        if (strcmp(status, "setup") && strcmp(status, "active")) {
+            break;
+        }
+        g_free(status);
+        g_usleep(1000);
+    }
+    g_assert_cmpstr(status, ==, "completed");
+    g_free(status);
+
+    args = g_strdup_printf(MACHINE "-incoming file:%s", file);
+    dst = qtest_init(args);
+    g_free(args);
+    for (;;) {
+        QDict *ret;
+        bool loaded;
+
+        response = wait_command(dst, "{ 'execute': 'query-status' }");
+        ret = qdict_get_qdict(response, "return");
+        loaded = strcmp(qdict_get_str(ret, "status"), "inmigrate");
+        QDECREF(response);
+        if (loaded) {
+            break;
+        }
+        g_usleep(1000);
+    }
+
+    g_assert_cmpint(qtest_readq(dst, FILL_START), ==, 0x2222 + FILL_START);
+    g_assert_cmpint(qtest_readq(dst, FILL_START + REWRITE_SIZE), ==, 0);
+    g_assert_cmpint(qtest_readq(dst, FILL_START + FILL_SIZE - PAGE_SIZE), ==,
+                    0x1111 + FILL_START + FILL_SIZE - PAGE_SIZE);
+
+    /* Low memory holds what the firmware set up */
+    compare_memory(src, dst, 0, 1 << 20);
+    compare_memory(src, dst, FILL_START - (1 << 20), FILL_SIZE + (2 << 20));
+
+    qtest_quit(src);
+    qtest_quit(dst);
+    unlink(file);
+    g_free(file);
+}
+
+/* Return a TCP port on the loopback interface that nobody listens on */
+static int free_tcp_port(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    g_assert(fd >= 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    g_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+/* Fill [@start, @start + @size) with random data, or with zeros if @rand
+ * is NULL
+ */
+static void fill_random(QTestState *s, GRand *rand, uint64_t start,
+                        uint64_t size)
+{
+    const size_t chunk = 1 << 20;
+    uint32_t *buf = g_malloc0(chunk);
+    uint64_t addr;
+    size_t i, len;
+
+    for (addr = start; addr < start + size; addr += len) {
+        len = MIN(chunk, start + size - addr);
+        for (i = 0; rand && i < len / sizeof(*buf); i++) {
+            buf[i] = g_rand_int(rand);
+        }
+        qtest_memwrite(s, addr, buf, len);
+    }
+    g_free(buf);
+}
+
+static char *query_status(QTestState *s)
+{
+    QDict *response, *ret;
+    char *status;
+
+    response = wait_command(s, "{ 'execute': 'query-status' }");
+    ret = qdict_get_qdict(response, "return");
+    status = g_strdup(qdict_get_str(ret, "status"));
+    QDECREF(response);
+    return status;
+}
+
+/* Migrate a guest with random data in its memory over @uri, with @caps
+ * (a list of migrate-set-capabilities entries) enabled on the source.
+ * Once half of the data has been sent, some of it is rewritten and some
+ * is zeroed, and the destination must end up with the new contents.
+ * With @postcopy, the migration then switches to post-copy, and the
+ * destination reads pages that it does not have yet before the rest of
+ * its memory is sent.
+ */
+static void migrate_live(const char *uri, const char *caps, bool postcopy)
+{
+    GRand *rand = g_rand_new_with_seed(0x5eed);
+    QTestState *src, *dst;
+    int64_t normal_pages;
+    char *args, *status;
+    QDict *response;
+
+    args = g_strdup_printf(MACHINE "-incoming %s", uri);
+    dst = qtest_init(args);
+    g_free(args);
+    src = qtest_init(MACHINE);
+    fill_random(src, rand, FILL_START, FILL_SIZE);
+
+    args = g_strdup_printf("{ 'execute': 'migrate-set-capabilities',"
+                           "  'arguments': { 'capabilities': [ %s ] } }",
+                           caps);
+    response = wait_command(src, args);
+    QDECREF(response);
+    g_free(args);
+    response = wait_command(src, "{ 'execute': 'migrate_set_speed',"
+                            "  'arguments': { 'value': 4194304 } }");
+    QDECREF(response);
+
+    args = g_strdup_printf("{ 'execute': 'migrate',"
+                           "  'arguments': { 'uri': '%s' } }", uri);
+    response = wait_command(src, args);
+    QDECREF(response);
+    g_free(args);
+
+    do {
+        status = migrate_status(src, &normal_pages);
+        g_assert(!strcmp(status, "setup") || !strcmp(status, "active"));
+        g_free(status);
+        g_usleep(1000);
+    } while (normal_pages < FILL_SIZE / 2 / PAGE_SIZE);
+
+    fill_random(src, rand, FILL_START, REWRITE_SIZE);
+    fill_random(src, NULL, FILL_START + REWRITE_SIZE, REWRITE_SIZE);
+
+    if (postcopy) {
+        uint64_t last = FILL_START + FILL_SIZE - PAGE_SIZE;
+
+        response = wait_command(src, "{ 'execute': "
+                                "'migrate-start-postcopy' }");
+        QDECREF(response);
+        for (;;) {
+            status = migrate_status(src, NULL);
+            if (strcmp(status, "active")) {
+                break;
+            }
+            g_free(status);
+            g_usleep(1000);
+        }
+        g_assert_cmpstr(status, ==, "postcopy-active");
+        g_free(status);
+
+        /* The destination runs once it has the device state */
+        for (;;) {
+            status = query_status(dst);
+            if (strcmp(status, "inmigrate")) {
+                break;
+            }
+            g_free(status);
+            g_usleep(1000);
+        }
+        g_assert_cmpstr(status, ==, "running");
+        g_free(status);
+
+        /* Rewritten after it was sent, and not sent yet */
+        g_assert_cmpint(qtest_readq(dst, FILL_START), ==,
+                        qtest_readq(src, FILL_START));
+        g_assert_cmpint(qtest_readq(dst, last), ==, qtest_readq(src, last));
+    }
+
+    response = wait_command(src, "{ 'execute': 'migrate_set_speed',"
+                            "  'arguments': { 'value': 1073741824 } }");
+    QDECREF(response);
+
+    while (!migration_done(src, dst)) {
+        g_usleep(1000);
+    }
+
+    compare_memory(src, dst, 0, 1 << 20);
+    compare_memory(src, dst, FILL_START - (1 << 20), FILL_SIZE + (2 << 20));
+
+    qtest_quit(src);
+    qtest_quit(dst);
+    g_rand_free(rand);
+}
+
+static void test_multifd(void)
+{
+    char *uri = g_strdup_printf("tcp:127.0.0.1:%d", free_tcp_port());
+
+    migrate_live(uri, "{ 'capability': 'multifd', 'state': true }", false);
+    g_free(uri);
+}
+
+static void test_compress(void)
+{
+    char *uri = g_strdup_printf("unix:/tmp/migration-test-%d.sock",
+                                getpid());
+
+    migrate_live(uri, "{ 'capability': 'compress', 'state': true }", false);
+    unlink(uri + strlen("unix:"));
+    g_free(uri);
+}
+
+#ifdef CONFIG_USERFAULTFD
+static bool ufd_available(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd < 0) {
+        return false;
+    }
+    if (ioctl(ufd, UFFDIO_API, &api) ||
+        !(api.ioctls & (1ULL << _UFFDIO_REGISTER))) {
+        close(ufd);
+        return false;
+    }
+    close(ufd);
+    return true;
+}
+#else
+static bool ufd_available(void)
+{
+    return false;
+}
+#endif
+
+static void test_postcopy(void)
+{
+    char *uri = g_strdup_printf("unix:/tmp/migration-test-%d.sock",
+                                getpid());
+
+    migrate_live(uri, "{ 'capability': 'postcopy-ram', 'state': true }",
+                 true);
+    unlink(uri + strlen("unix:"));
+    g_free(uri);
+}
+
+typedef struct {
+    char *name;
+    int64_t downtime;
+    int64_t bytes;
+} SectionCost;
+
+static gint section_cost_compare(gconstpointer a, gconstpointer b)
+{
+    const SectionCost *ca = a, *cb = b;
+
+    return ca->downtime < cb->downtime ? 1 : ca->downtime > cb->downtime ?
+           -1 : 0;
+}
+
+/* Which sections the downtime goes to: the time to complete a section on
+ * the source and to load it on the destination, averaged over a few runs.
+ */
+static void perf_downtime(void)
+{
+    const int runs = 5;
+    GHashTable *costs = g_hash_table_new(g_str_hash, g_str_equal);
+    GList *list, *l;
+    double total = 0;
+    int i;
+
+    for (i = 0; i < runs; i++) {
+        QTestState *src, *dst;
+        QDict *src_response, *dst_response;
+        QList *src_sections, *dst_sections;
+        QListEntry *entry;
+
+        total += migrate(&src, &dst);
+        src_sections = get_sections(src, &src_response);
+        dst_sections = get_sections(dst, &dst_response);
+
+        QLIST_FOREACH_ENTRY(src_sections, entry) {
+            QDict *sec = qobject_to_qdict(qlist_entry_obj(entry));
+            char *name = g_strdup_printf("%s/%" PRId64,
+                                         qdict_get_str(sec, "idstr"),
+                                         qdict_get_int(sec, "instance-id"));
+            QDict *loaded = find_section(dst_sections,
+                                         qdict_get_str(sec, "idstr"),
+                                         qdict_get_int(sec, "instance-id"));
+            SectionCost *cost = g_hash_table_lookup(costs, name);
+
+            if (!cost) {
+                cost = g_new0(SectionCost, 1);
+                cost->name = name;
+                g_hash_table_insert(costs, name, cost);
+            } else {
+                g_free(name);
+            }
+            cost->downtime += qdict_get_int(sec, "complete-time") +
+                              qdict_get_int(loaded, "load-time");
+            cost->bytes += qdict_get_int(sec, "complete-bytes");
+        }
+
+        QDECREF(src_response);
+        QDECREF(dst_response);
+        qtest_quit(src);
+        qtest_quit(dst);
+    }
+
+    g_test_message("%d migrations in %.3fs", runs, total);
+    list = g_list_sort(g_hash_table_get_values(costs), section_cost_compare);
+    for (l = list, i = 0; l; l = l->next, i++) {
+        SectionCost *cost = l->data;
+
+        if (i < 10) {
+            g_test_message("%-40s %8" PRId64 " us %8" PRId64 " bytes",
+                           cost->name, cost->downtime / runs,
+                           cost->bytes / runs);
+        }
+        g_free(cost->name);
+        g_free(cost);
+    }
+    g_list_free(list);
+    g_hash_table_destroy(costs);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/migration/sections", test_sections);
+    qtest_add_func("/migration/fixed-ram", test_fixed_ram);
+    qtest_add_func("/migration/multifd", test_multifd);
+    qtest_add_func("/migration/compress", test_compress);
+    /* Post-copy needs userfaultfd on the destination */
+    if (ufd_available()) {
+        qtest_add_func("/migration/postcopy", test_postcopy);
+    }
+    if (g_test_perf()) {
+        qtest_add_func("/migration/perf/downtime", perf_downtime);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,155 @@
+/*
+ * Test AES routines
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/aes.h"
+
+typedef struct {
+    int bits;
+    uint8_t key[32];
+    uint8_t ciphertext[64];
+} CBCTest;
+
+/* NIST SP 800-38A, F.2.1 and F.2.5 */
+static const uint8_t cbc_iv[AES_BLOCK_SIZE] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+
+static const uint8_t cbc_plaintext[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+    0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+    0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+    0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const CBCTest cbc_tests[] = {
+    {
+        .bits = 128,
+        .key = {
+            0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+            0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+        },
+        .ciphertext = {
+            0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+            0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+            0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+            0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+            0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+            0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+            0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+            0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7,
+        },
+    }, {
+        .bits = 256,
+        .key = {
+            0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+            0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+            0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+            0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4,
+        },
+        .ciphertext = {
+            0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba,
+            0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6,
+            0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d,
+            0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d,
+            0x39, 0xf2, 0x33, 0x69, 0xa9, 0xd9, 0xba, 0xcf,
+            0xa5, 0x30, 0xe2, 0x63, 0x04, 0x23, 0x14, 0x61,
+            0xb2, 0xeb, 0x05, 0xe2, 0xc3, 0x9b, 0xe9, 0xfc,
+            0xda, 0x6c, 0x19, 0x07, 0x8c, 0x6a, 0x9d, 0x1b,
+        },
+    },
+};
+
+static void test_cbc_vectors(void)
+{
+    uint8_t buf[64];
+    uint8_t iv[AES_BLOCK_SIZE];
+    AES_KEY key;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cbc_tests); i++) {
+        const CBCTest *test = &cbc_tests[i];
+
+        g_assert_cmpint(AES_set_encrypt_key(test->key, test->bits, &key),
+                        ==, 0);
+        memcpy(iv, cbc_iv, sizeof(iv));
+        AES_cbc_encrypt(cbc_plaintext, buf, sizeof(buf), &key, iv, 1);
+        g_assert(memcmp(buf, test->ciphertext, sizeof(buf)) == 0);
+        /* The IV is updated to the last ciphertext block */
+        g_assert(memcmp(iv, test->ciphertext + 48, sizeof(iv)) == 0);
+
+        g_assert_cmpint(AES_set_decrypt_key(test->key, test->bits, &key),
+                        ==, 0);
+        memcpy(iv, cbc_iv, sizeof(iv));
+        AES_cbc_encrypt(test->ciphertext, buf, sizeof(buf), &key, iv, 0);
+        g_assert(memcmp(buf, cbc_plaintext, sizeof(buf)) == 0);
+        g_assert(memcmp(iv, test->ciphertext + 48, sizeof(iv)) == 0);
+    }
+}
+
+/* Compare in-place CBC over a disk sector against a block-by-block
+ * reference built on AES_encrypt/AES_decrypt.
+ */
+static void test_cbc_sector(void)
+{
+    static const int key_bits[] = { 128, 192, 256 };
+    uint8_t user_key[32];
+    uint8_t plain[512], buf[512], ref[512];
+    uint8_t iv[AES_BLOCK_SIZE], tmp[AES_BLOCK_SIZE];
+    AES_KEY enc_key, dec_key;
+    int i, j, k;
+
+    for (i = 0; i < ARRAY_SIZE(key_bits); i++) {
+        for (j = 0; j < sizeof(user_key); j++) {
+            user_key[j] = g_test_rand_int();
+        }
+        for (j = 0; j < sizeof(plain); j++) {
+            plain[j] = g_test_rand_int();
+        }
+        AES_set_encrypt_key(user_key, key_bits[i], &enc_key);
+        AES_set_decrypt_key(user_key, key_bits[i], &dec_key);
+
+        memset(tmp, 0, sizeof(tmp));
+        for (j = 0; j < sizeof(plain); j += AES_BLOCK_SIZE) {
+            for (k = 0; k < AES_BLOCK_SIZE; k++) {
+                tmp[k] ^= plain[j + k];
+            }
+            AES_encrypt(tmp, tmp, &enc_key);
+            memcpy(ref + j, tmp, AES_BLOCK_SIZE);
+        }
+
+        memcpy(buf, plain, sizeof(buf));
+        memset(iv, 0, sizeof(iv));
+        AES_cbc_encrypt(buf, buf, sizeof(buf), &enc_key, iv, 1);
+        g_assert(memcmp(buf, ref, sizeof(buf)) == 0);
+
+        memset(iv, 0, sizeof(iv));
+        AES_cbc_encrypt(buf, buf, sizeof(buf), &dec_key, iv, 0);
+        g_assert(memcmp(buf, plain, sizeof(buf)) == 0);
+
+        /* Odd number of blocks to cover the tail of the 4-way loop */
+        memset(iv, 0, sizeof(iv));
+        AES_cbc_encrypt(ref, buf, 7 * AES_BLOCK_SIZE, &dec_key, iv, 0);
+        g_assert(memcmp(buf, plain, 7 * AES_BLOCK_SIZE) == 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/aes/cbc/vectors", test_cbc_vectors);
+    g_test_add_func("/aes/cbc/sector", test_cbc_sector);
+    return g_test_run();
+}
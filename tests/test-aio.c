@@ -425,6 +425,74 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+#ifndef _WIN32
+static bool poll_ready;
+static int poll_calls;
+
+static bool poll_test_cb(void *opaque)
+{
+    poll_calls++;
+    if (poll_ready) {
+        poll_ready = false;
+        return true;
+    }
+    return false;
+}
+
+static void test_poll_handler(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+    Error *local_err = NULL;
+    uint64_t hits = ctx->poll_hits;
+    uint64_t misses = ctx->poll_misses;
+    int calls;
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_test_cb);
+    aio_context_set_poll_params(ctx, 1000000000, 0, 0, &local_err);
+    g_assert(!local_err);
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* A short wait turns polling on */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Work found by the poll handler completes a blocking aio_poll() */
+    poll_ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert(!poll_ready);
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_hits, ==, hits + 1);
+    g_assert_cmpint(ctx->poll_misses, ==, misses);
+
+    /* Polling gives up after poll_ns and the fd handler runs */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(ctx->poll_hits, ==, hits + 1);
+    g_assert_cmpint(ctx->poll_misses, ==, misses + 1);
+
+    /* poll-max-ns == 0 disables polling */
+    aio_context_set_poll_params(ctx, 0, 0, 0, &local_err);
+    g_assert(!local_err);
+    calls = poll_calls;
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 3);
+    g_assert_cmpint(poll_calls, ==, calls);
+
+    aio_context_set_poll_params(ctx, 0, 0, -1, &local_err);
+    g_assert(local_err);
+    error_free(local_err);
+
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -843,6 +911,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+#ifndef _WIN32
+    g_test_add_func("/aio/event/poll",              test_poll_handler);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
@@ -0,0 +1,111 @@
+/*
+ * buffer_find_nonzero_offset() unit-tests and benchmark
+ *
+ * Run with "-m perf" to measure the throughput of every variant the host
+ * supports.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE (64 * 1024)
+
+static void test_buffer_find_nonzero_offset(void)
+{
+    char *area = qemu_memalign(64, BUF_SIZE + 128);
+    size_t start, len, pos;
+
+    memset(area, 0, BUF_SIZE + 128);
+
+    do {
+        const char *accel = buffer_find_nonzero_offset_accel();
+
+        g_test_message("testing %s", accel);
+        for (start = 0; start < 65; start++) {
+            for (len = 0; len < 1100; len += 1 + len / 8) {
+                char *buf = area + start;
+
+                g_assert_cmpuint(buffer_find_nonzero_offset(buf, len), ==,
+                                 len);
+                g_assert(buffer_is_zero(buf, len));
+
+                for (pos = 0; pos < len; pos += 1 + pos / 4) {
+                    buf[pos] = 0x80;
+                    g_assert_cmpuint(buffer_find_nonzero_offset(buf, len), ==,
+                                     pos);
+                    g_assert(!buffer_is_zero(buf, len));
+                    buf[pos] = 0;
+                }
+
+                /* Bytes outside the buffer do not count */
+                if (start) {
+                    buf[-1] = 1;
+                }
+                buf[len] = 1;
+                g_assert(buffer_is_zero(buf, len));
+                if (start) {
+                    buf[-1] = 0;
+                }
+                buf[len] = 0;
+            }
+        }
+
+        /* A non-zero byte at the very end of a large buffer */
+        area[BUF_SIZE - 1] = 1;
+        g_assert_cmpuint(buffer_find_nonzero_offset(area, BUF_SIZE), ==,
+                         BUF_SIZE - 1);
+        area[BUF_SIZE - 1] = 0;
+    } while (test_buffer_find_nonzero_offset_next_accel());
+
+    qemu_vfree(area);
+}
+
+static void perf_buffer_find_nonzero_offset(void)
+{
+    static const size_t sizes[] = { 4096, 64 * 1024 };
+    char *buf = qemu_memalign(64, BUF_SIZE);
+    size_t i;
+
+    memset(buf, 0, BUF_SIZE);
+
+    do {
+        const char *accel = buffer_find_nonzero_offset_accel();
+
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            size_t size = sizes[i];
+            uint64_t bytes = 0;
+            double duration;
+
+            g_test_timer_start();
+            do {
+                int j;
+
+                for (j = 0; j < 1000; j++) {
+                    g_assert(buffer_find_nonzero_offset(buf, size) == size);
+                }
+                bytes += 1000 * size;
+                duration = g_test_timer_elapsed();
+            } while (duration < 0.5);
+
+            g_test_message("%-8s %6zu bytes: %6.2f GB/s", accel, size,
+                           bytes / duration / 1e9);
+        }
+    } while (test_buffer_find_nonzero_offset_next_accel());
+
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/bufferiszero", test_buffer_find_nonzero_offset);
+    if (g_test_perf()) {
+        g_test_add_func("/cutils/bufferiszero/perf",
+                        perf_buffer_find_nonzero_offset);
+    }
+    return g_test_run();
+}
@@ -11,6 +11,7 @@
 
 #include <glib.h>
 #include <stdarg.h>
+#include <string.h>
 #include "qemu/hbitmap.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
@@ -369,6 +370,69 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *hb;
+
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, 0, 3);
+    hbitmap_test_set(data, L2, L1);
+
+    hb = hbitmap_alloc(L3 + 23, 0);
+    hbitmap_set(hb, 1, L1);
+    hbitmap_set(hb, L3 + 20, 3);
+    hbitmap_merge(data->hb, hb);
+    hbitmap_free(hb);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, (L1 + 1) + L1 + 3);
+
+    /* Add the merged bits to the shadow bitmap */
+    data->bits[0] |= ~0UL << 1;
+    data->bits[1] |= 1;
+    data->bits[L3 / BITS_PER_LONG] |= 7UL << 20;
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_get(data);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    uint64_t size;
+    uint8_t *buf;
+    HBitmap *hb;
+
+    hbitmap_test_init(data, L3 * 2 + 5, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 2);
+    hbitmap_test_set(data, L2 + 7, L1 * 3);
+    hbitmap_test_set(data, L3 * 2, 5);
+
+    size = hbitmap_serialization_size(data->hb);
+    g_assert_cmpint(size, ==, (L3 * 2 + 5 + 63) / 64 * 8);
+    buf = g_malloc(size);
+    hbitmap_serialize(data->hb, buf);
+
+    /* The format is independent of the host: bit 0 of byte 0 comes first */
+    g_assert_cmpint(buf[0], ==, 0x01);
+    g_assert_cmpint(buf[(L1 - 1) / 8], ==, 0x80);
+    g_assert_cmpint(buf[(L1 - 1) / 8 + 1], ==, 0x01);
+
+    /* Stale contents are replaced */
+    hb = hbitmap_alloc(L3 * 2 + 5, 0);
+    hbitmap_set(hb, 100, 1000);
+    hbitmap_deserialize(hb, buf);
+    hbitmap_free(data->hb);
+    data->hb = hb;
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_get(data);
+
+    /* Bits past the end of the bitmap are dropped */
+    memset(buf, 0xff, size);
+    hbitmap_deserialize(hb, buf);
+    g_assert_cmpint(hbitmap_count(hb), ==, L3 * 2 + 5);
+    g_free(buf);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +459,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
     g_test_run();
 
     return 0;
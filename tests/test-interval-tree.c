@@ -0,0 +1,197 @@
+/*
+ * Interval tree unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/interval-tree.h"
+
+typedef struct {
+    IntervalTreeNode node;
+    bool in_tree;
+    bool selectable;
+} TestInterval;
+
+static bool overlaps(uint64_t s1, uint64_t e1, uint64_t s2, uint64_t e2)
+{
+    return s1 < e2 && s2 < e1;
+}
+
+static bool match_selectable(IntervalTreeNode *node, void *opaque)
+{
+    TestInterval *ti = container_of(node, TestInterval, node);
+
+    return ti->selectable;
+}
+
+/* Reference implementation: lowest start wins, ties go to the lower
+ * address, which is the in-order position in the tree.
+ */
+static TestInterval *linear_find(TestInterval *iv, int n,
+                                 uint64_t start, uint64_t end)
+{
+    TestInterval *best = NULL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!iv[i].in_tree || !iv[i].selectable ||
+            !overlaps(iv[i].node.start, iv[i].node.end, start, end)) {
+            continue;
+        }
+        if (!best || iv[i].node.start < best->node.start ||
+            (iv[i].node.start == best->node.start && &iv[i] < best)) {
+            best = &iv[i];
+        }
+    }
+    return best;
+}
+
+static void test_interval_tree_empty(void)
+{
+    IntervalTree tree = { 0 };
+
+    g_assert(interval_tree_empty(&tree));
+    g_assert(interval_tree_find(&tree, 0, UINT64_MAX, NULL, NULL) == NULL);
+}
+
+static void test_interval_tree_boundaries(void)
+{
+    IntervalTree tree = { 0 };
+    TestInterval a, b, z;
+
+    interval_tree_insert(&tree, &a.node, 100, 200);
+    interval_tree_insert(&tree, &b.node, 300, 400);
+    g_assert(!interval_tree_empty(&tree));
+
+    /* Half-open: touching intervals do not overlap */
+    g_assert(interval_tree_find(&tree, 0, 100, NULL, NULL) == NULL);
+    g_assert(interval_tree_find(&tree, 200, 300, NULL, NULL) == NULL);
+    g_assert(interval_tree_find(&tree, 400, 500, NULL, NULL) == NULL);
+    g_assert(interval_tree_find(&tree, 99, 101, NULL, NULL) == &a.node);
+    g_assert(interval_tree_find(&tree, 199, 301, NULL, NULL) == &a.node);
+    g_assert(interval_tree_find(&tree, 200, 301, NULL, NULL) == &b.node);
+    g_assert(interval_tree_find(&tree, 0, UINT64_MAX, NULL, NULL) == &a.node);
+
+    /* An empty interval only overlaps ranges that strictly contain it */
+    interval_tree_insert(&tree, &z.node, 250, 250);
+    g_assert(interval_tree_find(&tree, 249, 251, NULL, NULL) == &z.node);
+    g_assert(interval_tree_find(&tree, 250, 260, NULL, NULL) == NULL);
+
+    interval_tree_remove(&tree, &a.node);
+    interval_tree_remove(&tree, &z.node);
+    g_assert(interval_tree_find(&tree, 0, UINT64_MAX, NULL, NULL) == &b.node);
+    interval_tree_remove(&tree, &b.node);
+    g_assert(interval_tree_empty(&tree));
+}
+
+static void test_interval_tree_random(void)
+{
+    enum { N = 500, SPACE = 10000, ROUNDS = 20000 };
+    IntervalTree tree = { 0 };
+    TestInterval *iv = g_new0(TestInterval, N);
+    int i, r;
+
+    for (r = 0; r < ROUNDS; r++) {
+        TestInterval *ti = &iv[g_test_rand_int_range(0, N)];
+        uint64_t start = g_test_rand_int_range(0, SPACE);
+        uint64_t end = start + g_test_rand_int_range(0, 200);
+        TestInterval *expected;
+        IntervalTreeNode *node;
+
+        if (ti->in_tree) {
+            interval_tree_remove(&tree, &ti->node);
+            ti->in_tree = false;
+        } else {
+            uint64_t s = g_test_rand_int_range(0, SPACE);
+            interval_tree_insert(&tree, &ti->node, s,
+                                 s + g_test_rand_int_range(0, 300));
+            ti->in_tree = true;
+            ti->selectable = g_test_rand_int_range(0, 2);
+        }
+
+        expected = linear_find(iv, N, start, end);
+        node = interval_tree_find(&tree, start, end, match_selectable, NULL);
+        g_assert(node == (expected ? &expected->node : NULL));
+    }
+
+    for (i = 0; i < N; i++) {
+        if (iv[i].in_tree) {
+            interval_tree_remove(&tree, &iv[i].node);
+        }
+    }
+    g_assert(interval_tree_empty(&tree));
+    g_free(iv);
+}
+
+/* Model of wait_serialising_requests(): @depth requests in flight at random
+ * cluster-aligned offsets, each lookup checks a new request against all of
+ * them.  Compare the interval tree with a walk of the whole list.
+ */
+static void perf_interval_tree_depth(void)
+{
+    enum { LOOKUPS = 200000, CLUSTER = 65536 };
+    const uint64_t disk_clusters = 1 << 20;
+    uint64_t *query = g_new(uint64_t, LOOKUPS);
+    int depth;
+
+    for (depth = 1; depth <= 1024; depth *= 4) {
+        IntervalTree tree = { 0 };
+        TestInterval *iv = g_new0(TestInterval, depth);
+        double tree_s, list_s;
+        int i, j, tree_hits = 0, list_hits = 0;
+
+        for (i = 0; i < depth; i++) {
+            uint64_t s = g_test_rand_int_range(0, disk_clusters) *
+                         (uint64_t)CLUSTER;
+            interval_tree_insert(&tree, &iv[i].node, s, s + CLUSTER);
+        }
+        for (i = 0; i < LOOKUPS; i++) {
+            query[i] = g_test_rand_int_range(0, disk_clusters) *
+                       (uint64_t)CLUSTER;
+        }
+
+        g_test_timer_start();
+        for (i = 0; i < LOOKUPS; i++) {
+            tree_hits += interval_tree_find(&tree, query[i], query[i] + 4096,
+                                            NULL, NULL) != NULL;
+        }
+        tree_s = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < LOOKUPS; i++) {
+            for (j = 0; j < depth; j++) {
+                if (overlaps(iv[j].node.start, iv[j].node.end,
+                             query[i], query[i] + 4096)) {
+                    list_hits++;
+                    break;
+                }
+            }
+        }
+        list_s = g_test_timer_elapsed();
+
+        g_assert_cmpint(tree_hits, ==, list_hits);
+        g_test_message("depth %4d: tree %6.1f ns/lookup, list %7.1f ns/lookup",
+                       depth, tree_s * 1e9 / LOOKUPS, list_s * 1e9 / LOOKUPS);
+
+        for (i = 0; i < depth; i++) {
+            interval_tree_remove(&tree, &iv[i].node);
+        }
+        g_free(iv);
+    }
+    g_free(query);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_interval_tree_empty);
+    g_test_add_func("/interval-tree/boundaries", test_interval_tree_boundaries);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+    if (g_test_perf()) {
+        g_test_add_func("/interval-tree/perf/depth", perf_interval_tree_depth);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,147 @@
+/*
+ * Page cache unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 64
+#define CACHE_PAGES 64
+#define WAYS 8
+/* Addresses this far apart fall into the same set */
+#define SET_STRIDE ((CACHE_PAGES / WAYS) * PAGE_SIZE)
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static bool page_matches(PageCache *cache, uint64_t addr)
+{
+    uint8_t expected[PAGE_SIZE];
+    uint8_t *data = get_cached_data(cache, addr);
+
+    fill_page(expected, addr);
+    return data && memcmp(data, expected, PAGE_SIZE) == 0;
+}
+
+static void insert_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+
+    fill_page(page, addr);
+    g_assert_cmpint(cache_insert(cache, addr, page), ==, 0);
+}
+
+static void test_page_cache_basic(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES + 5, PAGE_SIZE);
+    uint64_t addr;
+
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert(get_cached_data(cache, 0) == NULL);
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        insert_page(cache, addr);
+    }
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        g_assert(page_matches(cache, addr));
+    }
+
+    /* Overwriting keeps a single copy */
+    insert_page(cache, 0);
+    g_assert(page_matches(cache, 0));
+
+    cache_fini(cache);
+}
+
+/* Pages that collide in their set do not evict each other until the set
+ * is full.
+ */
+static void test_page_cache_ways(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < WAYS; i++) {
+        insert_page(cache, i * SET_STRIDE);
+    }
+    for (i = 0; i < WAYS; i++) {
+        g_assert(page_matches(cache, i * SET_STRIDE));
+    }
+
+    insert_page(cache, WAYS * SET_STRIDE);
+    g_assert(page_matches(cache, WAYS * SET_STRIDE));
+    for (i = 0; i < WAYS && cache_is_cached(cache, i * SET_STRIDE); i++) {
+        /* find the evicted page */
+    }
+    g_assert_cmpint(i, <, WAYS);
+
+    cache_fini(cache);
+}
+
+/* A page that keeps being used survives a stream of pages going through
+ * its set.
+ */
+static void test_page_cache_replacement(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    const uint64_t hot = 3 * PAGE_SIZE;
+    int i;
+
+    insert_page(cache, hot);
+    for (i = 1; i < 1000; i++) {
+        g_assert(page_matches(cache, hot));
+        insert_page(cache, hot + i * SET_STRIDE);
+    }
+
+    /* Recently inserted pages are still there, old ones are gone */
+    g_assert(cache_is_cached(cache, hot + 999 * SET_STRIDE));
+    g_assert(!cache_is_cached(cache, hot + SET_STRIDE));
+
+    cache_fini(cache);
+}
+
+static void test_page_cache_resize(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint64_t addr;
+    int cached = 0;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        insert_page(cache, addr);
+    }
+
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES * 4), ==,
+                    CACHE_PAGES * 4);
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_matches(cache, addr));
+    }
+
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES / 4), ==,
+                    CACHE_PAGES / 4);
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_is_cached(cache, addr)) {
+            g_assert(page_matches(cache, addr));
+            cached++;
+        }
+    }
+    g_assert_cmpint(cached, ==, CACHE_PAGES / 4);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/basic", test_page_cache_basic);
+    g_test_add_func("/page-cache/ways", test_page_cache_ways);
+    g_test_add_func("/page-cache/replacement", test_page_cache_replacement);
+    g_test_add_func("/page-cache/resize", test_page_cache_resize);
+    return g_test_run();
+}
@@ -0,0 +1,284 @@
+/*
+ * QEMUFile write path unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <sys/socket.h>
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "migration/qemu-file.h"
+#include "block/coroutine.h"
+
+#define PAGE_SIZE 4096
+#define RAM_PAGES 4096
+
+/* Fake yield_until_fd_readable() implementation so we don't have to pull the
+ * coroutine code as dependency.
+ */
+void yield_until_fd_readable(int fd)
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    select(fd + 1, &fds, NULL, NULL, NULL);
+}
+
+typedef struct {
+    int fd;
+    bool keep;          /* collect the data, or only count it */
+    GByteArray *data;
+    uint64_t len;
+    QemuThread thread;
+} TestReader;
+
+static void *reader_thread(void *opaque)
+{
+    TestReader *r = opaque;
+    uint8_t *buf = g_malloc(1 << 20);
+    ssize_t len;
+
+    while ((len = read(r->fd, buf, 1 << 20)) != 0) {
+        if (len < 0) {
+            g_assert(errno == EINTR);
+            continue;
+        }
+        if (r->keep) {
+            g_byte_array_append(r->data, buf, len);
+        }
+        r->len += len;
+    }
+    g_free(buf);
+    return NULL;
+}
+
+/* Open a socket file for writing, with a thread draining the other end */
+static QEMUFile *open_socket_file(TestReader *r, bool keep, bool batch)
+{
+    QEMUFile *f;
+    int sv[2];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    r->fd = sv[1];
+    r->keep = keep;
+    r->data = g_byte_array_new();
+    r->len = 0;
+    qemu_thread_create(&r->thread, "reader", reader_thread, r,
+                       QEMU_THREAD_JOINABLE);
+
+    f = qemu_fopen_socket(sv[0], "wb");
+    qemu_file_set_batch(f, batch);
+    return f;
+}
+
+static void close_socket_file(QEMUFile *f, TestReader *r)
+{
+    g_assert_cmpint(qemu_fclose(f), ==, 0);
+    qemu_thread_join(&r->thread);
+    close(r->fd);
+}
+
+static uint8_t *ram_alloc(void)
+{
+    uint8_t *ram = g_malloc(RAM_PAGES * PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < RAM_PAGES * PAGE_SIZE; i++) {
+        ram[i] = i * 7 + (i >> 12);
+    }
+    return ram;
+}
+
+static void expect_be(GByteArray *exp, uint64_t v, int size)
+{
+    uint8_t buf[8];
+    int i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = v >> ((size - 1 - i) * 8);
+    }
+    g_byte_array_append(exp, buf, size);
+}
+
+/* Something like a RAM section: page headers with the odd block name,
+ * pages queued without copying, zero pages and a large copied buffer.
+ */
+static void put_stream(QEMUFile *f, GByteArray *exp, uint8_t *ram, int pages)
+{
+    static const char idstr[] = "pc.ram";
+    uint8_t *big = g_malloc(3 * 32768 + 17);
+    int i;
+
+    for (i = 0; i < pages; i++) {
+        uint8_t *p = ram + (i * 37 % RAM_PAGES) * PAGE_SIZE;
+
+        qemu_put_be64(f, (uint64_t)i << 12 | 0x8);
+        expect_be(exp, (uint64_t)i << 12 | 0x8, 8);
+        if (i % 100 == 0) {
+            qemu_put_byte(f, strlen(idstr));
+            qemu_put_buffer(f, (uint8_t *)idstr, strlen(idstr));
+            g_byte_array_append(exp, (uint8_t *)"\6pc.ram", 7);
+        }
+        if (i % 5 == 0) {
+            qemu_put_byte(f, 0);
+            g_byte_array_append(exp, (uint8_t *)"", 1);
+        } else {
+            qemu_put_buffer_async(f, p, PAGE_SIZE);
+            g_byte_array_append(exp, p, PAGE_SIZE);
+        }
+        if (i % 1000 == 999) {
+            qemu_put_be16(f, 0xabcd);
+            qemu_put_be32(f, 0x12345678);
+            expect_be(exp, 0xabcd, 2);
+            expect_be(exp, 0x12345678, 4);
+            memset(big, i, 3 * 32768 + 17);
+            qemu_put_buffer(f, big, 3 * 32768 + 17);
+            g_byte_array_append(exp, big, 3 * 32768 + 17);
+        }
+    }
+    g_free(big);
+}
+
+static void test_stream(bool batch)
+{
+    GByteArray *exp = g_byte_array_new();
+    uint8_t *ram = ram_alloc();
+    TestReader r;
+    QEMUFile *f;
+
+    f = open_socket_file(&r, true, batch);
+    put_stream(f, exp, ram, 5000);
+    g_assert_cmpint(qemu_file_get_error(f), ==, 0);
+    close_socket_file(f, &r);
+
+    g_assert_cmpint(r.data->len, ==, exp->len);
+    g_assert(memcmp(r.data->data, exp->data, exp->len) == 0);
+
+    g_byte_array_free(r.data, true);
+    g_byte_array_free(exp, true);
+    g_free(ram);
+}
+
+static void test_stream_default(void)
+{
+    test_stream(false);
+}
+
+static void test_stream_batch(void)
+{
+    test_stream(true);
+}
+
+/* Switching batching off with more iovecs queued than the default limit */
+static void test_stream_batch_off(void)
+{
+    GByteArray *exp = g_byte_array_new();
+    uint8_t *ram = ram_alloc();
+    TestReader r;
+    QEMUFile *f;
+    int i;
+
+    f = open_socket_file(&r, true, true);
+    for (i = 0; i < 200; i++) {
+        qemu_put_byte(f, i);
+        g_byte_array_append(exp, (uint8_t *)&i, 1);
+        qemu_put_buffer_async(f, ram + i * PAGE_SIZE, PAGE_SIZE);
+        g_byte_array_append(exp, ram + i * PAGE_SIZE, PAGE_SIZE);
+    }
+    qemu_file_set_batch(f, false);
+    put_stream(f, exp, ram, 300);
+    close_socket_file(f, &r);
+
+    g_assert_cmpint(r.data->len, ==, exp->len);
+    g_assert(memcmp(r.data->data, exp->data, exp->len) == 0);
+
+    g_byte_array_free(r.data, true);
+    g_byte_array_free(exp, true);
+    g_free(ram);
+}
+
+/* Offsets and seeks on a file, the way the fixed-ram layout uses them */
+static void test_fd_seek(void)
+{
+    char path[] = "/tmp/test-qemu-file.XXXXXX";
+    uint8_t buf[PAGE_SIZE];
+    QEMUFile *f;
+    int fd;
+
+    fd = mkstemp(path);
+    g_assert(fd >= 0);
+    f = qemu_fdopen(fd, "wb");
+    qemu_put_be64(f, 0x1122334455667788ULL);
+    g_assert_cmpint(qemu_file_fd_offset(f), ==, 8);
+    memset(buf, 0xaa, PAGE_SIZE);
+    g_assert(pwrite(fd, buf, PAGE_SIZE, 3 * PAGE_SIZE) == PAGE_SIZE);
+    g_assert_cmpint(qemu_file_fd_seek(f, 4 * PAGE_SIZE), ==, 0);
+    qemu_put_be32(f, 0xdeadbeef);
+    g_assert_cmpint(qemu_fclose(f), ==, 0);
+
+    fd = open(path, O_RDONLY);
+    g_assert(fd >= 0);
+    f = qemu_fdopen(fd, "rb");
+    g_assert_cmphex(qemu_get_be64(f), ==, 0x1122334455667788ULL);
+    g_assert_cmpint(qemu_file_fd_offset(f), ==, 8);
+    g_assert(pread(fd, buf, PAGE_SIZE, 3 * PAGE_SIZE) == PAGE_SIZE);
+    g_assert_cmpint(buf[0], ==, 0xaa);
+    g_assert_cmpint(buf[PAGE_SIZE - 1], ==, 0xaa);
+    g_assert_cmpint(qemu_file_fd_seek(f, 4 * PAGE_SIZE), ==, 0);
+    g_assert_cmphex(qemu_get_be32(f), ==, 0xdeadbeef);
+    g_assert_cmpint(qemu_file_fd_offset(f), ==, 4 * PAGE_SIZE + 4);
+    qemu_get_byte(f);
+    g_assert_cmpint(qemu_file_get_error(f), ==, -EIO);
+    qemu_fclose(f);
+
+    unlink(path);
+}
+
+/* Pages with their headers over a local socket, like the RAM stream of a
+ * migration without XBZRLE or compression.
+ */
+static void perf_stream(void)
+{
+    const int pages = 256 * 1024;
+    uint8_t *ram = ram_alloc();
+    int batch, i;
+
+    for (batch = 0; batch <= 1; batch++) {
+        TestReader r;
+        QEMUFile *f;
+        double s;
+
+        g_test_timer_start();
+        f = open_socket_file(&r, false, batch);
+        for (i = 0; i < pages; i++) {
+            qemu_put_be64(f, (uint64_t)i << 12 | 0x28);
+            qemu_put_buffer_async(f, ram + (i % RAM_PAGES) * PAGE_SIZE,
+                                  PAGE_SIZE);
+        }
+        close_socket_file(f, &r);
+        s = g_test_timer_elapsed();
+
+        g_assert_cmpint(r.len, ==, (uint64_t)pages * (PAGE_SIZE + 8));
+        g_byte_array_free(r.data, true);
+        g_test_message("%s: %d pages in %.3fs, %.0f MB/s",
+                       batch ? "batch" : "default", pages, s,
+                       r.len / s / (1024 * 1024));
+    }
+    g_free(ram);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qemu-file/stream/default", test_stream_default);
+    g_test_add_func("/qemu-file/stream/batch", test_stream_batch);
+    g_test_add_func("/qemu-file/stream/batch-off", test_stream_batch_off);
+    g_test_add_func("/qemu-file/fd-seek", test_fd_seek);
+    if (g_test_perf()) {
+        g_test_add_func("/qemu-file/perf/stream", perf_stream);
+    }
+    return g_test_run();
+}
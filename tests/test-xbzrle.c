@@ -179,6 +179,158 @@ static void test_encode_decode(void)
     }
 }
 
+/* Fill @test with a copy of @old where alternating unchanged and changed
+ * runs have random lengths up to @max_run.
+ */
+static void random_runs(const uint8_t *old, uint8_t *test, int max_run)
+{
+    bool changed = g_test_rand_int_range(0, 2);
+    int i = 0, j, len;
+
+    while (i < PAGE_SIZE) {
+        len = MIN(g_test_rand_int_range(1, max_run + 1), PAGE_SIZE - i);
+        for (j = i; j < i + len; j++) {
+            test[j] = changed ? old[j] ^ g_test_rand_int_range(1, 256)
+                              : old[j];
+        }
+        i += len;
+        changed = !changed;
+    }
+}
+
+/* Every variant must produce the same stream as the word-at-a-time one,
+ * including when it overflows.
+ */
+static void test_encode_decode_accel(void)
+{
+    enum { PAGES = 2000 };
+    static const int max_runs[] = { 1, 7, 40, 300, PAGE_SIZE };
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGES * PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    int *expected_len = g_new(int, PAGES);
+    int *dlen = g_new(int, PAGES);
+    const char *accel;
+    int i, rc;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    for (i = 0; i < PAGES; i++) {
+        random_runs(old, test + i * PAGE_SIZE,
+                    max_runs[i % ARRAY_SIZE(max_runs)]);
+        dlen[i] = i % 3 ? PAGE_SIZE : g_test_rand_int_range(2, PAGE_SIZE);
+    }
+
+    /* The word-at-a-time variant is the slowest one and the reference */
+    while (strcmp(xbzrle_encode_buffer_accel(), "long")) {
+        test_xbzrle_encode_buffer_next_accel();
+    }
+    for (i = 0; i < PAGES; i++) {
+        expected_len[i] = xbzrle_encode_buffer(old, test + i * PAGE_SIZE,
+                                               PAGE_SIZE,
+                                               expected + i * PAGE_SIZE,
+                                               dlen[i]);
+    }
+    g_assert(!test_xbzrle_encode_buffer_next_accel());
+
+    do {
+        accel = xbzrle_encode_buffer_accel();
+        g_test_message("testing %s", accel);
+        for (i = 0; i < PAGES; i++) {
+            rc = xbzrle_encode_buffer(old, test + i * PAGE_SIZE, PAGE_SIZE,
+                                      compressed, dlen[i]);
+            g_assert_cmpint(rc, ==, expected_len[i]);
+            if (rc <= 0) {
+                continue;
+            }
+            g_assert(memcmp(compressed, expected + i * PAGE_SIZE, rc) == 0);
+
+            memcpy(buffer, old, PAGE_SIZE);
+            g_assert_cmpint(xbzrle_decode_buffer(compressed, rc, buffer,
+                                                 PAGE_SIZE), <=, PAGE_SIZE);
+            g_assert(memcmp(buffer, test + i * PAGE_SIZE, PAGE_SIZE) == 0);
+        }
+    } while (test_xbzrle_encode_buffer_next_accel());
+
+    g_free(dlen);
+    g_free(expected_len);
+    g_free(buffer);
+    g_free(compressed);
+    g_free(expected);
+    g_free(test);
+    g_free(old);
+}
+
+static void perf_encode_decode(void)
+{
+    enum { PAGES = 256 };
+    static const int max_runs[] = { 8, 64, 512 };
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGES * PAGE_SIZE);
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    int *dlen = g_new(int, PAGES);
+    int i, r;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+
+    for (r = 0; r < ARRAY_SIZE(max_runs); r++) {
+        uint64_t bytes = 0;
+        double duration;
+
+        for (i = 0; i < PAGES; i++) {
+            random_runs(old, test + i * PAGE_SIZE, max_runs[r]);
+        }
+
+        do {
+            const char *accel = xbzrle_encode_buffer_accel();
+
+            bytes = 0;
+            g_test_timer_start();
+            do {
+                for (i = 0; i < PAGES; i++) {
+                    dlen[i] = xbzrle_encode_buffer(old, test + i * PAGE_SIZE,
+                                                   PAGE_SIZE,
+                                                   compressed + i * PAGE_SIZE,
+                                                   PAGE_SIZE);
+                }
+                bytes += PAGES * PAGE_SIZE;
+                duration = g_test_timer_elapsed();
+            } while (duration < 0.5);
+
+            g_test_message("runs <= %3d: encode %-4s %6.2f GB/s",
+                           max_runs[r], accel, bytes / duration / 1e9);
+        } while (test_xbzrle_encode_buffer_next_accel());
+
+        bytes = 0;
+        g_test_timer_start();
+        do {
+            for (i = 0; i < PAGES; i++) {
+                if (dlen[i] > 0) {
+                    xbzrle_decode_buffer(compressed + i * PAGE_SIZE, dlen[i],
+                                         buffer, PAGE_SIZE);
+                }
+            }
+            bytes += PAGES * PAGE_SIZE;
+            duration = g_test_timer_elapsed();
+        } while (duration < 0.5);
+
+        g_test_message("runs <= %3d: decode      %6.2f GB/s",
+                       max_runs[r], bytes / duration / 1e9);
+    }
+
+    g_free(dlen);
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+    g_free(old);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +343,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf", perf_encode_decode);
+    }
 
     return g_test_run();
 }
@@ -1600,6 +1600,132 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 
 #endif /* AES_ASM */
 
+#ifdef CONFIG_AESNI_OPT
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+/* The round keys produced by AES_set_{en,de}crypt_key are stored as
+ * big-endian words; the AES-NI instructions want them as byte strings.
+ * The decryption schedule already is the "equivalent inverse cipher"
+ * one (reversed, with InvMixColumns applied to the inner round keys),
+ * which is exactly what AESDEC/AESDECLAST expect.
+ */
+static inline void aesni_load_key(__m128i *rk, const AES_KEY *key)
+{
+    int i;
+
+    for (i = 0; i <= key->rounds; i++) {
+        const uint32_t *w = &key->rd_key[4 * i];
+        rk[i] = _mm_set_epi32(bswap32(w[3]), bswap32(w[2]),
+                              bswap32(w[1]), bswap32(w[0]));
+    }
+}
+
+static inline __m128i aesni_encrypt_block(__m128i x, const __m128i *rk,
+                                          int rounds)
+{
+    int i;
+
+    x = _mm_xor_si128(x, rk[0]);
+    for (i = 1; i < rounds; i++) {
+        x = _mm_aesenc_si128(x, rk[i]);
+    }
+    return _mm_aesenclast_si128(x, rk[rounds]);
+}
+
+static void aesni_cbc_encrypt(const unsigned char *in, unsigned char *out,
+                              unsigned long len, const AES_KEY *key,
+                              unsigned char *ivec)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i iv = _mm_loadu_si128((const __m128i *)ivec);
+
+    aesni_load_key(rk, key);
+    for (; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), iv);
+
+        iv = aesni_encrypt_block(x, rk, key->rounds);
+        _mm_storeu_si128((__m128i *)out, iv);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)ivec, iv);
+}
+
+/* CBC decryption has no dependency between blocks, so keep four of them
+ * in flight to hide the latency of the AESDEC instruction.
+ */
+static void aesni_cbc_decrypt(const unsigned char *in, unsigned char *out,
+                              unsigned long len, const AES_KEY *key,
+                              unsigned char *ivec)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i iv = _mm_loadu_si128((const __m128i *)ivec);
+    int rounds = key->rounds;
+    int i;
+
+    aesni_load_key(rk, key);
+    for (; len >= 4 * AES_BLOCK_SIZE; len -= 4 * AES_BLOCK_SIZE) {
+        __m128i c0 = _mm_loadu_si128((const __m128i *)in);
+        __m128i c1 = _mm_loadu_si128((const __m128i *)in + 1);
+        __m128i c2 = _mm_loadu_si128((const __m128i *)in + 2);
+        __m128i c3 = _mm_loadu_si128((const __m128i *)in + 3);
+        __m128i x0 = _mm_xor_si128(c0, rk[0]);
+        __m128i x1 = _mm_xor_si128(c1, rk[0]);
+        __m128i x2 = _mm_xor_si128(c2, rk[0]);
+        __m128i x3 = _mm_xor_si128(c3, rk[0]);
+
+        for (i = 1; i < rounds; i++) {
+            x0 = _mm_aesdec_si128(x0, rk[i]);
+            x1 = _mm_aesdec_si128(x1, rk[i]);
+            x2 = _mm_aesdec_si128(x2, rk[i]);
+            x3 = _mm_aesdec_si128(x3, rk[i]);
+        }
+        x0 = _mm_xor_si128(_mm_aesdeclast_si128(x0, rk[rounds]), iv);
+        x1 = _mm_xor_si128(_mm_aesdeclast_si128(x1, rk[rounds]), c0);
+        x2 = _mm_xor_si128(_mm_aesdeclast_si128(x2, rk[rounds]), c1);
+        x3 = _mm_xor_si128(_mm_aesdeclast_si128(x3, rk[rounds]), c2);
+        iv = c3;
+
+        _mm_storeu_si128((__m128i *)out, x0);
+        _mm_storeu_si128((__m128i *)out + 1, x1);
+        _mm_storeu_si128((__m128i *)out + 2, x2);
+        _mm_storeu_si128((__m128i *)out + 3, x3);
+        in += 4 * AES_BLOCK_SIZE;
+        out += 4 * AES_BLOCK_SIZE;
+    }
+    for (; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE) {
+        __m128i c = _mm_loadu_si128((const __m128i *)in);
+        __m128i x = _mm_xor_si128(c, rk[0]);
+
+        for (i = 1; i < rounds; i++) {
+            x = _mm_aesdec_si128(x, rk[i]);
+        }
+        x = _mm_xor_si128(_mm_aesdeclast_si128(x, rk[rounds]), iv);
+        iv = c;
+        _mm_storeu_si128((__m128i *)out, x);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)ivec, iv);
+}
+#pragma GCC pop_options
+
+static bool aesni_available;
+
+static void __attribute__((constructor)) init_aesni(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        aesni_available = (c & bit_AES) && (d & bit_SSE2);
+    }
+}
+#endif /* CONFIG_AESNI_OPT */
+
 void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc)
@@ -1611,6 +1737,18 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 
 	assert(in && out && key && ivec);
 
+#ifdef CONFIG_AESNI_OPT
+	/* Partial trailing blocks are rare, leave them to the C code */
+	if (aesni_available && (len % AES_BLOCK_SIZE) == 0) {
+		if (enc) {
+			aesni_cbc_encrypt(in, out, len, key, ivec);
+		} else {
+			aesni_cbc_decrypt(in, out, len, key, ivec);
+		}
+		return;
+	}
+#endif
+
 	if (enc) {
 		while (len >= AES_BLOCK_SIZE) {
 			for(n=0; n < AES_BLOCK_SIZE; ++n)
@@ -167,45 +167,30 @@ int qemu_fdatasync(int fd)
 }
 
 /*
- * Searches for an area with non-zero content in a buffer
- *
- * Attention! The len must be a multiple of
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * and addr must be a multiple of sizeof(VECTYPE) due to
- * restriction of optimizations in this function.
- *
- * can_use_buffer_find_nonzero_offset() can be used to check
- * these requirements.
+ * Searching for non-zero bytes
  *
- * The return value is the offset of the non-zero area rounded
- * down to a multiple of sizeof(VECTYPE) for the first
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
- *
- * If the buffer is all zero the return value is equal to len.
+ * The scan itself is done by an accelerated function working on whole
+ * chunks of an aligned buffer; buffer_find_nonzero_offset() takes care of
+ * the unaligned head and tail, so it accepts any buffer and length.
  */
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+typedef struct BufferZeroAccel {
+    const char *name;
+    /* Returns the offset of the first chunk containing a non-zero byte, or
+     * len.  buf is aligned to @align and len is a multiple of @chunk. */
+    size_t (*find)(const void *buf, size_t len);
+    size_t align;
+    size_t chunk;
+    bool available;
+} BufferZeroAccel;
+
+static size_t find_nonzero_offset_vector(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
-    if (!len) {
-        return 0;
-    }
-
-    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
-        if (!ALL_EQ(p[i], zero)) {
-            return i * sizeof(VECTYPE);
-        }
-    }
-
-    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
-         i < len / sizeof(VECTYPE);
+    for (i = 0; i < len / sizeof(VECTYPE);
          i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
         VECTYPE tmp0 = p[i + 0] | p[i + 1];
         VECTYPE tmp1 = p[i + 2] | p[i + 3];
@@ -221,44 +206,201 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
-/*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m256i); i += 4) {
+        __m256i tmp = _mm256_or_si256(_mm256_or_si256(p[i + 0], p[i + 1]),
+                                      _mm256_or_si256(p[i + 2], p[i + 3]));
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m256i);
+}
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static size_t find_nonzero_offset_avx512f(const void *buf, size_t len)
+{
+    const __m512i *p = buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m512i); i += 4) {
+        __m512i tmp = _mm512_or_si512(_mm512_or_si512(p[i + 0], p[i + 1]),
+                                      _mm512_or_si512(p[i + 2], p[i + 3]));
+        if (_mm512_test_epi64_mask(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m512i);
+}
+#pragma GCC pop_options
+#endif
+
+/* Fastest first */
+static BufferZeroAccel buffer_zero_accels[] = {
+#ifdef CONFIG_AVX512F_OPT
+    { "avx512f", find_nonzero_offset_avx512f, 64, 4 * 64, false },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", find_nonzero_offset_avx2, 32, 4 * 32, false },
+#endif
+    { "vector", find_nonzero_offset_vector, sizeof(VECTYPE),
+      BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE), true },
+};
+
+static BufferZeroAccel *buffer_zero_accel =
+    &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1];
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+#include <cpuid.h>
+
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE     (1 << 27)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2        (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F     (1 << 16)
+#endif
+
+/* XCR0 bits for the SSE, AVX and AVX-512 register state */
+#define XCR0_YMM        0x06
+#define XCR0_ZMM        0xe6
+
+static void __attribute__((constructor)) init_buffer_zero_accel(void)
+{
+    unsigned a, b, c, d;
+    uint32_t xcr0_lo = 0, xcr0_hi = 0;
+    int max = __get_cpuid_max(0, 0);
+    int i;
+
+    if (max < 7) {
+        return;
+    }
+
+    /* The OS must save the wider registers on context switch */
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return;
+    }
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+
+    __cpuid_count(7, 0, a, b, c, d);
+    for (i = 0; i < ARRAY_SIZE(buffer_zero_accels); i++) {
+        BufferZeroAccel *accel = &buffer_zero_accels[i];
+
+#ifdef CONFIG_AVX512F_OPT
+        if (accel->find == find_nonzero_offset_avx512f) {
+            accel->available = (b & bit_AVX512F) &&
+                               (xcr0_lo & XCR0_ZMM) == XCR0_ZMM;
+        }
+#endif
+#ifdef CONFIG_AVX2_OPT
+        if (accel->find == find_nonzero_offset_avx2) {
+            accel->available = (b & bit_AVX2) &&
+                               (xcr0_lo & XCR0_YMM) == XCR0_YMM;
+        }
+#endif
+    }
+
+    for (i = 0; !buffer_zero_accels[i].available; i++) {
+        /* the last entry is always available */
+    }
+    buffer_zero_accel = &buffer_zero_accels[i];
+}
+#endif
+
+const char *buffer_find_nonzero_offset_accel(void)
+{
+    return buffer_zero_accel->name;
+}
+
+/* Switch to the next slower variant.  After the slowest one, go back to the
+ * fastest and return false, so that callers can loop over all of them.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+bool test_buffer_find_nonzero_offset_next_accel(void)
 {
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
+    BufferZeroAccel *end = &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels)];
+    BufferZeroAccel *accel;
 
+    for (accel = buffer_zero_accel + 1; accel < end; accel++) {
+        if (accel->available) {
+            buffer_zero_accel = accel;
+            return true;
+        }
+    }
+
+    for (accel = buffer_zero_accels; !accel->available; accel++) {
+        /* the last entry is always available */
+    }
+    buffer_zero_accel = accel;
+    return false;
+}
+
+static size_t find_nonzero_byte(const unsigned char *p, size_t len)
+{
     size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
 
-    /* use vector optimized zero check if possible */
-    if (can_use_buffer_find_nonzero_offset(buf, len)) {
-        return buffer_find_nonzero_offset(buf, len) == len;
+    for (i = 0; i < len && !p[i]; i++) {
+        /* nothing */
     }
+    return i;
+}
 
-    assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
+/*
+ * Searches for an area with non-zero content in a buffer
+ *
+ * Returns the offset of the first non-zero byte, or len if the buffer is
+ * all zero.  buf and len need not be aligned, but only the part that is
+ * aligned to the vector size is scanned with vector instructions.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    const BufferZeroAccel *accel = buffer_zero_accel;
+    const unsigned char *p = buf;
+    size_t head, body, off;
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+    head = MIN(len, -(uintptr_t)p & (accel->align - 1));
+    off = find_nonzero_byte(p, head);
+    if (off < head) {
+        return off;
+    }
 
-        if (d0 || d1 || d2 || d3) {
-            return false;
+    body = QEMU_ALIGN_DOWN(len - head, accel->chunk);
+    if (body) {
+        off = accel->find(p + head, body);
+        if (off < body) {
+            return head + off + find_nonzero_byte(p + head + off, body - off);
         }
     }
 
-    return true;
+    off = head + body;
+    return off + find_nonzero_byte(p + off, len - off);
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_find_nonzero_offset(buf, len) == len;
 }
 
 #ifndef _WIN32
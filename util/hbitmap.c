@@ -371,6 +371,102 @@ void hbitmap_free(HBitmap *hb)
     g_free(hb);
 }
 
+/* Number of longs in each level for a bitmap of @size bits */
+static size_t hb_level_size(const HBitmap *hb, int level)
+{
+    uint64_t size = hb->size;
+    int i;
+
+    for (i = HBITMAP_LEVELS; i-- > level; ) {
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    }
+    return size;
+}
+
+/* Recompute the upper levels and the count from the last level */
+static void hb_rebuild(HBitmap *hb)
+{
+    size_t size = hb_level_size(hb, HBITMAP_LEVELS - 1);
+    unsigned long *last = hb->levels[HBITMAP_LEVELS - 1];
+    size_t j;
+    int i;
+
+    /* Drop bits past the end, they must never be set */
+    if (hb->size & (BITS_PER_LONG - 1)) {
+        last[size - 1] &= (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+
+    hb->count = 0;
+    for (j = 0; j < size; j++) {
+        hb->count += ctpopl(last[j]);
+    }
+
+    for (i = HBITMAP_LEVELS - 1; i > 0; i--) {
+        unsigned long *cur = hb->levels[i];
+        unsigned long *up = hb->levels[i - 1];
+
+        memset(up, 0, hb_level_size(hb, i - 1) * sizeof(unsigned long));
+        for (j = 0; j < size; j++) {
+            if (cur[j]) {
+                up[j >> BITS_PER_LEVEL] |= 1UL << (j & (BITS_PER_LONG - 1));
+            }
+        }
+        size = hb_level_size(hb, i - 1);
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+}
+
+void hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    size_t size = hb_level_size(a, HBITMAP_LEVELS - 1);
+    size_t j;
+
+    assert(a->size == b->size && a->granularity == b->granularity);
+    for (j = 0; j < size; j++) {
+        a->levels[HBITMAP_LEVELS - 1][j] |= b->levels[HBITMAP_LEVELS - 1][j];
+    }
+    hb_rebuild(a);
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb)
+{
+    return DIV_ROUND_UP(hb->size, 64) * 8;
+}
+
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf)
+{
+    const unsigned long *last = hb->levels[HBITMAP_LEVELS - 1];
+    size_t words = hb_level_size(hb, HBITMAP_LEVELS - 1);
+    uint64_t len = hbitmap_serialization_size(hb);
+    uint64_t i;
+
+    for (i = 0; i < len; i++) {
+        size_t w = i / sizeof(unsigned long);
+
+        buf[i] = w < words ?
+                 last[w] >> ((i % sizeof(unsigned long)) * 8) : 0;
+    }
+}
+
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf)
+{
+    unsigned long *last = hb->levels[HBITMAP_LEVELS - 1];
+    size_t words = hb_level_size(hb, HBITMAP_LEVELS - 1);
+    uint64_t len = hbitmap_serialization_size(hb);
+    uint64_t i;
+
+    memset(last, 0, words * sizeof(unsigned long));
+    for (i = 0; i < len; i++) {
+        size_t w = i / sizeof(unsigned long);
+
+        if (w < words) {
+            last[w] |= (unsigned long)buf[i] <<
+                       ((i % sizeof(unsigned long)) * 8);
+        }
+    }
+    hb_rebuild(hb);
+}
+
 HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
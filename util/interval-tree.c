@@ -0,0 +1,186 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <assert.h>
+#include "qemu/interval-tree.h"
+
+/* Nodes are ordered by start; equal starts are told apart by address so that
+ * removal finds exactly the node it was given.
+ */
+static inline bool node_before(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start;
+    }
+    return (uintptr_t)a < (uintptr_t)b;
+}
+
+static inline void node_update(IntervalTreeNode *n)
+{
+    uint64_t end = n->end;
+
+    if (n->left && n->left->subtree_end > end) {
+        end = n->left->subtree_end;
+    }
+    if (n->right && n->right->subtree_end > end) {
+        end = n->right->subtree_end;
+    }
+    n->subtree_end = end;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+static IntervalTreeNode *treap_insert(IntervalTreeNode *t,
+                                      IntervalTreeNode *node)
+{
+    if (!t) {
+        return node;
+    }
+
+    if (node_before(node, t)) {
+        t->left = treap_insert(t->left, node);
+        if (t->left->priority > t->priority) {
+            return rotate_right(t);
+        }
+    } else {
+        t->right = treap_insert(t->right, node);
+        if (t->right->priority > t->priority) {
+            return rotate_left(t);
+        }
+    }
+    node_update(t);
+    return t;
+}
+
+/* Join two treaps where every node of @a sorts before every node of @b */
+static IntervalTreeNode *treap_merge(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+
+    if (a->priority > b->priority) {
+        a->right = treap_merge(a->right, b);
+        node_update(a);
+        return a;
+    } else {
+        b->left = treap_merge(a, b->left);
+        node_update(b);
+        return b;
+    }
+}
+
+static IntervalTreeNode *treap_remove(IntervalTreeNode *t,
+                                      IntervalTreeNode *node)
+{
+    assert(t);
+
+    if (t == node) {
+        return treap_merge(t->left, t->right);
+    }
+
+    if (node_before(node, t)) {
+        t->left = treap_remove(t->left, node);
+    } else {
+        t->right = treap_remove(t->right, node);
+    }
+    node_update(t);
+    return t;
+}
+
+static IntervalTreeNode *treap_find(IntervalTreeNode *t,
+                                    uint64_t start, uint64_t end,
+                                    IntervalTreeMatchFunc *match,
+                                    void *opaque)
+{
+    IntervalTreeNode *found;
+
+    /* Nothing in this subtree reaches past @start */
+    if (!t || t->subtree_end <= start) {
+        return NULL;
+    }
+
+    found = treap_find(t->left, start, end, match, opaque);
+    if (found) {
+        return found;
+    }
+
+    /* This node and everything to its right start at or after @end */
+    if (t->start >= end) {
+        return NULL;
+    }
+
+    if (start < t->end && (!match || match(t, opaque))) {
+        return t;
+    }
+
+    return treap_find(t->right, start, end, match, opaque);
+}
+
+/* xorshift32, priorities only need to be reasonably random */
+static uint32_t next_priority(IntervalTree *tree)
+{
+    uint32_t x = tree->seed ? tree->seed : 0x9e3779b9;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    tree->seed = x;
+    return x;
+}
+
+void interval_tree_insert(IntervalTree *tree, IntervalTreeNode *node,
+                          uint64_t start, uint64_t end)
+{
+    node->start = start;
+    node->end = end;
+    node->subtree_end = end;
+    node->priority = next_priority(tree);
+    node->left = NULL;
+    node->right = NULL;
+
+    tree->root = treap_insert(tree->root, node);
+}
+
+void interval_tree_remove(IntervalTree *tree, IntervalTreeNode *node)
+{
+    tree->root = treap_remove(tree->root, node);
+    node->left = NULL;
+    node->right = NULL;
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTree *tree,
+                                     uint64_t start, uint64_t end,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque)
+{
+    return treap_find(tree->root, start, end, match, opaque);
+}